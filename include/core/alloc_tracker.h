@@ -0,0 +1,92 @@
+#ifndef ALLOC_TRACKER_H
+#define ALLOC_TRACKER_H
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include <opencv2/core.hpp>
+
+namespace core
+{
+
+// cv::Mat allocations counted per owner, normally the filter running on the
+// calling thread. While enabled it is OpenCV's default allocator and takes
+// the memory from the standard one. Every Mat remembers the owner that
+// allocated it, so live and peak bytes stay right when the Mat is released
+// somewhere else. When disabled, OpenCV's own allocator is back in place.
+class alloc_tracker final : public cv::MatAllocator
+{
+public:
+  struct stats
+  {
+    std::string owner;
+    // scopes entered for this owner, i.e. filter calls
+    std::uint64_t calls = 0;
+    std::uint64_t allocations = 0;
+    std::uint64_t bytes = 0;
+    std::size_t live = 0;
+    std::size_t peak = 0;
+  };
+
+  // allocations on this thread go to owner until the scope ends
+  class scope
+  {
+  public:
+    explicit scope (const char *owner);
+    ~scope ();
+
+    scope (const scope &) = delete;
+    scope &operator= (const scope &) = delete;
+
+    // made on this thread since the scope began; work handed to other
+    // threads only shows up in the owner's stats
+    std::uint64_t allocations () const;
+    std::uint64_t bytes () const;
+    // the same as trace args, "allocs=N alloc_bytes=M"
+    std::string args () const;
+
+  private:
+    const char *previous;
+    std::uint64_t allocations_start;
+    std::uint64_t bytes_start;
+  };
+
+  static alloc_tracker &instance ();
+
+  void enable (bool on);
+  bool is_enabled () const { return enabled.load (std::memory_order_relaxed); }
+  // counters back to zero, except the live bytes of Mats still around
+  void reset ();
+  std::vector<stats> snapshot () const;
+
+  // owner of the calling thread, nullptr outside any scope; code that runs
+  // a caller's work on other threads carries it over with set_owner ()
+  static const char *owner ();
+  static const char *set_owner (const char *owner);
+
+  cv::UMatData *allocate (int dims, const int *sizes, int type, void *data, std::size_t *step,
+                          cv::AccessFlag flags, cv::UMatUsageFlags usage) const override;
+  bool allocate (cv::UMatData *data, cv::AccessFlag flags, cv::UMatUsageFlags usage) const override;
+  void deallocate (cv::UMatData *data) const override;
+
+private:
+  alloc_tracker () = default;
+
+  stats &find (const char *owner) const;
+
+  std::atomic<bool> enabled { false };
+  cv::MatAllocator *previous_default = nullptr;
+
+  mutable std::mutex mutex;
+  // Mats point at their owner's entry, so entries never move
+  mutable std::deque<stats> owners;
+};
+
+}
+
+#endif
@@ -1,11 +1,25 @@
 #ifndef CV_ENGINE_H
 #define CV_ENGINE_H
 
+#include <atomic>
+#include <functional>
+#include <memory>
+
 #include <QImage>
 
 #include <opencv2/opencv.hpp>
 
 #include "filters/filter.h"
+#include "core/recorder.h"
+#include "core/session_log.h"
+#include "core/mapped_source.h"
+#include "core/sequence_source.h"
+#include "core/shm_sink.h"
+#include "core/pipe_source.h"
+#include "core/tile_cache.h"
+#include "core/pipeline_graph.h"
+#include "core/thread_pool.h"
+#include "core/alloc_tracker.h"
 
 namespace core
 {
@@ -13,7 +27,7 @@ namespace core
 class cv_engine
 {
 public:
-  enum class source { image, video, camera };
+  enum class source { image, video, camera, mapped, sequence, pipe };
 
   cv_engine () = default;
   ~cv_engine () { close (); }
@@ -28,27 +42,156 @@ public:
   void set_test_image (const cv::Mat &bgr);
   void set_test_video_file (const QString &path);
   void set_camera_index (int index);
+  // camera frames stay YUV (YUYV, UYVY, NV12, NV21, I420): the pipeline gets
+  // the luma plane, and the colour frame is only converted when a stage
+  // that needs colour runs. Takes effect on the next open ()
+  void set_native_yuv (bool on);
+  bool is_native_yuv () const { return native_yuv; }
+  // camera and video MJPEG is decoded at 1/2, 1/4 or 1/8 scale as long as
+  // the frame still covers this size; 0 decodes full resolution. Takes
+  // effect on the next open ()
+  void set_decode_limit (int width, int height);
+  // raw BGR needs the frame size, Y4M carries its own
+  void set_mapped_file (const QString &path, int width = 0, int height = 0);
+  // directory or glob; a non-zero size allows reduced decoding down to it
+  void set_image_sequence (const QString &pattern, int max_width = 0, int max_height = 0);
+  // "-" reads stdin
+  void set_pipe (const QString &path, int width, int height, pipe_source::pixel_format fmt);
+
+  enum class open_state { closed, opening, opened, failed };
+  struct open_status
+  {
+    open_state state = open_state::closed;
+    // progress or the error, empty once opened
+    QString message;
+  };
 
   bool open ();
+  // open () without blocking the caller: the camera and video sources open
+  // their capture on a background thread and grab () returns false until
+  // it is ready; the other sources open right away
+  void open_async ();
+  open_status source_status () const { return status; }
   void close ();
   bool grab ();
 
+  // add_filter appends after the current output node; graph () gives
+  // access to branches, blends and merges
   void clear_filters ();
   void add_filter (std::shared_ptr<filters::filter> filter);
   std::shared_ptr<filters::filter> find_filter (const char *id);
+  pipeline_graph &graph () { return pipeline; }
+  pipeline_graph clone_graph () const;
 
   QImage process ();
+  // process () may hand back a pyramid level of the result as long as it
+  // is at least this large; 0 keeps full resolution
+  void set_preview_limit (int width, int height);
+  // full-resolution result of the current frame, also fed to the recorder
+  // and shm output
+  cv::Mat process_frame ();
+  // frames run filter by filter, see pipeline_graph::run_batch; results go
+  // to the sinks in order. Independent of the current source frame.
+  std::vector<cv::Mat> process_batch (const std::vector<cv::Mat> &frames);
+
+  // reprocess only changed tiles of a local linear chain, the rest of the
+  // previous output is reused
+  void set_incremental (bool on);
+  bool is_incremental () const { return incremental; }
+  double tile_reuse () const { return tiles.reused_fraction (); }
+
+  // recording of the processed stream
+  bool start_recording (const QString &path, double fps);
+  void stop_recording ();
+  bool is_recording () const;
+  recorder::stats recording_stats () const;
+
+  // every rendered frame with its input, the chain and each parameter
+  // change, so that session_log::replay can rerun the session headless
+  bool start_session_log (const QString &path);
+  void stop_session_log ();
+  bool is_session_logging () const;
+
+  // processed frames for other processes, see core::shm_reader
+  bool start_shm_output (const QString &name, int slots = 4);
+  void stop_shm_output ();
+  bool is_shm_output () const;
+
+  // per-frame timeline of grab, filters, conversion and paint, written as
+  // Chrome trace-event JSON (chrome://tracing, ui.perfetto.dev)
+  void set_tracing (bool on);
+  bool is_tracing () const;
+  bool dump_trace (const QString &path) const;
+
+  // cv::Mat allocations, bytes and peak live memory per filter, see
+  // core::alloc_tracker; per-call counts also go into the trace
+  void set_alloc_tracking (bool on);
+  bool is_alloc_tracking () const;
+  std::vector<alloc_tracker::stats> alloc_stats () const;
+  void reset_alloc_stats ();
 
 private:
+  cv::Mat render (filters::frame_context &ctx);
+  bool adopt_capture ();
+  void configure_capture ();
+  void reduce_mjpeg ();
+  bool wrap_yuv (const cv::Mat &raw);
+
   source src = source::image;
   cv::Mat test_bgr;
   QString video_path;
   int camera_index = 0;
-  cv::VideoCapture capture;
-
+  bool native_yuv = false;
+  // fourcc and size of the raw camera frames, 0 when the backend converts
+  int yuv_fourcc = 0;
+  int yuv_width = 0;
+  int yuv_height = 0;
+  int decode_width = 0;
+  int decode_height = 0;
+  // IMREAD_REDUCED_COLOR_* while the capture hands out compressed MJPEG,
+  // 0 when it decodes itself
+  int mjpeg_flags = 0;
+  // null while closed or still opening
+  std::unique_ptr<cv::VideoCapture> capture;
+  struct open_job
+  {
+    std::atomic<bool> done { false };
+    std::unique_ptr<cv::VideoCapture> capture;
+    QString error;
+  };
+  std::shared_ptr<open_job> pending;
+  open_status status;
+  QString mapped_path;
+  int mapped_width = 0;
+  int mapped_height = 0;
+  mapped_source mapped;
+  QString sequence_pattern;
+  int sequence_width = 0;
+  int sequence_height = 0;
+  sequence_source sequence;
+  QString pipe_path;
+  int pipe_width = 0;
+  int pipe_height = 0;
+  pipe_source::pixel_format pipe_format = pipe_source::pixel_format::bgr24;
+  pipe_source pipe;
+
+  // the luma plane when current_color is set
   cv::Mat current_bgr;
+  std::function<cv::Mat ()> current_color;
+  // where a session log finds this frame again, see session_log::begin_frame
+  std::string current_source;
+
+  pipeline_graph pipeline;
+
+  int preview_width = 0;
+  int preview_height = 0;
+
+  bool incremental = false;
+  tile_cache tiles;
 
-  std::vector<std::shared_ptr<filters::filter>> pipeline;
+  recorder rec;
+  session_log session;
+  shm_sink shm;
 };
 
 }
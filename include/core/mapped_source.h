@@ -0,0 +1,57 @@
+#ifndef MAPPED_SOURCE_H
+#define MAPPED_SOURCE_H
+
+#include <cstddef>
+#include <string>
+
+#include <opencv2/opencv.hpp>
+
+namespace core
+{
+
+// frames straight out of a memory-mapped file: raw packed BGR (size given
+// by the caller) or Y4M (4:2:0 or mono, size taken from the header)
+class mapped_source
+{
+public:
+  mapped_source () = default;
+  ~mapped_source () { close (); }
+
+  mapped_source (const mapped_source &) = delete;
+  mapped_source &operator= (const mapped_source &) = delete;
+
+  bool open (const std::string &path, int width = 0, int height = 0);
+  void close ();
+  bool is_open () const { return base != nullptr; }
+
+  // loops at the end of the file; raw BGR frames are read-only headers
+  // into the mapping and stay valid until close ()
+  bool read (cv::Mat &frame);
+
+  int get_width () const { return width; }
+  int get_height () const { return height; }
+
+private:
+  enum class format { bgr, i420, mono };
+
+  bool parse_y4m ();
+  const unsigned char *next_payload ();
+  void prefetch (std::size_t offset, std::size_t bytes) const;
+
+  int fd = -1;
+  unsigned char *base = nullptr;
+  std::size_t length = 0;
+
+  format fmt = format::bgr;
+  int width = 0;
+  int height = 0;
+  std::size_t frame_bytes = 0;
+  std::size_t first_frame = 0;
+  std::size_t pos = 0;
+
+  cv::Mat converted;
+};
+
+}
+
+#endif
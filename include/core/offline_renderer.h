@@ -0,0 +1,85 @@
+#ifndef OFFLINE_RENDERER_H
+#define OFFLINE_RENDERER_H
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include <opencv2/opencv.hpp>
+
+#include "core/pipeline_graph.h"
+
+namespace core
+{
+
+// Renders a video file through the filter graph as fast as possible. A decoder
+// thread reads ahead; groups of frames run as tasks of the shared pool, each
+// on an idle clone of the graph (filter-major, see pipeline_graph::run_batch),
+// and the results are written back in source order.
+class offline_renderer
+{
+public:
+  struct progress
+  {
+    std::uint64_t decoded = 0;
+    std::uint64_t written = 0;
+    std::uint64_t total = 0;
+    double fps = 0.0;
+  };
+
+  // at most workers groups run at once, <= 0 picks the shared pool's size;
+  // batch frames go through each filter together
+  explicit offline_renderer (const pipeline_graph &graph, int workers = 0, int batch = 4);
+
+  offline_renderer (const offline_renderer &) = delete;
+  offline_renderer &operator= (const offline_renderer &) = delete;
+
+  // blocks until the whole clip is written, cancelled or failed
+  bool render (const std::string &in_path, const std::string &out_path);
+  void cancel ();
+
+  bool is_running () const { return running; }
+  progress get_progress () const;
+
+private:
+  struct job
+  {
+    std::uint64_t seq = 0;
+    cv::Mat frame;
+  };
+
+  void decode (cv::VideoCapture &capture);
+  // hands waiting groups to the pool while graphs are idle; called with
+  // mutex held
+  void dispatch ();
+  void work (std::size_t graph, std::vector<std::uint64_t> seqs, std::vector<cv::Mat> frames);
+
+  std::vector<pipeline_graph> graphs;
+  std::vector<std::size_t> idle;
+
+  std::mutex mutex;
+  std::condition_variable changed;
+  std::deque<job> pending;
+  std::map<std::uint64_t, cv::Mat> done;
+  bool decode_finished = false;
+  std::uint64_t next_write = 0;
+  std::size_t window = 0;
+  std::size_t batch = 1;
+
+  std::atomic<bool> running { false };
+  std::atomic<bool> cancelled { false };
+  std::atomic<std::uint64_t> decoded { 0 };
+  std::atomic<std::uint64_t> written { 0 };
+  std::atomic<std::uint64_t> total { 0 };
+  std::atomic<double> fps { 0.0 };
+};
+
+}
+
+#endif
@@ -0,0 +1,73 @@
+#ifndef PIPE_SOURCE_H
+#define PIPE_SOURCE_H
+
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+
+#include <opencv2/opencv.hpp>
+
+namespace core
+{
+
+// fixed-size raw frames from stdin ("-") or a named FIFO, e.g.
+// ffmpeg -i in.mp4 -f rawvideo -pix_fmt bgr24 - | FilterCV --pipe - ...
+class pipe_source
+{
+public:
+  // names follow ffmpeg's -pix_fmt
+  enum class pixel_format { bgr24, rgb24, gray, yuv420p };
+  static bool parse_format (const std::string &name, pixel_format &fmt);
+
+  pipe_source () = default;
+  ~pipe_source () { close (); }
+
+  pipe_source (const pipe_source &) = delete;
+  pipe_source &operator= (const pipe_source &) = delete;
+
+  bool open (const std::string &path, int width, int height, pixel_format fmt);
+  void close ();
+  bool is_open () const { return reader.joinable (); }
+  bool at_end () const;
+
+  // never waits: false until the reader has a complete frame. bgr24
+  // frames point into the read buffer and stay valid until the next read
+  bool read (cv::Mat &frame);
+
+private:
+  struct buffer_free { void operator() (unsigned char *p) const; };
+  using buffer = std::unique_ptr<unsigned char, buffer_free>;
+
+  void read_loop ();
+  bool fill (unsigned char *dst);
+
+  std::string path;
+  int width = 0;
+  int height = 0;
+  pixel_format fmt = pixel_format::bgr24;
+  std::size_t frame_bytes = 0;
+
+  int fd = -1;
+  int stop_fd = -1;
+  std::thread reader;
+
+  // two page-aligned buffers: one is filled while the other is processed
+  buffer buffers[2];
+  mutable std::mutex mutex;
+  std::condition_variable freed;
+  std::deque<int> free_list;
+  std::deque<int> ready;
+  int held = -1;
+  bool eof = false;
+  bool stopping = false;
+
+  cv::Mat converted;
+};
+
+}
+
+#endif
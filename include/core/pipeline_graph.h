@@ -0,0 +1,116 @@
+#ifndef PIPELINE_GRAPH_H
+#define PIPELINE_GRAPH_H
+
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <opencv2/opencv.hpp>
+
+#include "filters/filter.h"
+#include "core/thread_pool.h"
+
+namespace core
+{
+
+// Filter pipeline as a directed acyclic graph. Node 0 is the source frame; a
+// node can only consume nodes added before it, so the graph is acyclic by
+// construction and node order is a valid topological order.
+class pipeline_graph
+{
+public:
+  using node_id = int;
+
+  enum class merge_op { max, min, add, average };
+
+  static constexpr node_id input = 0;
+
+  pipeline_graph ();
+
+  // a filter instance must appear in the graph only once, branches may run
+  // concurrently
+  node_id add_filter (std::shared_ptr<filters::filter> filter, node_id from);
+  // alpha * a + (1 - alpha) * b
+  node_id add_blend (node_id a, node_id b, double alpha);
+  node_id add_merge (std::vector<node_id> from, merge_op op);
+
+  void set_output (node_id id);
+  node_id output () const { return out; }
+
+  void clear ();
+  bool is_linear () const;
+
+  // sum of the enabled filters' halos on a linear chain, -1 if any of
+  // them (or the graph shape) makes the output depend on the whole frame
+  int halo () const;
+  // ids and parameters of the enabled filters; changes whenever the output
+  // for the same input could
+  std::string signature () const;
+
+  std::shared_ptr<filters::filter> find_filter (const char *id) const;
+  // every filter node in the order they were added
+  std::vector<std::shared_ptr<filters::filter>> all_filters () const;
+  // deep copy with cloned filters, same topology
+  pipeline_graph clone () const;
+
+  // runs the nodes the output depends on. A linear chain goes through the
+  // compiled plan; otherwise independent branches go to the pool when one is
+  // given and intermediates are released after their last use. Not reentrant:
+  // the plan's working buffers belong to the graph. Stages share pyramids
+  // through ctx; without one a context lives for this call only.
+  cv::Mat run (const cv::Mat &frame, thread_pool *pool = nullptr, filters::frame_context *ctx = nullptr);
+  // filter-major order for offline work: on a linear chain every stage is
+  // prepared once and runs over all frames before the next stage starts, so
+  // its setup and its code stay warm. Same results as run () per frame; a
+  // graph with branches falls back to one run per frame.
+  std::vector<cv::Mat> run_batch (const std::vector<cv::Mat> &frames, thread_pool *pool = nullptr);
+
+private:
+  enum class kind { source, filter, blend, merge };
+
+  struct node
+  {
+    kind type = kind::source;
+    std::shared_ptr<filters::filter> filter;
+    std::vector<node_id> inputs;
+    double alpha = 0.5;
+    merge_op op = merge_op::max;
+  };
+
+  // active stages of a linear chain, recompiled when the enabled set changes
+  struct plan
+  {
+    struct stage
+    {
+      filters::filter *filter = nullptr;
+      bool in_place = false;
+    };
+
+    bool valid = false;
+    std::vector<bool> enabled;
+    std::vector<stage> stages;
+    cv::Mat buffers[2];
+  };
+
+  struct run_state;
+
+  bool valid (node_id id) const { return id >= 0 && id < static_cast<node_id> (nodes.size ()); }
+  static void execute (const node &n, const std::vector<const cv::Mat *> &in, cv::Mat &dst,
+                       filters::frame_context &ctx);
+  void step (const std::shared_ptr<run_state> &s, thread_pool *pool, node_id id) const;
+  cv::Mat run_dag (const cv::Mat &frame, thread_pool *pool, filters::frame_context &ctx) const;
+  bool plan_outdated () const;
+  void compile ();
+  static void run_stage (const plan::stage &stage, const cv::Mat &frame, cv::Mat *buffers, int &cur,
+                         filters::frame_context &ctx);
+  cv::Mat run_plan (const cv::Mat &frame, filters::frame_context &ctx);
+
+  std::vector<node> nodes;
+  node_id out = input;
+  plan compiled;
+  std::vector<cv::Mat> batch_buffers;
+};
+
+}
+
+#endif
@@ -0,0 +1,88 @@
+#ifndef RECORDER_H
+#define RECORDER_H
+
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+
+#include <opencv2/opencv.hpp>
+
+namespace core
+{
+
+// Background encoder for the processed stream. Frames are pushed into a bounded
+// queue and written by a worker thread; when the queue is full the frame is
+// dropped instead of stalling the caller.
+class recorder
+{
+public:
+  struct stats
+  {
+    std::size_t queue_depth = 0;
+    std::size_t queue_capacity = 0;
+    std::uint64_t written = 0;
+    std::uint64_t dropped = 0;
+  };
+
+  explicit recorder (std::size_t capacity = 32);
+  ~recorder () { stop (); }
+
+  recorder (const recorder &) = delete;
+  recorder &operator= (const recorder &) = delete;
+  recorder (recorder &&) = delete;
+  recorder &operator= (recorder &&) = delete;
+
+  // a path containing a printf-style pattern (e.g. "out/frame_%05d.png")
+  // is written as an image sequence, anything else through cv::VideoWriter.
+  // The pattern must hold exactly one integer conversion (%d or %i, with
+  // flags and width), other percent signs written as %%. A video keeps the
+  // size and type of its first frame, later frames that differ are dropped
+  bool start (const std::string &path, double fps);
+  void stop ();
+  bool is_running () const;
+
+  // never blocks on the encoder unless wait is set, returns false if the
+  // frame was dropped. A frame pushed with a name goes to that file in place
+  // of the next name of the sequence
+  bool push (const cv::Mat &frame, const std::string &name = {}, bool wait = false);
+
+  stats get_stats () const;
+
+private:
+  struct item
+  {
+    cv::Mat frame;
+    std::string name;
+  };
+
+  void run ();
+  bool write (const item &it);
+
+  const std::size_t capacity;
+
+  mutable std::mutex mutex;
+  std::condition_variable ready;
+  std::condition_variable space;
+  std::deque<item> queue;
+  bool running = false;
+
+  std::thread worker;
+  std::string path;
+  double fps = 30.0;
+  bool sequence = false;
+  bool failed = false;
+  cv::VideoWriter writer;
+  cv::Size writer_size;
+  int writer_type = -1;
+  bool mismatch_warned = false;
+
+  std::uint64_t written = 0;
+  std::uint64_t dropped = 0;
+};
+
+}
+
+#endif
@@ -0,0 +1,20 @@
+#ifndef REDUCED_DECODE_H
+#define REDUCED_DECODE_H
+
+#include <opencv2/opencv.hpp>
+
+namespace core
+{
+
+// JPEG can be decoded at 1/2, 1/4 or 1/8 scale by libjpeg's scaled IDCT, so
+// the decode costs what the output size costs. Picks the IMREAD_REDUCED_COLOR_*
+// flag of the largest reduction of full that still covers max_width x
+// max_height, IMREAD_COLOR if none does.
+int reduced_read_flags (const cv::Size &full, int max_width, int max_height);
+
+// motion JPEG as reported by V4L2 and FFmpeg captures
+bool is_mjpeg (int fourcc);
+
+}
+
+#endif
@@ -0,0 +1,67 @@
+#ifndef SEQUENCE_SOURCE_H
+#define SEQUENCE_SOURCE_H
+
+#include <atomic>
+#include <cstddef>
+#include <deque>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <opencv2/opencv.hpp>
+
+#include "core/thread_pool.h"
+
+namespace core
+{
+
+// stills from a directory or a glob pattern, decoded ahead on a pool so
+// that read () only picks up finished frames
+class sequence_source
+{
+public:
+  explicit sequence_source (int depth = 8);
+  ~sequence_source () { close (); }
+
+  sequence_source (const sequence_source &) = delete;
+  sequence_source &operator= (const sequence_source &) = delete;
+
+  // max_width/max_height > 0 let the decoder downscale by 2, 4 or 8 as
+  // long as the result still covers that size
+  bool open (const std::string &pattern, int max_width = 0, int max_height = 0);
+  void close ();
+  bool is_open () const { return !files.empty (); }
+
+  // never waits: false while the next file is still being decoded
+  bool read (cv::Mat &frame);
+
+  std::size_t size () const { return files.size (); }
+  // file the last frame read came from, and the imread flags it was
+  // decoded with
+  const std::string &current_path () const { return last_path; }
+  int decode_flags () const { return read_flags; }
+
+private:
+  struct slot
+  {
+    std::atomic<bool> done { false };
+    cv::Mat image;
+    std::string path;
+  };
+
+  void fill ();
+
+  int depth;
+  std::vector<std::string> files;
+  std::size_t next_file = 0;
+  int read_flags = cv::IMREAD_COLOR;
+  std::string last_path;
+
+  std::deque<std::shared_ptr<slot>> queue;
+  std::shared_ptr<std::atomic<bool>> cancelled;
+  std::unique_ptr<thread_pool> pool;
+};
+
+}
+
+#endif
@@ -0,0 +1,94 @@
+#ifndef SESSION_LOG_H
+#define SESSION_LOG_H
+
+#include <atomic>
+#include <cstdint>
+#include <fstream>
+#include <mutex>
+#include <string>
+#include <unordered_set>
+#include <vector>
+
+#include <opencv2/opencv.hpp>
+
+#include "core/pipeline_graph.h"
+#include "core/recorder.h"
+
+namespace core
+{
+
+// Text log of the frames an engine rendered, so that a session in the GUI
+// can be run again headless as a benchmark:
+//
+//   filtercv-session 2
+//   chain <frame> <id> <id> ...                  filter order, when it changes
+//   param <frame> <index> <id> <key=value ...>   parameters, when they change
+//   input <frame> video <index> <path>           input read back from a file
+//   input <frame> still <imread flags> <path>
+//   frame <frame> <input hash> <output hash>
+//
+// Hashes are 16 hex digits. A frame from a video or an image sequence is
+// logged as a reference to it. Any other distinct input frame (camera,
+// pipe) is written losslessly to <log>.frames/<input hash>.png by a
+// background writer, which holds the engine up rather than drop one.
+class session_log
+{
+public:
+  struct replay_result
+  {
+    std::uint64_t frames = 0;
+    // frames whose input can't be read back as it was logged, skipped
+    std::uint64_t missing = 0;
+    // outputs that differ from the recorded ones
+    std::uint64_t mismatched = 0;
+    double total_ms = 0.0;
+    double mean_ms = 0.0;
+    double p50_ms = 0.0;
+    double p95_ms = 0.0;
+    double max_ms = 0.0;
+    std::uint64_t slowest_frame = 0;
+  };
+
+  session_log ();
+  ~session_log () { stop (); }
+
+  session_log (const session_log &) = delete;
+  session_log &operator= (const session_log &) = delete;
+  session_log (session_log &&) = delete;
+  session_log &operator= (session_log &&) = delete;
+
+  bool start (const std::string &path);
+  void stop ();
+  bool is_running () const { return running.load (std::memory_order_relaxed); }
+
+  // around every rendered frame; begin_frame logs the chain and whatever
+  // parameters changed since the previous frame. input must be the BGR
+  // frame the chain sees on replay; source is an input reference ("video
+  // <index> <path>" or "still <flags> <path>"), empty keeps a copy. Linear
+  // chains only.
+  void begin_frame (const cv::Mat &input, const pipeline_graph &graph, const std::string &source = {});
+  void end_frame (const cv::Mat &output);
+
+  // runs the logged frames through a chain rebuilt from the log, one after
+  // the other as fast as they go; only the pipeline is timed
+  static bool replay (const std::string &path, replay_result &result);
+
+  static std::uint64_t hash (const cv::Mat &img);
+
+private:
+  mutable std::mutex mutex;
+  std::atomic<bool> running { false };
+  std::ofstream out;
+  std::string frames_dir;
+  recorder frames;
+  std::uint64_t frame = 0;
+  bool in_frame = false;
+  std::uint64_t input_hash = 0;
+  std::vector<std::string> chain;
+  std::vector<std::string> params;
+  std::unordered_set<std::uint64_t> stored;
+};
+
+}
+
+#endif
@@ -0,0 +1,135 @@
+#ifndef SHM_SINK_H
+#define SHM_SINK_H
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+#include <opencv2/opencv.hpp>
+
+namespace core
+{
+
+// layout of the shared segment, shared with out-of-process readers:
+// shm_header, then slot_count slots of slot_stride bytes each. A slot is
+// an shm_slot followed by its pixels at slot + payload_offset. A segment
+// holds frames of one size and type; when they change the writer creates a
+// new segment under the same name and retires the old one.
+struct shm_header
+{
+  static constexpr std::uint32_t magic_value = 0x32564346; // "FCV2"
+
+  std::uint32_t magic;
+  std::uint32_t slot_count;
+  std::uint64_t slot_stride;
+  std::uint64_t payload_offset;
+  std::uint64_t payload_capacity;
+
+  // newest complete frame, 0 while nothing was published
+  std::atomic<std::uint64_t> latest;
+  // futex word, bumped on every publish
+  std::atomic<std::uint32_t> notify;
+  // readers blocked in futex wait, the writer skips the wake when 0
+  std::atomic<std::uint32_t> waiters;
+  // set once the writer has left this segment, for a new one under the same
+  // name or because it stopped; notify is bumped with it
+  std::atomic<std::uint32_t> retired;
+};
+
+struct shm_slot
+{
+  // seqlock: odd while the writer fills the slot, 2 * frame when done
+  std::atomic<std::uint64_t> seq;
+  std::uint64_t frame;
+  std::uint64_t timestamp_ns;  // CLOCK_MONOTONIC
+  std::int32_t width;
+  std::int32_t height;
+  std::int32_t type;           // cv::Mat type, CV_8UC3 is BGR
+  std::int32_t step;
+};
+
+static_assert (std::atomic<std::uint64_t>::is_always_lock_free, "shm ring needs address-free atomics");
+static_assert (std::atomic<std::uint32_t>::is_always_lock_free, "shm ring needs address-free atomics");
+
+// writes processed frames into a POSIX shared-memory ring
+class shm_sink
+{
+public:
+  shm_sink () = default;
+  ~shm_sink () { stop (); }
+
+  shm_sink (const shm_sink &) = delete;
+  shm_sink &operator= (const shm_sink &) = delete;
+
+  // the segment is created with the first frame and sized for it, and made
+  // again whenever the frame size or type changes
+  bool start (const std::string &name, int slots = 4);
+  void stop ();
+  bool is_running () const { return !name.empty (); }
+
+  // one copy into the ring, no syscall unless a reader is waiting
+  void push (const cv::Mat &frame);
+
+  std::uint64_t published () const { return frame; }
+  // frames lost because no segment could be created
+  std::uint64_t dropped () const { return lost; }
+
+private:
+  bool create (std::size_t bytes);
+
+  std::string name;
+  int slots = 4;
+  int fd = -1;
+  unsigned char *base = nullptr;
+  std::size_t length = 0;
+  shm_header *header = nullptr;
+
+  // format of the current segment
+  int width = 0;
+  int height = 0;
+  int type = -1;
+
+  std::uint64_t frame = 0;
+  std::uint64_t lost = 0;
+  bool failed = false;
+};
+
+// the consumer side: frames are read in place from the mapping
+class shm_reader
+{
+public:
+  shm_reader () = default;
+  ~shm_reader () { close (); }
+
+  shm_reader (const shm_reader &) = delete;
+  shm_reader &operator= (const shm_reader &) = delete;
+
+  bool open (const std::string &name);
+  void close ();
+
+  // blocks until a frame newer than after is published or timeout_ms
+  // passes; returns the newest frame number, 0 on timeout. Follows the
+  // writer to a new segment when it retires this one; if none is there the
+  // reader is closed and returns 0 until opened again. Frame numbers carry
+  // on across segments.
+  std::uint64_t wait (std::uint64_t after, int timeout_ms);
+
+  // header into the shared slot; the pixels may be overwritten once the
+  // writer wraps around, check still_valid () after using them
+  bool view (std::uint64_t frame, cv::Mat &out, std::uint64_t *timestamp_ns = nullptr) const;
+  bool still_valid (std::uint64_t frame) const;
+
+private:
+  const shm_slot *slot_for (std::uint64_t frame) const;
+
+  std::string name;
+  int fd = -1;
+  unsigned char *base = nullptr;
+  std::size_t length = 0;
+  shm_header *header = nullptr;
+};
+
+}
+
+#endif
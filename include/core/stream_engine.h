@@ -0,0 +1,129 @@
+#ifndef STREAM_ENGINE_H
+#define STREAM_ENGINE_H
+
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include <opencv2/opencv.hpp>
+
+#include "core/cv_engine.h"
+#include "core/thread_pool.h"
+
+namespace core
+{
+
+// Runs many cv_engines, each with its own source, chain and sinks, on the
+// shared thread_pool. A stream has at most one frame in flight, so its
+// frames stay in order and its pipeline buffers are never shared. Among the
+// streams that are due, the one that has used the least worker time per
+// unit of priority goes next (stride scheduling), so a heavy chain can't
+// starve light ones and priorities split the pool when it is saturated.
+class stream_engine
+{
+public:
+  using stream_id = int;
+  // called on a worker thread; the frame is only valid for the call unless
+  // the sink keeps a reference
+  using sink_fn = std::function<void (stream_id, const cv::Mat &)>;
+
+  struct config
+  {
+    // relative share of the workers while streams compete for them
+    int priority = 1;
+    // frames per second to aim for, 0 runs as fast as the share allows
+    double target_fps = 30.0;
+  };
+
+  struct stats
+  {
+    std::uint64_t frames = 0;
+    // source had nothing to give (pipe or sequence not ready, camera error)
+    std::uint64_t empty = 0;
+    // grab, chain or sink threw; the stream is retried like an empty one
+    std::uint64_t failed = 0;
+    // schedule slots that passed while the stream was still busy or queued
+    std::uint64_t late = 0;
+    // measured over the last second
+    double fps = 0.0;
+    // moving averages of grab + process and of the delay behind schedule
+    double process_ms = 0.0;
+    double lag_ms = 0.0;
+  };
+
+  // max_in_flight <= 0 allows one frame per worker of the shared pool
+  explicit stream_engine (int max_in_flight = 0);
+  ~stream_engine ();
+
+  stream_engine (const stream_engine &) = delete;
+  stream_engine &operator= (const stream_engine &) = delete;
+  stream_engine (stream_engine &&) = delete;
+  stream_engine &operator= (stream_engine &&) = delete;
+
+  // the engine should have its source and chain set up; it is opened on
+  // its first grab. Ids start at 1, 0 means no engine was given
+  stream_id add_stream (std::unique_ptr<cv_engine> engine, config cfg, sink_fn sink = {});
+  // waits for a frame in flight, then closes the engine
+  void remove_stream (stream_id id);
+  void set_config (stream_id id, config cfg);
+
+  // for filter parameter changes, which are safe while the stream runs;
+  // the graph itself should only be edited before add_stream
+  cv_engine *engine (stream_id id);
+
+  void start ();
+  void stop ();
+  bool is_running () const;
+
+  stats get_stats (stream_id id) const;
+  std::vector<stream_id> streams () const;
+  // last output of the stream, kept until the next one replaces it
+  cv::Mat latest (stream_id id) const;
+
+private:
+  using clock = std::chrono::steady_clock;
+
+  struct stream
+  {
+    stream_id id = 0;
+    std::unique_ptr<cv_engine> engine;
+    config cfg;
+    sink_fn sink;
+
+    // worker time used, divided by priority
+    double pass = 0.0;
+    clock::time_point due;
+    bool busy = false;
+    bool removed = false;
+
+    cv::Mat latest;
+    stats st;
+    std::uint64_t window_frames = 0;
+    clock::time_point window_start;
+  };
+
+  void schedule ();
+  void run_frame (stream *s, clock::time_point scheduled);
+  stream *find (stream_id id) const;
+  stream *pick (clock::time_point now, clock::time_point &wake);
+
+  thread_pool &pool;
+  const int max_in_flight;
+
+  mutable std::mutex mutex;
+  std::condition_variable changed;
+  std::vector<std::unique_ptr<stream>> list;
+  stream_id next_id = 1;
+  int in_flight = 0;
+  bool running = false;
+  std::thread scheduler;
+};
+
+}
+
+#endif
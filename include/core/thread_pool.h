@@ -0,0 +1,87 @@
+#ifndef THREAD_POOL_H
+#define THREAD_POOL_H
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace core
+{
+
+// Work-stealing pool. Every worker owns a deque: tasks it submits go to the
+// back and it takes from the back, so nested work stays hot in its cache;
+// idle workers steal the oldest task from the front of another deque. Tasks
+// from outside the pool go to a shared queue. Waiting inside a task is done
+// with help_until (), which keeps running queued work instead of blocking a
+// worker, so stages and loops can nest freely; outside threads just wait.
+class thread_pool
+{
+public:
+  struct options
+  {
+    // <= 0 picks the number of hardware threads
+    int workers = 0;
+    // worker i is pinned to cpus[i % cpus.size ()]; empty leaves placement
+    // to the scheduler
+    std::vector<int> cpus;
+  };
+
+  explicit thread_pool (int workers = 0);
+  explicit thread_pool (const options &opt);
+  ~thread_pool ();
+
+  thread_pool (const thread_pool &) = delete;
+  thread_pool &operator= (const thread_pool &) = delete;
+  thread_pool (thread_pool &&) = delete;
+  thread_pool &operator= (thread_pool &&) = delete;
+
+  void submit (std::function<void ()> task);
+  int size () const { return static_cast<int> (threads.size ()); }
+  // index of the calling worker, -1 for threads outside this pool
+  int worker_index () const;
+
+  // fn (begin, end) over [first, last) in chunks of at least grain items;
+  // the caller runs chunks too and returns when all are done. The first
+  // exception a chunk throws is rethrown here
+  void parallel_for (int first, int last, int grain, const std::function<void (int, int)> &fn);
+  // a worker runs queued tasks until done () holds, a thread outside the
+  // pool blocks; whoever makes done () true calls wake ()
+  void help_until (const std::function<bool ()> &done);
+  void wake ();
+
+  // process-wide pool for filter kernels, pipeline stages and streams. It
+  // is also installed as OpenCV's parallel_for_ backend, so OpenCV's own
+  // loops and ours share the same threads. configure_shared () only has an
+  // effect before the first shared ().
+  static void configure_shared (const options &opt);
+  static thread_pool &shared ();
+
+private:
+  struct queue
+  {
+    std::mutex mutex;
+    std::deque<std::function<void ()>> tasks;
+  };
+
+  void start (const options &opt);
+  void run (int index);
+  bool take (int self, std::function<void ()> &task);
+
+  // one per worker, the last one takes submissions from outside
+  std::vector<std::unique_ptr<queue>> queues;
+  std::atomic<int> pending { 0 };
+
+  std::mutex mutex;
+  std::condition_variable ready;
+  std::vector<std::thread> threads;
+  bool stopping = false;
+};
+
+}
+
+#endif
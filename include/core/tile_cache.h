@@ -0,0 +1,51 @@
+#ifndef TILE_CACHE_H
+#define TILE_CACHE_H
+
+#include <functional>
+#include <string>
+
+#include <opencv2/opencv.hpp>
+
+namespace core
+{
+
+// Keeps the last output of a local chain and recomputes only the tiles
+// whose input changed, each grown by the chain's halo so the kept part of
+// the result is exact. With a tolerance it is only approximate.
+class tile_cache
+{
+public:
+  using process_fn = std::function<cv::Mat (const cv::Mat &)>;
+
+  // a tile is unchanged while no sample differs from its reference by more
+  // than tolerance. 0 reuses only identical tiles. Slack keeps sensor noise
+  // from dirtying everything, but is approximate: a threshold, canny or
+  // contours near its level can keep a stale output that is off by 255.
+  // The reference is only refreshed for redone tiles, so the input error
+  // stays within the tolerance instead of creeping.
+  explicit tile_cache (int tile_size = 64, double tolerance = 0.0);
+
+  // halo < 0 or a changed signature processes the whole frame
+  cv::Mat run (const cv::Mat &frame, int halo, const std::string &signature, const process_fn &process);
+  void reset ();
+
+  // share of tiles taken from the previous output in the last run ()
+  double reused_fraction () const { return reused; }
+
+private:
+  cv::Mat run_full (const cv::Mat &frame, int halo, const std::string &signature, const process_fn &process);
+
+  int tile;
+  double tolerance;
+
+  // input each cached tile was computed from, and the matching output
+  cv::Mat reference;
+  cv::Mat output;
+  std::string last_signature;
+  int last_halo = -1;
+  double reused = 0.0;
+};
+
+}
+
+#endif
@@ -0,0 +1,69 @@
+#ifndef TILED_RENDERER_H
+#define TILED_RENDERER_H
+
+#include <atomic>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include <opencv2/opencv.hpp>
+
+#include "core/pipeline_graph.h"
+
+namespace core
+{
+
+// Filters stills far larger than memory, e.g. 20k x 20k scans. Input and
+// output are binary PPM (P6) or raw packed BGR files mapped into memory.
+// The image goes through the graph in tiles grown by the graph's halo, one
+// row of tiles at a time on the shared pool, and every tile's core is
+// written straight into the mapped output. Rows that are done are dropped
+// from both mappings, so what stays resident is about one row of tiles of
+// input and output plus a tile per thread.
+class tiled_renderer
+{
+public:
+  struct progress
+  {
+    std::uint64_t done = 0;
+    std::uint64_t total = 0;
+  };
+
+  explicit tiled_renderer (const pipeline_graph &graph, int tile_size = 1024);
+
+  tiled_renderer (const tiled_renderer &) = delete;
+  tiled_renderer &operator= (const tiled_renderer &) = delete;
+
+  // raw input needs its size; the output is PPM when its name ends in
+  // .ppm, raw BGR otherwise. Blocks until done, cancelled or failed; the
+  // graph must be a chain of local filters (halo () >= 0).
+  bool render (const std::string &in_path, const std::string &out_path, int width = 0, int height = 0);
+  void cancel () { cancelled = true; }
+
+  bool is_running () const { return running; }
+  progress get_progress () const;
+
+private:
+  struct image;
+
+  bool run_tile (const image &in, image &out, const cv::Rect &core, int halo);
+  // run () isn't reentrant, concurrent tiles each take a clone
+  pipeline_graph acquire ();
+  void release (pipeline_graph &&g);
+
+  pipeline_graph graph;
+  int tile;
+
+  std::mutex mutex;
+  std::vector<pipeline_graph> idle;
+
+  std::atomic<bool> running { false };
+  std::atomic<bool> cancelled { false };
+  std::atomic<std::uint64_t> done { 0 };
+  std::atomic<std::uint64_t> total { 0 };
+};
+
+}
+
+#endif
@@ -0,0 +1,81 @@
+#ifndef TRACER_H
+#define TRACER_H
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <vector>
+
+namespace core
+{
+
+// ring buffer of timed events, exported as Chrome trace-event JSON that
+// chrome://tracing and Perfetto open directly. Off by default; a disabled
+// scope costs one relaxed load.
+class tracer
+{
+public:
+  struct event
+  {
+    const char *name;
+    const char *category;
+    std::uint64_t start_ns;
+    std::uint64_t duration_ns;
+    std::uint64_t frame;
+    std::uint32_t tid;
+    // key=value pairs, see filters::filter::serialize_params
+    std::string args;
+  };
+
+  class scope
+  {
+  public:
+    scope (const char *name, const char *category);
+    ~scope ();
+
+    scope (const scope &) = delete;
+    scope &operator= (const scope &) = delete;
+
+    bool active () const { return start_ns != 0; }
+    void set_args (std::string a) { args = std::move (a); }
+
+  private:
+    const char *name;
+    const char *category;
+    std::uint64_t start_ns = 0;
+    std::string args;
+  };
+
+  static tracer &instance ();
+
+  // ~60 s of a full chain at 30 fps
+  void enable (bool on, std::size_t capacity = 1 << 16);
+  bool is_enabled () const { return enabled.load (std::memory_order_relaxed); }
+
+  // frame number attached to the events that follow
+  std::uint64_t next_frame () { return frame.fetch_add (1, std::memory_order_relaxed) + 1; }
+  std::uint64_t current_frame () const { return frame.load (std::memory_order_relaxed); }
+
+  void record (event e);
+  std::size_t size () const;
+  bool dump (const std::string &path) const;
+
+  static std::uint64_t now_ns ();
+
+private:
+  tracer () = default;
+
+  std::atomic<bool> enabled { false };
+  std::atomic<std::uint64_t> frame { 0 };
+
+  mutable std::mutex mutex;
+  std::vector<event> ring;
+  std::size_t head = 0;
+  std::size_t count = 0;
+};
+
+}
+
+#endif
@@ -2,6 +2,7 @@
 #define AFFINE_H
 
 #include "filters/filter.h"
+#include "filters/params.h"
 #include <opencv2/opencv.hpp>
 #include <algorithm>
 
@@ -11,26 +12,61 @@ namespace filters
 class affine final : public filter
 {
 public:
+  struct params
+  {
+    bool enabled = false;
+    double angle = 0.0;
+    double scale = 1.0;
+    int tx = 0;
+    int ty = 0;
+  };
+
   const char *id () const override final { return "affine"; }
+  std::shared_ptr<filter> clone () const override final { return std::make_shared<affine> (*this); }
+  std::string serialize_params () const override final
+  {
+    const auto p = state.load ();
+    return "enabled=" + std::to_string (p->enabled)
+           + " angle=" + param_text (p->angle)
+           + " scale=" + param_text (p->scale)
+           + " tx=" + std::to_string (p->tx)
+           + " ty=" + std::to_string (p->ty);
+  }
+  bool load_params (const std::string &text) override final
+  {
+    param_reader r (text);
+    modify ([&r] (params &p) {
+      r.get ("enabled", p.enabled);
+      r.get ("angle", p.angle);
+      r.get ("scale", p.scale);
+      r.get ("tx", p.tx);
+      r.get ("ty", p.ty);
+    });
+    return r.ok ();
+  }
+
+  bool is_enabled () const override final { return state.load ()->enabled; }
+  void set_enabled (bool on) override final { modify ([on] (params &p) { p.enabled = on; }); }
 
-  bool is_enabled () const override final { return enabled; }
-  void set_enabled (bool on) override final { enabled = on; }
+  void set_angle (double v) { modify ([v] (params &p) { p.angle = v; }); }
+  double get_angle () const { return state.load ()->angle; }
 
-  void set_angle (double v) { angle = std::clamp (v, -180.0, 180.0); }
-  double get_angle () const { return angle; }
+  void set_scale (double v) { modify ([v] (params &p) { p.scale = v; }); }
+  double get_scale () const { return state.load ()->scale; }
 
-  void set_scale (double v) { scale = std::clamp (v, 0.1, 3.0); }
-  double get_scale () const { return scale; }
+  void set_tx (int v) { modify ([v] (params &p) { p.tx = v; }); }
+  int get_tx () const { return state.load ()->tx; }
 
-  void set_tx (int v) { tx = v; }
-  int get_tx () const { return tx; }
+  void set_ty (int v) { modify ([v] (params &p) { p.ty = v; }); }
+  int get_ty () const { return state.load ()->ty; }
 
-  void set_ty (int v) { ty = v; }
-  int get_ty () const { return ty; }
+  params get_params () const { return *state.load (); }
+  template <typename Fn> void modify (Fn &&fn) { state.update ([&fn] (params &p) { fn (p); sanitize (p); }); }
 
   void apply (const cv::Mat &src_bgr, cv::Mat &dst_bgr) override final
   {
-    if (!enabled)
+    const auto p = state.load ();
+    if (!p->enabled)
     {
       dst_bgr = src_bgr;
       return;
@@ -41,11 +77,11 @@ public:
       static_cast<float>(src_bgr.rows) / 2.0f
     );
 
-    cv::Mat M = cv::getRotationMatrix2D (center, angle, scale);
+    cv::Mat M = cv::getRotationMatrix2D (center, p->angle, p->scale);
 
     // добавляем сдвиг
-    M.at<double>(0, 2) += tx;
-    M.at<double>(1, 2) += ty;
+    M.at<double>(0, 2) += p->tx;
+    M.at<double>(1, 2) += p->ty;
 
     cv::warpAffine (
       src_bgr, dst_bgr, M,
@@ -57,11 +93,13 @@ public:
   }
 
 private:
-  bool enabled = false;
-  double angle = 0.0;
-  double scale = 1.0;
-  int tx = 0;
-  int ty = 0;
+  static void sanitize (params &p)
+  {
+    p.angle = std::clamp (p.angle, -180.0, 180.0);
+    p.scale = std::clamp (p.scale, 0.1, 3.0);
+  }
+
+  param_cell<params> state;
 };
 
 }
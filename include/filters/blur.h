@@ -2,50 +2,113 @@
 #define BLUR_H
 
 #include "filters/filter.h"
+#include "filters/params.h"
 
 namespace filters
 {
-  
+
 class blur : public filter
 {
 public:
+  struct params
+  {
+    bool enabled = false;
+    int  ksize   = 0;
+  };
+
   const char *id () const override final { return "blur"; }
+  std::shared_ptr<filter> clone () const override final { return std::make_shared<blur> (*this); }
+  bool in_place () const override final { return true; }
+  int halo () const override final
+  {
+    // the pyramid path samples relative to the image origin, regions differ
+    const int k = state.load ()->ksize;
+    return pyramid_level (k) > 0 ? -1 : k / 2;
+  }
+  std::string serialize_params () const override final
+  {
+    const auto p = state.load ();
+    return "enabled=" + std::to_string (p->enabled)
+           + " ksize=" + std::to_string (p->ksize);
+  }
+  bool load_params (const std::string &text) override final
+  {
+    param_reader r (text);
+    modify ([&r] (params &p) {
+      r.get ("enabled", p.enabled);
+      r.get ("ksize", p.ksize);
+    });
+    return r.ok ();
+  }
 
-  bool is_enabled () const override final { return enabled; }
-  void set_enabled (bool on) override final { enabled = on; }
+  bool is_enabled () const override final { return state.load ()->enabled; }
+  void set_enabled (bool on) override final { modify ([on] (params &p) { p.enabled = on; }); }
 
   void set_ksize (int k)
   {
-    if (k <= 1) 
-      {
-        ksize = 0;
-        enabled = false; 
-      }
-    else 
-      { 
-        ksize = (k % 2 == 0 ? k + 1 : k); 
-        enabled = true; 
-      }
+    modify ([k] (params &p) {
+      p.ksize = k;
+      p.enabled = (k > 1);
+    });
   }
 
-  int get_ksize () const { return ksize; }
+  int get_ksize () const { return state.load ()->ksize; }
+
+  params get_params () const { return *state.load (); }
+  template <typename Fn> void modify (Fn &&fn) { state.update ([&fn] (params &p) { fn (p); sanitize (p); }); }
 
   void apply (const cv::Mat &src_bgr, cv::Mat &dst_bgr) override final
   {
-    if (!enabled || ksize <= 1) 
-      { 
-        dst_bgr = src_bgr; 
-        return; 
+    frame_context ctx;
+    apply_shared (src_bgr, dst_bgr, ctx);
+  }
+
+  void apply_shared (const cv::Mat &src_bgr, cv::Mat &dst_bgr, frame_context &ctx) override final
+  {
+    const auto p = state.load ();
+    if (!p->enabled || p->ksize <= 1)
+      {
+        dst_bgr = src_bgr;
+        return;
       }
-    cv::GaussianBlur (src_bgr, dst_bgr, cv::Size (ksize, ksize), 0);
+
+    const int level = pyramid_level (p->ksize);
+    if (level == 0)
+      {
+        cv::GaussianBlur (src_bgr, dst_bgr, cv::Size (p->ksize, p->ksize), 0);
+        return;
+      }
+
+    // very wide kernels run on a shared pyramid level with a proportionally
+    // smaller kernel and are scaled back up
+    const int k = (p->ksize >> level) | 1;
+    cv::Mat blurred;
+    cv::GaussianBlur (ctx.level (src_bgr, level), blurred, cv::Size (k, k), 0);
+    cv::resize (blurred, dst_bgr, src_bgr.size (), 0, 0, cv::INTER_LINEAR);
   }
 
 private:
-  bool enabled = false;
-  int  ksize   = 0;
+  // halve the frame while the kernel would still be at least 15 wide
+  static int pyramid_level (int ksize)
+  {
+    int level = 0;
+    while (level < 3 && (ksize >> (level + 1)) >= 15)
+      ++level;
+    return level;
+  }
+
+  static void sanitize (params &p)
+  {
+    if (p.ksize <= 1)
+      p.ksize = 0;
+    else if (p.ksize % 2 == 0)
+      ++p.ksize;
+  }
+
+  param_cell<params> state;
 };
 
 }
 
 
-#endif
\ No newline at end of file
+#endif
@@ -2,58 +2,120 @@
 #define CANNY_H
 
 #include "filters/filter.h"
+#include "filters/params.h"
+#include <algorithm>
 
 namespace filters
 {
-  
+
 class canny : public filter
 {
 public:
+  struct params
+  {
+    bool enabled = false;
+    double low = 50.0;
+    double high = 150.0;
+    // thresholds at (1 ∓ sigma) times the frame's median luma instead
+    bool automatic = false;
+    double sigma = 0.33;
+  };
+
   const char *id () const override final { return "canny"; }
+  std::shared_ptr<filter> clone () const override final { return std::make_shared<canny> (*this); }
+  bool in_place () const override final { return true; }
+  bool needs_color () const override final { return false; }
+  std::string serialize_params () const override final
+  {
+    const auto p = state.load ();
+    return "enabled=" + std::to_string (p->enabled)
+           + " low=" + param_text (p->low)
+           + " high=" + param_text (p->high)
+           + " automatic=" + std::to_string (p->automatic)
+           + " sigma=" + param_text (p->sigma);
+  }
+  bool load_params (const std::string &text) override final
+  {
+    param_reader r (text);
+    modify ([&r] (params &p) {
+      r.get ("enabled", p.enabled);
+      r.get ("low", p.low);
+      r.get ("high", p.high);
+      r.get ("automatic", p.automatic);
+      r.get ("sigma", p.sigma);
+    });
+    return r.ok ();
+  }
 
-  bool is_enabled () const override final { return enabled; }
-  void set_enabled (bool on) override final { enabled = on; }
+  bool is_enabled () const override final { return state.load ()->enabled; }
+  void set_enabled (bool on) override final { modify ([on] (params &p) { p.enabled = on; }); }
 
   void set_thresholds (double l, double h)
   {
-    if (l < 0.0) 
-      l = 0.0;
-    if (h < 0.0) 
-      h = 0.0;
-    if (h < l)
-      std::swap (l, h);
-    low = l; 
-    high = h;
+    modify ([l, h] (params &p) {
+      p.low = l;
+      p.high = h;
+    });
   }
 
-  double get_low ()  const { return low; }
-  double get_high () const { return high; }
+  double get_low ()  const { return state.load ()->low; }
+  double get_high () const { return state.load ()->high; }
+
+  void set_automatic (bool on) { modify ([on] (params &p) { p.automatic = on; }); }
+  bool get_automatic () const { return state.load ()->automatic; }
+
+  void set_sigma (double v) { modify ([v] (params &p) { p.sigma = v; }); }
+  double get_sigma () const { return state.load ()->sigma; }
+
+  params get_params () const { return *state.load (); }
+  template <typename Fn> void modify (Fn &&fn) { state.update ([&fn] (params &p) { fn (p); sanitize (p); }); }
 
   void apply (const cv::Mat& src_bgr, cv::Mat& dst_bgr) override final
   {
-    if (!enabled) 
-      { 
-        dst_bgr = src_bgr; 
-        return; 
+    frame_context ctx;
+    apply_shared (src_bgr, dst_bgr, ctx);
+  }
+
+  void apply_shared (const cv::Mat &src_bgr, cv::Mat &dst_bgr, frame_context &ctx) override final
+  {
+    const auto p = state.load ();
+    if (!p->enabled)
+      {
+        dst_bgr = src_bgr;
+        return;
       }
 
-    cv::Mat gray, edges;
-    if (src_bgr.channels () == 1)
-      gray = src_bgr;
-    else
-      cv::cvtColor (src_bgr, gray, cv::COLOR_BGR2GRAY);
+    const cv::Mat gray = ctx.gray (src_bgr);
 
+    double low = p->low, high = p->high;
+    if (p->automatic)
+      {
+        const double median = ctx.stats (src_bgr).median ();
+        low = std::max (0.0, (1.0 - p->sigma) * median);
+        high = std::min (255.0, (1.0 + p->sigma) * median);
+      }
+
+    cv::Mat edges;
     cv::Canny (gray, edges, low, high);
     cv::cvtColor (edges, dst_bgr, cv::COLOR_GRAY2BGR);
   }
 
 private:
-  bool enabled = false;
-  double low = 50.0;
-  double high = 150.0;
+  static void sanitize (params &p)
+  {
+    if (p.low < 0.0)
+      p.low = 0.0;
+    if (p.high < 0.0)
+      p.high = 0.0;
+    if (p.high < p.low)
+      std::swap (p.low, p.high);
+    p.sigma = std::clamp (p.sigma, 0.0, 1.0);
+  }
+
+  param_cell<params> state;
 };
 
 }
 
 
-#endif
\ No newline at end of file
+#endif
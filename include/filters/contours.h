@@ -2,6 +2,7 @@
 #define CONTOURS_H
 
 #include "filters/filter.h"
+#include "filters/params.h"
 #include <opencv2/opencv.hpp>
 #include <algorithm>
 #include <vector>
@@ -12,39 +13,75 @@ namespace filters
 class contours final : public filter
 {
 public:
+  struct params
+  {
+    bool enabled = false;
+    double epsilon = 0.02;
+    double min_area = 100.0;
+    bool draw_approx = true;
+  };
+
   const char *id () const override final { return "contours"; }
+  std::shared_ptr<filter> clone () const override final { return std::make_shared<contours> (*this); }
+  bool in_place () const override final { return true; }
+  bool needs_color () const override final { return false; }
+  std::string serialize_params () const override final
+  {
+    const auto p = state.load ();
+    return "enabled=" + std::to_string (p->enabled)
+           + " epsilon=" + param_text (p->epsilon)
+           + " min_area=" + param_text (p->min_area)
+           + " draw_approx=" + std::to_string (p->draw_approx);
+  }
+  bool load_params (const std::string &text) override final
+  {
+    param_reader r (text);
+    modify ([&r] (params &p) {
+      r.get ("enabled", p.enabled);
+      r.get ("epsilon", p.epsilon);
+      r.get ("min_area", p.min_area);
+      r.get ("draw_approx", p.draw_approx);
+    });
+    return r.ok ();
+  }
 
-  bool is_enabled () const override final { return enabled; }
-  void set_enabled (bool on) override final { enabled = on; }
+  bool is_enabled () const override final { return state.load ()->enabled; }
+  void set_enabled (bool on) override final { modify ([on] (params &p) { p.enabled = on; }); }
 
   void set_epsilon (double v)
   {
-    epsilon = std::clamp (v, 0.001, 0.2);
+    modify ([v] (params &p) { p.epsilon = v; });
   }
-  double get_epsilon () const { return epsilon; }
+  double get_epsilon () const { return state.load ()->epsilon; }
 
   void set_min_area (double v)
   {
-    min_area = std::max (0.0, v);
+    modify ([v] (params &p) { p.min_area = v; });
   }
-  double get_min_area () const { return min_area; }
+  double get_min_area () const { return state.load ()->min_area; }
+
+  void set_draw_approx (bool on) { modify ([on] (params &p) { p.draw_approx = on; }); }
+  bool get_draw_approx () const { return state.load ()->draw_approx; }
 
-  void set_draw_approx (bool on) { draw_approx = on; }
-  bool get_draw_approx () const { return draw_approx; }
+  params get_params () const { return *state.load (); }
+  template <typename Fn> void modify (Fn &&fn) { state.update ([&fn] (params &p) { fn (p); sanitize (p); }); }
 
   void apply (const cv::Mat &src_bgr, cv::Mat &dst_bgr) override final
   {
-    if (!enabled)
+    frame_context ctx;
+    apply_shared (src_bgr, dst_bgr, ctx);
+  }
+
+  void apply_shared (const cv::Mat &src_bgr, cv::Mat &dst_bgr, frame_context &ctx) override final
+  {
+    const auto p = state.load ();
+    if (!p->enabled)
     {
       dst_bgr = src_bgr;
       return;
     }
 
-    cv::Mat gray;
-    if (src_bgr.channels () == 1)
-      gray = src_bgr;
-    else
-      cv::cvtColor (src_bgr, gray, cv::COLOR_BGR2GRAY);
+    const cv::Mat gray = ctx.gray (src_bgr);
 
     cv::Mat bin;
     cv::threshold (gray, bin, 128, 255, cv::THRESH_BINARY);
@@ -52,18 +89,21 @@ public:
     std::vector<std::vector<cv::Point>> found;
     cv::findContours (bin, found, cv::RETR_EXTERNAL, cv::CHAIN_APPROX_SIMPLE);
 
-    dst_bgr = src_bgr.clone ();
+    // contours are found on luma and drawn on the colour frame
+    const cv::Mat base = ctx.color (src_bgr);
+    if (dst_bgr.data != base.data)
+      base.copyTo (dst_bgr);
 
     for (const auto &cnt : found)
     {
       const double area = cv::contourArea (cnt);
-      if (area < min_area)
+      if (area < p->min_area)
         continue;
 
-      if (draw_approx)
+      if (p->draw_approx)
       {
         std::vector<cv::Point> approx;
-        const double eps = epsilon * cv::arcLength (cnt, true);
+        const double eps = p->epsilon * cv::arcLength (cnt, true);
         cv::approxPolyDP (cnt, approx, eps, true);
 
         cv::polylines (dst_bgr, approx, true,
@@ -80,10 +120,13 @@ public:
   }
 
 private:
-  bool enabled = false;
-  double epsilon = 0.02;
-  double min_area = 100.0;
-  bool draw_approx = true;
+  static void sanitize (params &p)
+  {
+    p.epsilon = std::clamp (p.epsilon, 0.001, 0.2);
+    p.min_area = std::max (0.0, p.min_area);
+  }
+
+  param_cell<params> state;
 };
 
 }
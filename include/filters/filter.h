@@ -1,8 +1,13 @@
 #ifndef FILTER_H
 #define FILTER_H
 
+#include <memory>
+#include <string>
+
 #include <opencv2/opencv.hpp>
 
+#include "filters/frame_context.h"
+
 namespace filters
 {
 
@@ -14,6 +19,36 @@ public:
   virtual void set_enabled (bool on) = 0;
   virtual void apply (const cv::Mat &src_bgr, cv::Mat &dst_bgr) = 0;
 
+  // apply () with access to the frame's shared pyramids; the pipeline calls
+  // this one, filters that can use a shared level override it
+  virtual void apply_shared (const cv::Mat &src_bgr, cv::Mat &dst_bgr, frame_context & /*ctx*/) { apply (src_bgr, dst_bgr); }
+
+  // builds whatever apply () needs for the current parameters (detectors,
+  // structuring elements, buffers) ahead of a run of frames; apply ()
+  // builds it on demand when this wasn't called
+  virtual void prepare () {}
+
+  // independent copy with the same parameters, used to run one chain per worker
+  virtual std::shared_ptr<filter> clone () const = 0;
+
+  // false if the filter reads only luma and accepts a 1-channel frame (the
+  // Y plane of a YUV capture); otherwise the pipeline hands it the colour
+  // frame, converted once per frame and only when some stage asks
+  virtual bool needs_color () const { return true; }
+
+  // true if apply () works when src and dst are the same matrix
+  virtual bool in_place () const { return false; }
+
+  // how far (in pixels) an output pixel can see into the input; -1 when
+  // the result depends on the whole frame. Only asked of enabled filters.
+  virtual int halo () const { return -1; }
+
+  // current parameters as space separated key=value pairs
+  virtual std::string serialize_params () const { return {}; }
+  // the inverse: keys present in text are set, the rest stay as they are.
+  // False if a value doesn't parse
+  virtual bool load_params (const std::string &text) { return text.empty (); }
+
   virtual ~filter () = default;
 };
 
@@ -0,0 +1,162 @@
+#ifndef FRAME_CONTEXT_H
+#define FRAME_CONTEXT_H
+
+#include <algorithm>
+#include <array>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#include <opencv2/opencv.hpp>
+
+#include "filters/luma_stats.h"
+
+namespace filters
+{
+
+// Data derived from the images of one frame, built on first request and
+// shared by every stage that asks for it. Entries are keyed by the image's
+// storage and hold a reference to it, so the address can't be reused for
+// another image while the context lives; whoever rewrites an image in place
+// calls invalidate () first. Dropped as a whole when the frame retires.
+class frame_context
+{
+public:
+  frame_context () = default;
+
+  frame_context (const frame_context &) = delete;
+  frame_context &operator= (const frame_context &) = delete;
+
+  // level 0 is img itself, level n is pyrDown of level n - 1
+  cv::Mat level (const cv::Mat &img, int n)
+  {
+    if (n <= 0 || img.empty ())
+      return img;
+    return find (img)->level (std::min (n, max_levels - 1));
+  }
+
+  cv::Mat gray (const cv::Mat &img)
+  {
+    if (img.empty () || img.channels () == 1)
+      return img;
+
+    const std::shared_ptr<entry> e = find (img);
+    std::call_once (e->gray_once, [&] { cv::cvtColor (img, e->gray, cv::COLOR_BGR2GRAY); });
+    return e->gray;
+  }
+
+  // luma histogram of img, taken once per frame however many stages
+  // threshold on it
+  luma_stats stats (const cv::Mat &img)
+  {
+    if (img.empty ())
+      return {};
+
+    const cv::Mat g = gray (img);
+    const std::shared_ptr<entry> e = find (img);
+    std::call_once (e->stats_once, [&] { e->stats = luma_stats::of (g); });
+    return e->stats;
+  }
+
+  // BGR version of a 1-channel image. When the image is the luma plane of a
+  // YUV capture (see attach_color) that is the captured colour, otherwise
+  // the gray values repeated
+  cv::Mat color (const cv::Mat &img)
+  {
+    if (img.empty () || img.channels () == 3)
+      return img;
+
+    const std::shared_ptr<entry> e = find (img);
+    std::call_once (e->color_once, [&] {
+      std::function<cv::Mat ()> convert;
+      {
+        std::lock_guard<std::mutex> lock (mutex);
+        convert = e->convert;
+      }
+      if (convert)
+        e->color = convert ();
+      else if (img.channels () == 4)
+        cv::cvtColor (img, e->color, cv::COLOR_BGRA2BGR);
+      else
+        cv::cvtColor (img, e->color, cv::COLOR_GRAY2BGR);
+    });
+    return e->color;
+  }
+
+  // convert () produces the colour frame luma was taken from; it only runs
+  // if some stage asks for color (luma)
+  void attach_color (const cv::Mat &luma, std::function<cv::Mat ()> convert)
+  {
+    const std::shared_ptr<entry> e = find (luma);
+    std::lock_guard<std::mutex> lock (mutex);
+    e->convert = std::move (convert);
+  }
+
+  void invalidate (const cv::Mat &img)
+  {
+    // a stage still building from a dropped entry keeps it alive
+    std::lock_guard<std::mutex> lock (mutex);
+    entries.erase (std::remove_if (entries.begin (), entries.end (),
+                                   [&img] (const std::shared_ptr<entry> &e) { return e->key.data == img.data; }),
+                   entries.end ());
+  }
+
+private:
+  // enough halvings to bring any frame down to a pixel
+  static constexpr int max_levels = 24;
+
+  // The mutex only guards the list; each item is built by the first stage
+  // that asks, outside the lock, while other stages asking for the same item
+  // wait on its once flag and stages after anything else carry on.
+  struct entry
+  {
+    explicit entry (const cv::Mat &img) : key (img) {}
+
+    cv::Mat level (int n)
+    {
+      if (n == 0)
+        return key;
+      const cv::Mat prev = level (n - 1);
+      std::call_once (level_once[n], [&] {
+        if (prev.cols < 2 || prev.rows < 2)
+          levels[n] = prev;
+        else
+          cv::pyrDown (prev, levels[n]);
+      });
+      return levels[n];
+    }
+
+    const cv::Mat key;
+    std::array<cv::Mat, max_levels> levels;
+    std::array<std::once_flag, max_levels> level_once;
+    cv::Mat gray;
+    std::once_flag gray_once;
+    cv::Mat color;
+    std::once_flag color_once;
+    luma_stats stats;
+    std::once_flag stats_once;
+    // guarded by the context's mutex
+    std::function<cv::Mat ()> convert;
+  };
+
+  std::shared_ptr<entry> find (const cv::Mat &img)
+  {
+    std::lock_guard<std::mutex> lock (mutex);
+    for (const auto &e : entries)
+      {
+        const cv::Mat &key = e->key;
+        if (key.data == img.data && key.size () == img.size () && key.type () == img.type () && key.step[0] == img.step[0])
+          return e;
+      }
+    entries.push_back (std::make_shared<entry> (img));
+    return entries.back ();
+  }
+
+  std::mutex mutex;
+  std::vector<std::shared_ptr<entry>> entries;
+};
+
+}
+
+#endif
@@ -2,6 +2,7 @@
 #define GLITCH_H
 
 #include "filters/jpeg.h"
+#include "filters/params.h"
 
 namespace filters
 {
@@ -9,27 +10,58 @@ namespace filters
 class glitch final : public jpeg
 {
 public:
+  struct params
+  {
+    bool enabled = false;
+    int strength = 50;
+  };
+
   const char *id () const override final { return "glitch"; }
+  std::shared_ptr<filter> clone () const override final { return std::make_shared<glitch> (*this); }
+  bool in_place () const override final { return false; }
+  std::string serialize_params () const override final
+  {
+    const auto p = state.load ();
+    return "enabled=" + std::to_string (p->enabled)
+           + " strength=" + std::to_string (p->strength);
+  }
+  bool load_params (const std::string &text) override final
+  {
+    param_reader r (text);
+    modify ([&r] (params &p) {
+      r.get ("enabled", p.enabled);
+      r.get ("strength", p.strength);
+    });
+    return r.ok ();
+  }
+
+  bool is_enabled () const override final { return state.load ()->enabled; }
+  void set_enabled (bool on) override final { modify ([on] (params &p) { p.enabled = on; }); }
 
-  void set_strength (int s) { strength = std::clamp (s, 1, 30); }
+  void set_strength (int s) { modify ([s] (params &p) { p.strength = std::clamp (s, 1, 30); }); }
 
-  int get_strength () const { return strength; }
+  int get_strength () const { return state.load ()->strength; }
+
+  params get_params () const { return *state.load (); }
+  template <typename Fn> void modify (Fn &&fn) { state.update (fn); }
 
   void apply (const cv::Mat &src_bgr, cv::Mat &dst_bgr) override final
   {
-    if (!is_enabled ())
+    const auto snapshot = state.load ();
+    if (!snapshot->enabled)
       {
         dst_bgr = src_bgr;
         return;
       }
 
+    const int strength = snapshot->strength;
+
     // ==========================
     // PHASE 1 — JPEG COMPRESSION
     // ==========================
 
-    set_quality (1);
     cv::Mat cur = src_bgr.clone ();
-    jpeg::apply (cur, dst_bgr);
+    recompress (cur, dst_bgr, 1);
 
     // ==========================
     // PHASE 2 — CHANNEL SHIFT
@@ -120,7 +152,7 @@ public:
   }
 
 private:
-  int strength = 50;
+  param_cell<params> state;
 };
 
 
@@ -2,6 +2,8 @@
 #define GRAYSCALE_H
 
 #include "filters/filter.h"
+#include "filters/params.h"
+#include "filters/pixel_op.h"
 
 namespace filters
 {
@@ -9,28 +11,76 @@ namespace filters
 class grayscale : public filter
 {
 public:
+  struct params
+  {
+    bool enabled = false;
+  };
+
   const char *id () const override final { return "grayscale"; }
-  bool is_enabled () const override final { return enabled; }
-  void set_enabled (bool on) override final { enabled = on; }
+  std::shared_ptr<filter> clone () const override final { return std::make_shared<grayscale> (*this); }
+  bool in_place () const override final { return true; }
+  int halo () const override final { return 0; }
+  bool needs_color () const override final { return false; }
+  std::string serialize_params () const override final
+  {
+    const auto p = state.load ();
+    return "enabled=" + std::to_string (p->enabled);
+  }
+  bool load_params (const std::string &text) override final
+  {
+    param_reader r (text);
+    modify ([&r] (params &p) {
+      r.get ("enabled", p.enabled);
+    });
+    return r.ok ();
+  }
+  bool is_enabled () const override final { return state.load ()->enabled; }
+  void set_enabled (bool on) override final { modify ([on] (params &p) { p.enabled = on; }); }
+
+  params get_params () const { return *state.load (); }
+  template <typename Fn> void modify (Fn &&fn) { state.update (fn); }
 
-  void apply (const cv::Mat &src_bgr, cv::Mat &dst_bgr) override final 
+  struct pixel_op
   {
-    if (!enabled) 
-      { 
+    bool on = false;
+    void operator() (uchar &b, uchar &g, uchar &r) const
+    {
+      if (on)
+        b = g = r = luma (b, g, r);
+    }
+  };
+  bool get_pixel_op (pixel_op &op) const
+  {
+    op.on = state.load ()->enabled;
+    return true;
+  }
+
+  void apply (const cv::Mat &src_bgr, cv::Mat &dst_bgr) override final
+  {
+    const auto p = state.load ();
+    if (!p->enabled)
+      {
         dst_bgr = src_bgr;
-        return; 
+        return;
+      }
+
+    // a luma plane is already the answer
+    if (src_bgr.channels () == 1)
+      {
+        cv::cvtColor (src_bgr, dst_bgr, cv::COLOR_GRAY2BGR);
+        return;
       }
 
-    cv::Mat gray; 
+    cv::Mat gray;
     cv::cvtColor (src_bgr, gray, cv::COLOR_BGR2GRAY);
     cv::cvtColor (gray, dst_bgr, cv::COLOR_GRAY2BGR);
   }
 
 private:
-  bool enabled = false;
+  param_cell<params> state;
 };
 
 }
 
 
-#endif
\ No newline at end of file
+#endif
@@ -2,6 +2,7 @@
 #define JPEG_H
 
 #include "filters/filter.h"
+#include "filters/params.h"
 
 namespace filters
 {
@@ -9,47 +10,86 @@ namespace filters
 class jpeg : public filter
 {
 public:
+  struct params
+  {
+    bool enabled = false;
+    int quality = 80;
+  };
+
   const char *id () const override { return "jpeg"; }
+  std::shared_ptr<filter> clone () const override { return std::make_shared<jpeg> (*this); }
+  bool in_place () const override { return true; }
+  std::string serialize_params () const override
+  {
+    const auto p = state.load ();
+    return "enabled=" + std::to_string (p->enabled)
+           + " quality=" + std::to_string (p->quality);
+  }
+  bool load_params (const std::string &text) override
+  {
+    param_reader r (text);
+    modify ([&r] (params &p) {
+      r.get ("enabled", p.enabled);
+      r.get ("quality", p.quality);
+    });
+    return r.ok ();
+  }
 
-  bool is_enabled () const override { return enabled; }
-  void set_enabled (bool on) override { enabled = on; }
+  bool is_enabled () const override { return state.load ()->enabled; }
+  void set_enabled (bool on) override { modify ([on] (params &p) { p.enabled = on; }); }
 
   void set_quality (int q)
   {
-    quality = std::clamp (q, 0, 100);
+    modify ([q] (params &p) { p.quality = q; });
   }
 
-  int get_quality () const { return quality; }
+  int get_quality () const { return state.load ()->quality; }
+
+  params get_params () const { return *state.load (); }
+  template <typename Fn> void modify (Fn &&fn) { state.update ([&fn] (params &p) { fn (p); sanitize (p); }); }
 
   void apply (const cv::Mat& src_bgr, cv::Mat& dst_bgr) override
 {
-  if (!enabled) 
-    { 
-      dst_bgr = src_bgr; 
+  const auto p = state.load ();
+  if (!p->enabled)
+    {
+      dst_bgr = src_bgr;
       return;
     }
 
+  recompress (src_bgr, dst_bgr, p->quality);
+}
+
+protected:
+  // the encoded buffer is kept between frames, it only grows
+  void recompress (const cv::Mat& src_bgr, cv::Mat& dst_bgr, int quality)
+{
   cv::Mat bgr;
-  if (src_bgr.channels () == 3)        
+  if (src_bgr.channels () == 3)
     bgr = src_bgr;
-  else if (src_bgr.channels () == 4)   
+  else if (src_bgr.channels () == 4)
     cv::cvtColor (src_bgr, bgr, cv::COLOR_BGRA2BGR);
-  else if (src_bgr.channels () == 1)   
+  else if (src_bgr.channels () == 1)
     cv::cvtColor (src_bgr, bgr, cv::COLOR_GRAY2BGR);
-  else                                 
+  else
     src_bgr.copyTo (bgr);
 
-  std::vector<uchar> buf;
-  std::vector<int> params { cv::IMWRITE_JPEG_QUALITY, quality };
-  cv::imencode (".jpg", bgr, buf, params);
-  dst_bgr = cv::imdecode (buf, cv::IMREAD_COLOR);
+  encode_params[1] = quality;
+  cv::imencode (".jpg", bgr, encoded, encode_params);
+  cv::imdecode (encoded, cv::IMREAD_COLOR, &dst_bgr);
 }
 
 private:
-  bool enabled = false;
-  int quality = 80;
+  static void sanitize (params &p)
+  {
+    p.quality = std::clamp (p.quality, 0, 100);
+  }
+
+  param_cell<params> state;
+  std::vector<uchar> encoded;
+  std::vector<int> encode_params { cv::IMWRITE_JPEG_QUALITY, 0 };
 };
 
 }
 
-#endif
\ No newline at end of file
+#endif
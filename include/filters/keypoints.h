@@ -2,6 +2,7 @@
 #define KEYPOINTS_H
 
 #include "filters/filter.h"
+#include "filters/params.h"
 #include <opencv2/opencv.hpp>
 #include <opencv2/features2d.hpp>
 #include <algorithm>
@@ -19,53 +20,105 @@ public:
     orb
   };
 
+  struct params
+  {
+    bool enabled = false;
+    detector_t detector = detector_t::fast;
+    int threshold = 20;
+    int max_features = 500;
+  };
+
   const char *id () const override final { return "keypoints"; }
+  std::shared_ptr<filter> clone () const override final
+  {
+    // each clone may run on its own thread, don't let them share detectors
+    auto copy = std::make_shared<keypoints> (*this);
+    copy->detectors.clear ();
+    copy->detectors_features = -1;
+    return copy;
+  }
+  bool in_place () const override final { return true; }
+  bool needs_color () const override final { return false; }
+  std::string serialize_params () const override final
+  {
+    const auto p = state.load ();
+    return "enabled=" + std::to_string (p->enabled)
+           + " detector=" + std::to_string (static_cast<int> (p->detector))
+           + " threshold=" + std::to_string (p->threshold)
+           + " max_features=" + std::to_string (p->max_features);
+  }
+  bool load_params (const std::string &text) override final
+  {
+    param_reader r (text);
+    modify ([&r] (params &p) {
+      r.get ("enabled", p.enabled);
+      r.get ("detector", p.detector);
+      r.get ("threshold", p.threshold);
+      r.get ("max_features", p.max_features);
+    });
+    return r.ok ();
+  }
 
-  bool is_enabled () const override final { return enabled; }
-  void set_enabled (bool on) override final { enabled = on; }
+  bool is_enabled () const override final { return state.load ()->enabled; }
+  void set_enabled (bool on) override final { modify ([on] (params &p) { p.enabled = on; }); }
 
-  void set_detector (detector_t d) { detector = d; }
-  detector_t get_detector () const { return detector; }
+  void set_detector (detector_t d) { modify ([d] (params &p) { p.detector = d; }); }
+  detector_t get_detector () const { return state.load ()->detector; }
 
   void set_threshold (int v)
   {
-    threshold = std::clamp (v, 1, 100);
+    modify ([v] (params &p) { p.threshold = v; });
   }
-  int get_threshold () const { return threshold; }
+  int get_threshold () const { return state.load ()->threshold; }
 
   void set_max_features (int v)
   {
-    max_features = std::clamp (v, 50, 5000);
+    modify ([v] (params &p) { p.max_features = v; });
+  }
+  int get_max_features () const { return state.load ()->max_features; }
+
+  params get_params () const { return *state.load (); }
+  template <typename Fn> void modify (Fn &&fn) { state.update ([&fn] (params &p) { fn (p); sanitize (p); }); }
+
+  void prepare () override final
+  {
+    const auto p = state.load ();
+    if (p->detector == detector_t::orb)
+      detectors_for (p->max_features);
   }
-  int get_max_features () const { return max_features; }
 
   void apply (const cv::Mat &src_bgr, cv::Mat &dst_bgr) override final
   {
-    if (!enabled)
+    frame_context ctx;
+    apply_shared (src_bgr, dst_bgr, ctx);
+  }
+
+  void apply_shared (const cv::Mat &src_bgr, cv::Mat &dst_bgr, frame_context &ctx) override final
+  {
+    const auto p = state.load ();
+    if (!p->enabled)
     {
       dst_bgr = src_bgr;
       return;
     }
 
-    cv::Mat gray;
-    if (src_bgr.channels () == 1)
-      gray = src_bgr;
-    else
-      cv::cvtColor (src_bgr, gray, cv::COLOR_BGR2GRAY);
+    const cv::Mat gray = ctx.gray (src_bgr);
 
     std::vector<cv::KeyPoint> kps;
 
-    if (detector == detector_t::fast)
+    if (p->detector == detector_t::fast)
     {
-      cv::FAST (gray, kps, threshold, true);
+      cv::FAST (gray, kps, p->threshold, true);
     }
     else
     {
-      auto orb = cv::ORB::create (max_features);
-      orb->detect (gray, kps);
+      detect_orb (ctx, gray, p->max_features, kps);
     }
 
-    dst_bgr = src_bgr.clone ();
+    // detection only needs luma, the marks go on the colour frame
+    const cv::Mat base = ctx.color (src_bgr);
+    if (dst_bgr.data != base.data)
+      base.copyTo (dst_bgr);
     cv::drawKeypoints (
       dst_bgr, kps, dst_bgr,
       cv::Scalar (0, 255, 0),
@@ -74,10 +127,61 @@ public:
   }
 
 private:
-  bool enabled = false;
-  detector_t detector = detector_t::fast;
-  int threshold = 20;
-  int max_features = 500;
+  // ORB on the frame's shared factor-2 pyramid instead of building its own
+  // 1.2 pyramid; each level gets a share of the features by area, as ORB does
+  void detect_orb (frame_context &ctx, const cv::Mat &gray, int max_features, std::vector<cv::KeyPoint> &kps)
+  {
+    const std::vector<cv::Ptr<cv::ORB>> &orbs = detectors_for (max_features);
+    for (int k = 0; k < orb_levels; ++k)
+    {
+      const cv::Mat level = ctx.level (gray, k);
+      // ORB ignores a 31 px border, below this nothing is left
+      if (std::min (level.cols, level.rows) < 96)
+        break;
+
+      std::vector<cv::KeyPoint> found;
+      orbs[k]->detect (level, found);
+
+      const float scale = static_cast<float> (1 << k);
+      for (auto &kp : found)
+      {
+        kp.pt.x *= scale;
+        kp.pt.y *= scale;
+        kp.size *= scale;
+        kp.octave = k;
+        kps.push_back (kp);
+      }
+    }
+  }
+
+  // one detector per level, rebuilt only when max_features changes
+  const std::vector<cv::Ptr<cv::ORB>> &detectors_for (int max_features)
+  {
+    if (detectors_features == max_features)
+      return detectors;
+
+    // 1 + 1/4 + 1/16 + 1/64
+    constexpr double total = 1.328125;
+    detectors.clear ();
+    double share = 1.0;
+    for (int k = 0; k < orb_levels; ++k, share /= 4.0)
+      detectors.push_back (cv::ORB::create (std::max (1, cvRound (max_features * share / total)), 1.2f, 1));
+    detectors_features = max_features;
+    return detectors;
+  }
+
+  static void sanitize (params &p)
+  {
+    p.threshold = std::clamp (p.threshold, 1, 100);
+    p.max_features = std::clamp (p.max_features, 50, 5000);
+  }
+
+  static constexpr int orb_levels = 4;
+
+  param_cell<params> state;
+  // not shared between clones, see clone ()
+  std::vector<cv::Ptr<cv::ORB>> detectors;
+  int detectors_features = -1;
 };
 
 }
@@ -0,0 +1,161 @@
+#ifndef LUMA_STATS_H
+#define LUMA_STATS_H
+
+#include <algorithm>
+#include <array>
+#include <cstdint>
+
+#include <opencv2/opencv.hpp>
+
+namespace filters
+{
+
+// Histogram of an 8-bit luma plane and the automatic thresholds derived
+// from it. Frames of 256×256 and up are sampled on every other row and
+// column, which moves the thresholds by a level at most on real footage.
+struct luma_stats
+{
+  std::array<std::uint32_t, 256> hist {};
+  std::uint64_t count = 0;
+  double mean = 0.0;
+
+  static luma_stats of (const cv::Mat &gray)
+  {
+    luma_stats s;
+    if (gray.empty () || gray.type () != CV_8UC1)
+      return s;
+
+    const int step = gray.rows * gray.cols >= 256 * 256 ? 2 : 1;
+    // four partial histograms so neighbouring samples of the same value
+    // don't wait on each other's increment
+    std::array<std::array<std::uint32_t, 256>, 4> part {};
+    for (int y = 0; y < gray.rows; y += step)
+      {
+        const uchar *p = gray.ptr<uchar> (y);
+        int x = 0;
+        for (; x + 3 * step < gray.cols; x += 4 * step)
+          {
+            ++part[0][p[x]];
+            ++part[1][p[x + step]];
+            ++part[2][p[x + 2 * step]];
+            ++part[3][p[x + 3 * step]];
+          }
+        for (; x < gray.cols; x += step)
+          ++part[0][p[x]];
+      }
+
+    double sum = 0.0;
+    for (int v = 0; v < 256; ++v)
+      {
+        s.hist[v] = part[0][v] + part[1][v] + part[2][v] + part[3][v];
+        s.count += s.hist[v];
+        sum += static_cast<double> (v) * s.hist[v];
+      }
+    s.mean = s.count ? sum / s.count : 0.0;
+    return s;
+  }
+
+  // smallest level that at least a fraction p of the samples don't exceed
+  int percentile (double p) const
+  {
+    if (count == 0)
+      return 0;
+    const double target = std::clamp (p, 0.0, 1.0) * count;
+    std::uint64_t seen = 0;
+    for (int v = 0; v < 256; ++v)
+      {
+        seen += hist[v];
+        if (seen >= target && seen > 0)
+          return v;
+      }
+    return 255;
+  }
+
+  int median () const { return percentile (0.5); }
+
+  // level maximising the between-class variance; pixels above it are
+  // foreground, as with cv::THRESH_OTSU
+  int otsu () const
+  {
+    if (count == 0)
+      return 0;
+
+    double total = 0.0;
+    for (int v = 0; v < 256; ++v)
+      total += static_cast<double> (v) * hist[v];
+
+    double w0 = 0.0, sum0 = 0.0, best = -1.0;
+    int thresh = 0;
+    for (int v = 0; v < 256; ++v)
+      {
+        w0 += hist[v];
+        if (w0 == 0.0)
+          continue;
+        const double w1 = static_cast<double> (count) - w0;
+        if (w1 == 0.0)
+          break;
+        sum0 += static_cast<double> (v) * hist[v];
+        const double d = sum0 / w0 - (total - sum0) / w1;
+        const double between = w0 * w1 * d * d;
+        if (between > best)
+          {
+            best = between;
+            thresh = v;
+          }
+      }
+    return thresh;
+  }
+
+  // the level farthest from the line between the histogram's peak and the
+  // end of its longer tail; suits one dominant mode such as a lit
+  // background, same as cv::THRESH_TRIANGLE
+  int triangle () const
+  {
+    if (count == 0)
+      return 0;
+
+    int left = 0, right = 255, peak = 0;
+    while (left < 255 && hist[left] == 0)
+      ++left;
+    while (right > 0 && hist[right] == 0)
+      --right;
+    if (left > 0)
+      --left;
+    if (right < 255)
+      ++right;
+    for (int v = 0; v < 256; ++v)
+      if (hist[v] > hist[peak])
+        peak = v;
+
+    // work on the left tail, mirroring the histogram if the right one is
+    // longer
+    std::array<std::uint32_t, 256> h = hist;
+    const bool flip = peak - left < right - peak;
+    if (flip)
+      {
+        std::reverse (h.begin (), h.end ());
+        left = 255 - right;
+        peak = 255 - peak;
+      }
+
+    int thresh = left;
+    const double a = h[peak];
+    const double b = left - peak;
+    double dist = 0.0;
+    for (int v = left + 1; v <= peak; ++v)
+      {
+        const double d = a * v + b * h[v];
+        if (d > dist)
+          {
+            dist = d;
+            thresh = v;
+          }
+      }
+    thresh = std::max (0, thresh - 1);
+    return flip ? 255 - thresh : thresh;
+  }
+};
+
+}
+
+#endif
@@ -2,6 +2,7 @@
 #define MORPHOLOGY_H
 
 #include "filters/filter.h"
+#include "filters/params.h"
 #include <opencv2/opencv.hpp>
 #include <algorithm>
 
@@ -19,31 +20,72 @@ public:
     close
   };
 
+  struct params
+  {
+    bool enabled = false;
+    op_t op = op_t::open;
+    int kernel_size = 3;
+    int iterations = 1;
+  };
+
   const char *id () const override final { return "morphology"; }
+  std::shared_ptr<filter> clone () const override final { return std::make_shared<morphology> (*this); }
+  bool in_place () const override final { return true; }
+  bool needs_color () const override final { return false; }
+  int halo () const override final
+  {
+    // open and close run the kernel twice per iteration
+    const auto p = state.load ();
+    const int passes = (p->op == op_t::open || p->op == op_t::close) ? 2 : 1;
+    return p->kernel_size / 2 * p->iterations * passes;
+  }
+  std::string serialize_params () const override final
+  {
+    const auto p = state.load ();
+    return "enabled=" + std::to_string (p->enabled)
+           + " op=" + std::to_string (static_cast<int> (p->op))
+           + " kernel_size=" + std::to_string (p->kernel_size)
+           + " iterations=" + std::to_string (p->iterations);
+  }
+  bool load_params (const std::string &text) override final
+  {
+    param_reader r (text);
+    modify ([&r] (params &p) {
+      r.get ("enabled", p.enabled);
+      r.get ("op", p.op);
+      r.get ("kernel_size", p.kernel_size);
+      r.get ("iterations", p.iterations);
+    });
+    return r.ok ();
+  }
 
-  bool is_enabled () const override final { return enabled; }
-  void set_enabled (bool on) override final { enabled = on; }
+  bool is_enabled () const override final { return state.load ()->enabled; }
+  void set_enabled (bool on) override final { modify ([on] (params &p) { p.enabled = on; }); }
 
-  void set_op (op_t o) { op = o; }
-  op_t get_op () const { return op; }
+  void set_op (op_t o) { modify ([o] (params &p) { p.op = o; }); }
+  op_t get_op () const { return state.load ()->op; }
 
   void set_kernel_size (int v)
   {
-    v = std::max (1, v);
-    if ((v % 2) == 0) ++v;
-    kernel_size = v;
+    modify ([v] (params &p) { p.kernel_size = v; });
   }
-  int get_kernel_size () const { return kernel_size; }
+  int get_kernel_size () const { return state.load ()->kernel_size; }
 
   void set_iterations (int v)
   {
-    iterations = std::max (1, v);
+    modify ([v] (params &p) { p.iterations = v; });
   }
-  int get_iterations () const { return iterations; }
+  int get_iterations () const { return state.load ()->iterations; }
+
+  params get_params () const { return *state.load (); }
+  template <typename Fn> void modify (Fn &&fn) { state.update ([&fn] (params &p) { fn (p); sanitize (p); }); }
+
+  void prepare () override final { kernel_for (state.load ()->kernel_size); }
 
   void apply (const cv::Mat &src_bgr, cv::Mat &dst_bgr) override final
   {
-    if (!enabled)
+    const auto p = state.load ();
+    if (!p->enabled)
     {
       dst_bgr = src_bgr;
       return;
@@ -58,14 +100,13 @@ public:
     cv::Mat bin;
     cv::threshold (gray, bin, 128, 255, cv::THRESH_BINARY);
 
-    cv::Mat kernel = cv::getStructuringElement (
-      cv::MORPH_RECT,
-      cv::Size (kernel_size, kernel_size)
-    );
+    const cv::Mat kernel = kernel_for (p->kernel_size);
 
     cv::Mat out;
 
-    switch (op)
+    const int iterations = p->iterations;
+
+    switch (p->op)
     {
       case op_t::erode:
         cv::erode (bin, out, kernel, cv::Point (-1, -1), iterations);
@@ -90,10 +131,23 @@ public:
   }
 
 private:
-  bool enabled = false;
-  op_t op = op_t::open;
-  int kernel_size = 3;
-  int iterations = 1;
+  // rebuilt only when the size changes; clones share it read-only
+  const cv::Mat &kernel_for (int size)
+  {
+    if (kernel.rows != size)
+      kernel = cv::getStructuringElement (cv::MORPH_RECT, cv::Size (size, size));
+    return kernel;
+  }
+
+  static void sanitize (params &p)
+  {
+    p.kernel_size = std::max (1, p.kernel_size);
+    if ((p.kernel_size % 2) == 0) ++p.kernel_size;
+    p.iterations = std::max (1, p.iterations);
+  }
+
+  param_cell<params> state;
+  cv::Mat kernel;
 };
 
 }
@@ -0,0 +1,138 @@
+#ifndef PARAMS_H
+#define PARAMS_H
+
+#include <algorithm>
+#include <atomic>
+#include <charconv>
+#include <memory>
+#include <string>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+namespace filters
+{
+
+// Holds an immutable parameter struct behind an atomic pointer. Readers take
+// one consistent snapshot per frame without locking; writers publish a whole
+// new struct, so several changes made in one update become visible together.
+template <typename T>
+class param_cell
+{
+public:
+  param_cell () : current (std::make_shared<const T> ()) {}
+  param_cell (const param_cell &other) : current (other.load ()) {}
+  param_cell &operator= (const param_cell &other)
+  {
+    current.store (other.load (), std::memory_order_release);
+    return *this;
+  }
+
+  std::shared_ptr<const T> load () const { return current.load (std::memory_order_acquire); }
+
+  void store (const T &value) { current.store (std::make_shared<const T> (value), std::memory_order_release); }
+
+  template <typename Fn>
+  void update (Fn &&fn)
+  {
+    std::shared_ptr<const T> expected = load ();
+    for (;;)
+      {
+        auto next = std::make_shared<T> (*expected);
+        fn (*next);
+        if (current.compare_exchange_weak (expected, std::shared_ptr<const T> (std::move (next)),
+                                           std::memory_order_acq_rel, std::memory_order_acquire))
+          return;
+      }
+  }
+
+private:
+  std::atomic<std::shared_ptr<const T>> current;
+};
+
+// Shortest text that reads back as exactly v; std::to_string rounds to six
+// decimals and follows the C locale's decimal point
+inline std::string param_text (double v)
+{
+  char text[32];
+  const auto [end, ec] = std::to_chars (text, text + sizeof (text), v);
+  return std::string (text, ec == std::errc () ? end : text);
+}
+
+// Reads serialize_params () text back, e.g. "enabled=1 ksize=5"; numbers
+// are parsed with std::from_chars, independent of the locale. get ()
+// leaves the value alone when the key is absent; a value that doesn't parse
+// also leaves it alone and makes ok () false.
+class param_reader
+{
+public:
+  explicit param_reader (const std::string &text)
+  {
+    std::size_t pos = 0;
+    while (pos < text.size ())
+      {
+        const std::size_t end = std::min (text.find (' ', pos), text.size ());
+        const std::size_t eq = text.find ('=', pos);
+        if (eq < end)
+          pairs.emplace_back (text.substr (pos, eq - pos), text.substr (eq + 1, end - eq - 1));
+        else if (end > pos)
+          good = false;
+        pos = end + 1;
+      }
+  }
+
+  template <typename T>
+  void get (const char *key, T &value)
+  {
+    for (const auto &[k, v] : pairs)
+      {
+        if (k != key)
+          continue;
+        if (!parse (v, value))
+          good = false;
+        return;
+      }
+  }
+
+  bool ok () const { return good; }
+
+private:
+  template <typename T>
+  static bool parse (const std::string &text, T &value)
+  {
+    const char *first = text.data ();
+    const char *last = first + text.size ();
+    if constexpr (std::is_enum_v<T>)
+      {
+        int v = 0;
+        if (!parse (text, v))
+          return false;
+        value = static_cast<T> (v);
+        return true;
+      }
+    else if constexpr (std::is_same_v<T, bool>)
+      {
+        int v = 0;
+        if (!parse (text, v))
+          return false;
+        value = v != 0;
+        return true;
+      }
+    else
+      {
+        T v {};
+        const auto [end, ec] = std::from_chars (first, last, v);
+        if (ec != std::errc () || end != last)
+          return false;
+        value = v;
+        return true;
+      }
+  }
+
+  std::vector<std::pair<std::string, std::string>> pairs;
+  bool good = true;
+};
+
+}
+
+#endif
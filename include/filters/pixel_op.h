@@ -0,0 +1,34 @@
+#ifndef PIXEL_OP_H
+#define PIXEL_OP_H
+
+#include <concepts>
+
+#include <opencv2/opencv.hpp>
+
+namespace filters
+{
+
+// A filter whose output pixel depends only on the same input pixel can hand
+// out its current parameters as a small value type that static_pipeline
+// inlines into one loop with its neighbours:
+//
+//   struct pixel_op { void operator() (uchar &b, uchar &g, uchar &r) const; };
+//   bool get_pixel_op (pixel_op &op) const;  // false: not per-pixel right now
+//
+// A disabled stage returns an op that leaves the pixel alone.
+template <typename F>
+concept per_pixel = requires (const F &f, typename F::pixel_op &op, uchar &c) {
+  { f.get_pixel_op (op) } -> std::same_as<bool>;
+  op (c, c, c);
+};
+
+// cvtColor's fixed-point BGR2GRAY, so fused stages match the unfused ones
+// bit for bit
+inline uchar luma (int b, int g, int r)
+{
+  return static_cast<uchar> ((b * 1868 + g * 9617 + r * 4899 + 8192) >> 14);
+}
+
+}
+
+#endif
@@ -1,7 +1,8 @@
 #ifndef PIXEL_SORT_H
-#define PIxEL_SORT_H
+#define PIXEL_SORT_H
 
 #include "filters/filter.h"
+#include "filters/params.h"
 
 namespace filters
 {
@@ -11,45 +12,81 @@ class pixel_sort final : public filter
 public:
   enum class axis_t { horizontal, vertical };
 
+  struct params
+  {
+    bool enabled = false;
+    axis_t axis = axis_t::vertical;
+    int chunk = 32;
+    int stride = 1;
+    bool reverse = false;
+  };
+
   const char *id () const override final { return "pixel_sort"; }
+  std::shared_ptr<filter> clone () const override final { return std::make_shared<pixel_sort> (*this); }
+  bool in_place () const override final { return true; }
+  std::string serialize_params () const override final
+  {
+    const auto p = state.load ();
+    return "enabled=" + std::to_string (p->enabled)
+           + " axis=" + std::to_string (static_cast<int> (p->axis))
+           + " chunk=" + std::to_string (p->chunk)
+           + " stride=" + std::to_string (p->stride)
+           + " reverse=" + std::to_string (p->reverse);
+  }
+  bool load_params (const std::string &text) override final
+  {
+    param_reader r (text);
+    modify ([&r] (params &p) {
+      r.get ("enabled", p.enabled);
+      r.get ("axis", p.axis);
+      r.get ("chunk", p.chunk);
+      r.get ("stride", p.stride);
+      r.get ("reverse", p.reverse);
+    });
+    return r.ok ();
+  }
+
+  bool is_enabled () const override final { return state.load ()->enabled; }
+  void set_enabled (bool on) override final { modify ([on] (params &p) { p.enabled = on; }); }
 
-  bool is_enabled () const override final { return enabled; }
-  void set_enabled (bool on) override final { enabled = on; }
+  void set_axis (axis_t a) { modify ([a] (params &p) { p.axis = a; }); }
+  axis_t get_axis () const { return state.load ()->axis; }
 
-  void set_axis (axis_t a) { axis = a; }
-  axis_t get_axis () const { return axis; }
+  void set_chunk (int value) { modify ([value] (params &p) { p.chunk = value; }); }
+  int get_chunk () const { return state.load ()->chunk; }
 
-  void set_chunk (int value) { chunk = std::max (1, value); }
-  int get_chunk () const { return chunk; }
+  void set_reverse (bool on) { modify ([on] (params &p) { p.reverse = on; }); }
+  bool get_reverse () const { return state.load ()->reverse; }
 
-  void set_reverse (bool on) { reverse = on; }
-  bool get_reverse () const { return reverse; }
+  void set_stride (int s) { modify ([s] (params &p) { p.stride = s; }); }
+  int get_stride () const { return state.load ()->stride; }
 
-  void set_stride (int s) { stride = std::max (1, s); }
-  int get_stride () const { return stride; }
+  params get_params () const { return *state.load (); }
+  template <typename Fn> void modify (Fn &&fn) { state.update ([&fn] (params &p) { fn (p); sanitize (p); }); }
 
   void apply (const cv::Mat &src_bgr, cv::Mat &dst_bgr) override final
   {
-    if (!enabled)
+    const auto p = state.load ();
+    if (!p->enabled)
     {
       dst_bgr = src_bgr;
       return;
     }
 
-    cv::Mat bgr;
     if (src_bgr.channels () == 3) 
-      bgr = src_bgr;
+      {
+        if (dst_bgr.data != src_bgr.data)
+          src_bgr.copyTo (dst_bgr);
+      }
     else if (src_bgr.channels () == 4) 
-      cv::cvtColor (src_bgr, bgr, cv::COLOR_BGRA2BGR);
+      cv::cvtColor (src_bgr, dst_bgr, cv::COLOR_BGRA2BGR);
     else                               
-      cv::cvtColor (src_bgr, bgr, cv::COLOR_GRAY2BGR);
+      cv::cvtColor (src_bgr, dst_bgr, cv::COLOR_GRAY2BGR);
 
-    dst_bgr = bgr.clone ();
-
-    if (axis == axis_t::horizontal)
-      sort_rows (dst_bgr);
+    if (p->axis == axis_t::horizontal)
+      sort_rows (dst_bgr, *p);
     else
-      sort_cols (dst_bgr);
+      sort_cols (dst_bgr, *p);
   }
 
 private:
@@ -59,69 +96,87 @@ private:
     return 29 * b + 150 * g + 77 * r;
   }
 
-  void sort_rows (cv::Mat &img)
+  // rows (and columns) are independent, so they are split across threads;
+  // cv::parallel_for_ runs on core::thread_pool::shared () when OpenCV
+  // supports a custom backend
+  static void sort_rows (cv::Mat &img, const params &p)
   {
     const int rows = img.rows, cols = img.cols;
-    std::vector<std::pair<int, cv::Vec3b>> buf;
-    buf.reserve (chunk);
-
-    for (int y = 0; y < rows; y += stride)
-      {
-        cv::Vec3b *row = img.ptr<cv::Vec3b> (y);
-        for (int x = 0; x < cols; x += chunk)
-          {
-            const int w = std::min (chunk, cols - x);
-            buf.resize (w);
-            for (int i = 0; i < w; ++i)
-              buf[i] = { luma_key (row[x + i]), row[x + i] };
-
-            if (!reverse)
-              std::sort (buf.begin (), buf.end (), [] (auto &a, auto &b) { return a.first < b.first; });
-            else
-              std::sort (buf.begin (), buf.end (), [] (auto &a, auto &b) { return a.first > b.first; });
-
-            for (int i = 0; i < w; ++i)
-              row[x + i] = buf[i].second;
-          }
-      }
+    const int chunk = p.chunk, stride = p.stride;
+    const bool reverse = p.reverse;
+    const int lines = (rows + stride - 1) / stride;
+
+    cv::parallel_for_ (cv::Range (0, lines), [&] (const cv::Range &range) {
+      std::vector<std::pair<int, cv::Vec3b>> buf;
+      buf.reserve (chunk);
+
+      for (int line = range.start; line < range.end; ++line)
+        {
+          cv::Vec3b *row = img.ptr<cv::Vec3b> (line * stride);
+          for (int x = 0; x < cols; x += chunk)
+            {
+              const int w = std::min (chunk, cols - x);
+              buf.resize (w);
+              for (int i = 0; i < w; ++i)
+                buf[i] = { luma_key (row[x + i]), row[x + i] };
+
+              if (!reverse)
+                std::sort (buf.begin (), buf.end (), [] (auto &a, auto &b) { return a.first < b.first; });
+              else
+                std::sort (buf.begin (), buf.end (), [] (auto &a, auto &b) { return a.first > b.first; });
+
+              for (int i = 0; i < w; ++i)
+                row[x + i] = buf[i].second;
+            }
+        }
+    });
   }
 
-  void sort_cols (cv::Mat &img)
+  static void sort_cols (cv::Mat &img, const params &p)
   {
     const int rows = img.rows, cols = img.cols;
-    std::vector<std::pair<int, cv::Vec3b>> buf;
-    buf.reserve (chunk);
+    const int chunk = p.chunk, stride = p.stride;
+    const bool reverse = p.reverse;
+    const int lines = (cols + stride - 1) / stride;
+
+    cv::parallel_for_ (cv::Range (0, lines), [&] (const cv::Range &range) {
+      std::vector<std::pair<int, cv::Vec3b>> buf;
+      buf.reserve (chunk);
+
+      for (int line = range.start; line < range.end; ++line)
+        {
+          const int x = line * stride;
+          for (int y0 = 0; y0 < rows; y0 += chunk)
+            {
+              const int h = std::min (chunk, rows - y0);
+              buf.resize (h);
+
+              for (int i = 0; i < h; ++i)
+                {
+                  const cv::Vec3b &pix = img.at<cv::Vec3b> (y0 + i, x);
+                  buf[i] = { luma_key (pix), pix };
+                }
+
+              if (!reverse)
+                std::sort (buf.begin (), buf.end (), [] (auto &a, auto &b) { return a.first < b.first; });
+              else
+                std::sort (buf.begin (), buf.end (), [] (auto &a, auto &b) { return a.first > b.first; });
+
+              for (int i = 0; i < h; ++i)
+                img.at<cv::Vec3b> (y0 + i, x) = buf[i].second;
+            }
+        }
+    });
+  }
 
-    for (int x = 0; x < cols; x += stride)
-      {
-        for (int y0 = 0; y0 < rows; y0 += chunk)
-          {
-            const int h = std::min (chunk, rows - y0);
-            buf.resize (h);
-
-            for (int i = 0; i < h; ++i)
-              {
-                const cv::Vec3b &pix = img.at<cv::Vec3b> (y0 + i, x);
-                buf[i] = { luma_key (pix), pix };
-              }
-
-            if (!reverse)
-              std::sort (buf.begin (), buf.end (), [] (auto &a, auto &b) { return a.first < b.first; });
-            else
-              std::sort (buf.begin (), buf.end (), [] (auto &a, auto &b) { return a.first > b.first; });
-
-            for (int i = 0; i < h; ++i)
-              img.at<cv::Vec3b> (y0 + i, x) = buf[i].second;
-          }
-      }
+  static void sanitize (params &p)
+  {
+    p.chunk = std::max (1, p.chunk);
+    p.stride = std::max (1, p.stride);
   }
 
 private:
-  bool enabled = false;
-  axis_t axis = axis_t::vertical;
-  int chunk = 32;
-  int stride = 1;
-  bool reverse = false;
+  param_cell<params> state;
 };
 
 }
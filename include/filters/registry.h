@@ -0,0 +1,58 @@
+#ifndef REGISTRY_H
+#define REGISTRY_H
+
+#include <memory>
+#include <string>
+
+#include "filters/filter.h"
+#include "filters/grayscale.h"
+#include "filters/blur.h"
+#include "filters/canny.h"
+#include "filters/jpeg.h"
+#include "filters/sharpen.h"
+#include "filters/pixel_sort.h"
+#include "filters/threshold.h"
+#include "filters/morphology.h"
+#include "filters/contours.h"
+#include "filters/keypoints.h"
+#include "filters/affine.h"
+#include "filters/glitch.h"
+
+namespace filters
+{
+
+// A default-constructed filter for an id () value, null for ids it doesn't
+// know (static_pipeline chains among them); rebuilds a chain from its
+// description, see core::session_log
+inline std::shared_ptr<filter> make_filter (const std::string &id)
+{
+  if (id == "grayscale")
+    return std::make_shared<grayscale> ();
+  if (id == "blur")
+    return std::make_shared<blur> ();
+  if (id == "canny")
+    return std::make_shared<canny> ();
+  if (id == "jpeg")
+    return std::make_shared<jpeg> ();
+  if (id == "sharpen")
+    return std::make_shared<sharpen> ();
+  if (id == "pixel_sort")
+    return std::make_shared<pixel_sort> ();
+  if (id == "threshold")
+    return std::make_shared<threshold> ();
+  if (id == "morphology")
+    return std::make_shared<morphology> ();
+  if (id == "contours")
+    return std::make_shared<contours> ();
+  if (id == "keypoints")
+    return std::make_shared<keypoints> ();
+  if (id == "affine")
+    return std::make_shared<affine> ();
+  if (id == "glitch")
+    return std::make_shared<glitch> ();
+  return nullptr;
+}
+
+}
+
+#endif
@@ -2,6 +2,7 @@
 #define SHARPEN_H
 
 #include "filters/filter.h"
+#include "filters/params.h"
 
 namespace filters
 {
@@ -9,33 +10,67 @@ namespace filters
 class sharpen final : public filter
 {
 public:
+  struct params
+  {
+    bool enabled = false;
+    double amount = 1.0;
+    int radius = 3;
+    int threshold = 10;
+  };
+
   const char *id () const override final { return "sharpen"; }
+  std::shared_ptr<filter> clone () const override final { return std::make_shared<sharpen> (*this); }
+  bool in_place () const override final { return true; }
+  int halo () const override final { return state.load ()->radius; }
+  std::string serialize_params () const override final
+  {
+    const auto p = state.load ();
+    return "enabled=" + std::to_string (p->enabled)
+           + " amount=" + param_text (p->amount)
+           + " radius=" + std::to_string (p->radius)
+           + " threshold=" + std::to_string (p->threshold);
+  }
+  bool load_params (const std::string &text) override final
+  {
+    param_reader r (text);
+    modify ([&r] (params &p) {
+      r.get ("enabled", p.enabled);
+      r.get ("amount", p.amount);
+      r.get ("radius", p.radius);
+      r.get ("threshold", p.threshold);
+    });
+    return r.ok ();
+  }
 
-  bool is_enabled () const override final { return enabled; }
-  void set_enabled (bool on) override final { enabled = on; }
+  bool is_enabled () const override final { return state.load ()->enabled; }
+  void set_enabled (bool on) override final { modify ([on] (params &p) { p.enabled = on; }); }
 
   void set_amount (double value)
   {
-    amount = std::clamp (value, 0.0, 3.0);
+    modify ([value] (params &p) { p.amount = value; });
   }
 
   void set_radius (int value)
   {
-    radius = std::clamp (value, 1, 15);
+    modify ([value] (params &p) { p.radius = value; });
   }
 
   void set_threshold (int value)
   {
-    threshold = std::clamp (value, 0, 255);
+    modify ([value] (params &p) { p.threshold = value; });
   }
 
-  double get_amount () const { return amount; }
-  int get_radius () const { return radius; }
-  int get_threshold () const { return threshold; }
+  double get_amount () const { return state.load ()->amount; }
+  int get_radius () const { return state.load ()->radius; }
+  int get_threshold () const { return state.load ()->threshold; }
+
+  params get_params () const { return *state.load (); }
+  template <typename Fn> void modify (Fn &&fn) { state.update ([&fn] (params &p) { fn (p); sanitize (p); }); }
 
   void apply (const cv::Mat &src_bgr, cv::Mat &dst_bgr) override final
   {
-    if (!enabled)
+    const auto p = state.load ();
+    if (!p->enabled)
     {
       dst_bgr = src_bgr;
       return;
@@ -43,24 +78,29 @@ public:
 
     cv::Mat blurred, low_contrast_mask, sharpened;
 
-    cv::GaussianBlur (src_bgr, blurred, cv::Size (radius * 2 + 1, radius * 2 + 1), 0);
+    cv::GaussianBlur (src_bgr, blurred, cv::Size (p->radius * 2 + 1, p->radius * 2 + 1), 0);
 
-    cv::addWeighted (src_bgr, 1.0 + amount, blurred, -amount, 0, sharpened);
+    cv::addWeighted (src_bgr, 1.0 + p->amount, blurred, -p->amount, 0, sharpened);
 
     cv::Mat diff;
     cv::absdiff (src_bgr, blurred, diff);
     cv::cvtColor (diff, diff, cv::COLOR_BGR2GRAY);
-    cv::threshold (diff, low_contrast_mask, threshold, 255, cv::THRESH_BINARY);
+    cv::threshold (diff, low_contrast_mask, p->threshold, 255, cv::THRESH_BINARY);
 
-    dst_bgr = src_bgr.clone ();
+    if (dst_bgr.data != src_bgr.data)
+      src_bgr.copyTo (dst_bgr);
     sharpened.copyTo (dst_bgr, low_contrast_mask);
   }
 
 private:
-  bool enabled = false;
-  double amount = 1.0;
-  int radius = 3;
-  int threshold = 10;
+  static void sanitize (params &p)
+  {
+    p.amount = std::clamp (p.amount, 0.0, 3.0);
+    p.radius = std::clamp (p.radius, 1, 15);
+    p.threshold = std::clamp (p.threshold, 0, 255);
+  }
+
+  param_cell<params> state;
 };
 
 }
@@ -0,0 +1,284 @@
+#ifndef STATIC_PIPELINE_H
+#define STATIC_PIPELINE_H
+
+#include <tuple>
+#include <type_traits>
+#include <utility>
+
+#include "filters/filter.h"
+#include "filters/params.h"
+#include "filters/pixel_op.h"
+
+namespace filters
+{
+
+// A fixed chain of concrete filters known at compile time, e.g.
+// static_pipeline<grayscale, threshold, morphology>. Stages are held by
+// value and called without virtual dispatch; adjacent per_pixel stages run
+// as one fused loop over the frame. To the engine the whole chain is a
+// single filter, and stage<I> () / get<F> () replace find_filter lookups.
+template <typename... Fs>
+class static_pipeline final : public filter
+{
+  static_assert (sizeof... (Fs) > 0, "static_pipeline needs at least one stage");
+  static_assert ((std::is_base_of_v<filter, Fs> && ...), "stages must be filters");
+
+public:
+  static constexpr std::size_t size = sizeof... (Fs);
+
+  struct params
+  {
+    bool enabled = true;
+  };
+
+  const char *id () const override final { return "static_pipeline"; }
+  std::shared_ptr<filter> clone () const override final
+  {
+    auto copy = std::make_shared<static_pipeline> (*this);
+    // scratch buffers are per instance
+    copy->scratch[0].release ();
+    copy->scratch[1].release ();
+    return copy;
+  }
+
+  bool is_enabled () const override final { return state.load ()->enabled; }
+  void set_enabled (bool on) override final { state.update ([on] (params &p) { p.enabled = on; }); }
+
+  int halo () const override final
+  {
+    int total = 0;
+    bool local = true;
+    for_each ([&] (const filter &f) {
+      if (!f.is_enabled ())
+        return;
+      const int h = f.halo ();
+      local = local && h >= 0;
+      total += h;
+    });
+    return local ? total : -1;
+  }
+
+  // stages only see a luma plane when none of them wants colour
+  bool needs_color () const override final
+  {
+    bool any = false;
+    for_each ([&any] (const filter &f) { any = any || (f.is_enabled () && f.needs_color ()); });
+    return any;
+  }
+
+  // stage parameters prefixed with the stage id, e.g. threshold.thresh=128
+  std::string serialize_params () const override final
+  {
+    std::string out;
+    for_each ([&] (const filter &f) {
+      const std::string params = f.serialize_params ();
+      std::size_t pos = 0;
+      while (pos < params.size ())
+        {
+          const std::size_t end = std::min (params.find (' ', pos), params.size ());
+          if (!out.empty ())
+            out += ' ';
+          out += std::string (f.id ()) + '.' + params.substr (pos, end - pos);
+          pos = end + 1;
+        }
+    });
+    return out;
+  }
+
+  // each stage reads the keys carrying its id
+  bool load_params (const std::string &text) override final
+  {
+    bool ok = true;
+    std::apply ([&] (auto &... s) { ((ok = s.load_params (stage_params (text, s.id ())) && ok), ...); }, stages);
+    return ok;
+  }
+
+  void prepare () override final
+  {
+    std::apply ([] (auto &... s) { (s.prepare (), ...); }, stages);
+  }
+
+  template <std::size_t I> auto &stage () { return std::get<I> (stages); }
+  template <typename F> F &get () { return std::get<F> (stages); }
+
+  void apply (const cv::Mat &src_bgr, cv::Mat &dst_bgr) override final
+  {
+    frame_context ctx;
+    apply_shared (src_bgr, dst_bgr, ctx);
+  }
+
+  void apply_shared (const cv::Mat &src_bgr, cv::Mat &dst_bgr, frame_context &ctx) override final
+  {
+    if (!is_enabled ())
+      {
+        dst_bgr = src_bgr;
+        return;
+      }
+
+    cv::Mat cur = src_bgr;
+    run_from<0> (cur, dst_bgr, ctx);
+  }
+
+private:
+  template <std::size_t I> using stage_t = std::tuple_element_t<I, std::tuple<Fs...>>;
+
+  // filters that override apply_shared want the frame context, the others
+  // are called through apply () directly
+  template <typename F>
+  static constexpr bool uses_context = !std::is_same_v<decltype (&F::apply_shared), decltype (&filter::apply_shared)>;
+
+  static std::string stage_params (const std::string &text, const std::string &id)
+  {
+    const std::string prefix = id + '.';
+    std::string out;
+    std::size_t pos = 0;
+    while (pos < text.size ())
+      {
+        const std::size_t end = std::min (text.find (' ', pos), text.size ());
+        if (text.compare (pos, prefix.size (), prefix) == 0)
+          {
+            if (!out.empty ())
+              out += ' ';
+            out += text.substr (pos + prefix.size (), end - pos - prefix.size ());
+          }
+        pos = end + 1;
+      }
+    return out;
+  }
+
+  // end of the run of per_pixel stages starting at I
+  template <std::size_t I>
+  static constexpr std::size_t run_end ()
+  {
+    // nested so stage_t<size> is never named
+    if constexpr (I < size)
+      {
+        if constexpr (per_pixel<stage_t<I>>)
+          return run_end<I + 1> ();
+        else
+          return I;
+      }
+    else
+      {
+        return I;
+      }
+  }
+
+  template <typename Fn>
+  void for_each (Fn &&fn) const
+  {
+    std::apply ([&fn] (const auto &... s) { (fn (s), ...); }, stages);
+  }
+
+  // the last stage writes straight into dst, the others into scratch
+  cv::Mat &target_for (const cv::Mat &cur, cv::Mat &dst, bool last)
+  {
+    if (last)
+      return dst;
+    return cur.data == scratch[0].data && !scratch[0].empty () ? scratch[1] : scratch[0];
+  }
+
+  // a stage that passed its input through leaves cur as it was; when that
+  // was a scratch buffer and the stage was the last one, the buffer is
+  // handed to the caller instead of being overwritten next frame
+  void advance (cv::Mat &cur, cv::Mat &out, bool last)
+  {
+    if (out.data == cur.data)
+      {
+        if (last)
+          {
+            for (auto &buffer : scratch)
+              if (buffer.data == cur.data)
+                buffer.release ();
+            return;
+          }
+        out.release ();
+        return;
+      }
+    cur = out;
+  }
+
+  template <std::size_t I>
+  void run_from (cv::Mat &cur, cv::Mat &dst, frame_context &ctx)
+  {
+    if constexpr (I < size)
+      {
+        constexpr std::size_t end = run_end<I> ();
+        if constexpr (end - I >= 2)
+          {
+            const bool last = end == size;
+            cv::Mat &out = target_for (cur, dst, last);
+            if (!last)
+              ctx.invalidate (out);
+            if (cur.type () == CV_8UC3 && run_fused<I> (cur, out, std::make_index_sequence<end - I> ()))
+              {
+                cur = out;
+                run_from<end> (cur, dst, ctx);
+              }
+            else
+              {
+                // some stage isn't per-pixel with its current parameters
+                run_single<I> (cur, dst, ctx);
+                run_from<I + 1> (cur, dst, ctx);
+              }
+          }
+        else
+          {
+            run_single<I> (cur, dst, ctx);
+            run_from<I + 1> (cur, dst, ctx);
+          }
+      }
+  }
+
+  template <std::size_t I>
+  void run_single (cv::Mat &cur, cv::Mat &dst, frame_context &ctx)
+  {
+    using F = stage_t<I>;
+    F &s = std::get<I> (stages);
+    const bool last = I + 1 == size;
+    cv::Mat &out = target_for (cur, dst, last);
+
+    if (!last)
+      ctx.invalidate (out);
+    if constexpr (uses_context<F>)
+      s.F::apply_shared (cur, out, ctx);
+    else
+      s.F::apply (cur, out);
+    advance (cur, out, last);
+  }
+
+  template <std::size_t I, std::size_t... K>
+  bool run_fused (const cv::Mat &in, cv::Mat &out, std::index_sequence<K...>)
+  {
+    std::tuple<typename stage_t<I + K>::pixel_op...> ops;
+    if (!(std::get<I + K> (stages).get_pixel_op (std::get<K> (ops)) && ...))
+      return false;
+
+    out.create (in.size (), CV_8UC3);
+    cv::parallel_for_ (cv::Range (0, in.rows), [&] (const cv::Range &range) {
+      for (int y = range.start; y < range.end; ++y)
+        {
+          const uchar *s = in.ptr<uchar> (y);
+          uchar *d = out.ptr<uchar> (y);
+          for (int x = 0; x < in.cols; ++x, s += 3, d += 3)
+            {
+              uchar b = s[0], g = s[1], r = s[2];
+              (std::get<K> (ops) (b, g, r), ...);
+              d[0] = b;
+              d[1] = g;
+              d[2] = r;
+            }
+        }
+    });
+    return true;
+  }
+
+  std::tuple<Fs...> stages;
+  param_cell<params> state;
+  // never aliases the input: stages that pass through don't keep it
+  cv::Mat scratch[2];
+};
+
+}
+
+#endif
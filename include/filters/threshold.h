@@ -2,6 +2,8 @@
 #define THRESHOLD_H
 
 #include "filters/filter.h"
+#include "filters/params.h"
+#include "filters/pixel_op.h"
 #include <opencv2/opencv.hpp>
 #include <algorithm>
 
@@ -15,51 +17,128 @@ public:
   {
     binary,
     adaptive_mean,
-    adaptive_gaussian
+    adaptive_gaussian,
+    // level picked from the frame's histogram, see luma_stats
+    otsu,
+    triangle
+  };
+
+  struct params
+  {
+    bool enabled = false;
+    mode_t mode = mode_t::binary;
+    int thresh = 128;
+    int block_size = 11;
+    int c = 2;
   };
 
   const char *id () const override final { return "threshold"; }
+  std::shared_ptr<filter> clone () const override final { return std::make_shared<threshold> (*this); }
+  bool in_place () const override final { return true; }
+  bool needs_color () const override final { return false; }
+  int halo () const override final
+  {
+    const auto p = state.load ();
+    switch (p->mode)
+      {
+      case mode_t::binary:
+        return 0;
+      case mode_t::adaptive_mean:
+      case mode_t::adaptive_gaussian:
+        return p->block_size / 2;
+      default:
+        // the level depends on the whole frame
+        return -1;
+      }
+  }
+  std::string serialize_params () const override final
+  {
+    const auto p = state.load ();
+    return "enabled=" + std::to_string (p->enabled)
+           + " mode=" + std::to_string (static_cast<int> (p->mode))
+           + " thresh=" + std::to_string (p->thresh)
+           + " block_size=" + std::to_string (p->block_size)
+           + " c=" + std::to_string (p->c);
+  }
+  bool load_params (const std::string &text) override final
+  {
+    param_reader r (text);
+    modify ([&r] (params &p) {
+      r.get ("enabled", p.enabled);
+      r.get ("mode", p.mode);
+      r.get ("thresh", p.thresh);
+      r.get ("block_size", p.block_size);
+      r.get ("c", p.c);
+    });
+    return r.ok ();
+  }
 
-  bool is_enabled () const override final { return enabled; }
-  void set_enabled (bool on) override final { enabled = on; }
+  bool is_enabled () const override final { return state.load ()->enabled; }
+  void set_enabled (bool on) override final { modify ([on] (params &p) { p.enabled = on; }); }
 
-  void set_mode (mode_t m) { mode = m; }
-  mode_t get_mode () const { return mode; }
+  void set_mode (mode_t m) { modify ([m] (params &p) { p.mode = m; }); }
+  mode_t get_mode () const { return state.load ()->mode; }
 
-  void set_thresh (int v) { thresh = std::clamp (v, 0, 255); }
-  int get_thresh () const { return thresh; }
+  void set_thresh (int v) { modify ([v] (params &p) { p.thresh = v; }); }
+  int get_thresh () const { return state.load ()->thresh; }
 
   void set_block_size (int v)
   {
-    v = std::max (3, v);
-    if ((v % 2) == 0) ++v;
-    block_size = v;
+    modify ([v] (params &p) { p.block_size = v; });
   }
-  int get_block_size () const { return block_size; }
+  int get_block_size () const { return state.load ()->block_size; }
 
-  void set_c (int v) { c = std::clamp (v, -50, 50); }
-  int get_c () const { return c; }
+  void set_c (int v) { modify ([v] (params &p) { p.c = v; }); }
+  int get_c () const { return state.load ()->c; }
+
+  params get_params () const { return *state.load (); }
+  template <typename Fn> void modify (Fn &&fn) { state.update ([&fn] (params &p) { fn (p); sanitize (p); }); }
+
+  struct pixel_op
+  {
+    bool on = false;
+    int thresh = 128;
+    void operator() (uchar &b, uchar &g, uchar &r) const
+    {
+      if (on)
+        b = g = r = luma (b, g, r) > thresh ? 255 : 0;
+    }
+  };
+  // only the binary mode is per-pixel, adaptive ones look at a block and
+  // automatic ones at the whole frame
+  bool get_pixel_op (pixel_op &op) const
+  {
+    const auto p = state.load ();
+    if (p->enabled && p->mode != mode_t::binary)
+      return false;
+    op.on = p->enabled;
+    op.thresh = p->thresh;
+    return true;
+  }
 
   void apply (const cv::Mat &src_bgr, cv::Mat &dst_bgr) override final
   {
-    if (!enabled)
+    frame_context ctx;
+    apply_shared (src_bgr, dst_bgr, ctx);
+  }
+
+  void apply_shared (const cv::Mat &src_bgr, cv::Mat &dst_bgr, frame_context &ctx) override final
+  {
+    const auto p = state.load ();
+    if (!p->enabled)
     {
       dst_bgr = src_bgr;
       return;
     }
 
-    cv::Mat gray;
-    if (src_bgr.channels () == 1)
-      gray = src_bgr;
-    else
-      cv::cvtColor (src_bgr, gray, cv::COLOR_BGR2GRAY);
+    const cv::Mat gray = ctx.gray (src_bgr);
 
     cv::Mat bin;
 
-    switch (mode)
+    switch (p->mode)
     {
       case mode_t::binary:
-        cv::threshold (gray, bin, thresh, 255, cv::THRESH_BINARY);
+        cv::threshold (gray, bin, p->thresh, 255, cv::THRESH_BINARY);
         break;
 
       case mode_t::adaptive_mean:
@@ -67,7 +146,7 @@ public:
           gray, bin, 255,
           cv::ADAPTIVE_THRESH_MEAN_C,
           cv::THRESH_BINARY,
-          block_size, c
+          p->block_size, p->c
         );
         break;
 
@@ -76,20 +155,32 @@ public:
           gray, bin, 255,
           cv::ADAPTIVE_THRESH_GAUSSIAN_C,
           cv::THRESH_BINARY,
-          block_size, c
+          p->block_size, p->c
         );
         break;
+
+      case mode_t::otsu:
+        cv::threshold (gray, bin, ctx.stats (src_bgr).otsu (), 255, cv::THRESH_BINARY);
+        break;
+
+      case mode_t::triangle:
+        cv::threshold (gray, bin, ctx.stats (src_bgr).triangle (), 255, cv::THRESH_BINARY);
+        break;
     }
 
     cv::cvtColor (bin, dst_bgr, cv::COLOR_GRAY2BGR);
   }
 
 private:
-  bool enabled = false;
-  mode_t mode = mode_t::binary;
-  int thresh = 128;
-  int block_size = 11;
-  int c = 2;
+  static void sanitize (params &p)
+  {
+    p.thresh = std::clamp (p.thresh, 0, 255);
+    p.block_size = std::max (3, p.block_size);
+    if ((p.block_size % 2) == 0) ++p.block_size;
+    p.c = std::clamp (p.c, -50, 50);
+  }
+
+  param_cell<params> state;
 };
 
 }
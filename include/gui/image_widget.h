@@ -3,6 +3,11 @@
 
 #include <QWidget>
 #include <QImage>
+#include <QPixmap>
+
+#include <condition_variable>
+#include <mutex>
+#include <thread>
 
 namespace gui
 {
@@ -11,20 +16,40 @@ class image_widget : public QWidget {
   Q_OBJECT
 public:
   explicit image_widget (QWidget *parent = nullptr);
+  ~image_widget ();
 
   void set_image (const QImage &img);
 
 protected:
   void paintEvent (QPaintEvent *event) override;
+  void resizeEvent (QResizeEvent *event) override;
   QSize sizeHint () const override { return (image.isNull () ? QSize (hint_width, hint_height) : image.size ()); }
 
 private:
+  void request_scale ();
+  void scale_loop ();
+  void take_scaled ();
+
   QImage image;
+  // already scaled to the widget size and device pixel ratio, paint only blits it
+  QPixmap cached;
 
   int hint_width;
   int hint_height;
+
+  // latest-wins hand-off to the scaling thread
+  std::thread scaler;
+  std::mutex scale_mutex;
+  std::condition_variable scale_ready;
+  QImage scale_source;
+  QSize scale_target;
+  qreal scale_dpr = 1.0;
+  bool scale_requested = false;
+  bool stopping = false;
+  QImage scaled;
+  qreal scaled_dpr = 1.0;
 };
 
 }
 
-#endif
\ No newline at end of file
+#endif
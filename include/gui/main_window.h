@@ -13,7 +13,13 @@
 #include <QLabel>
 #include <QComboBox>
 
+#include <atomic>
+#include <future>
+#include <thread>
+
 #include "core/cv_engine.h"
+#include "core/offline_renderer.h"
+#include "core/tiled_renderer.h"
 
 namespace gui
 {
@@ -25,7 +31,10 @@ class main_window : public QMainWindow
   Q_OBJECT
 public:
   explicit main_window (QWidget *parent = nullptr);
-  ~main_window () {};
+  ~main_window ();
+
+  // switches to raw frames from stdin ("-") or a FIFO, see --pipe
+  void use_pipe (const QString &path, int width, int height, core::pipe_source::pixel_format fmt);
 
 private:
   image_widget *viewport = nullptr;
@@ -34,11 +43,39 @@ private:
 
   void build_ui ();
   void show_test_image ();
+  std::future<cv::Mat> test_image;
 
   QRadioButton *rb_image  = nullptr;
   QRadioButton *rb_video  = nullptr;
   QRadioButton *rb_camera = nullptr;
+  QRadioButton *rb_mapped = nullptr;
+  QRadioButton *rb_sequence = nullptr;
+  QRadioButton *rb_pipe = nullptr;
   QSpinBox     *sb_camera_index = nullptr;
+  // opening progress and errors of the current source
+  QLabel       *lb_source = nullptr;
+  QCheckBox    *cb_yuv = nullptr;
+  QCheckBox    *cb_record = nullptr;
+  QCheckBox    *cb_session = nullptr;
+  QCheckBox    *cb_shm = nullptr;
+  QCheckBox    *cb_trace = nullptr;
+  QCheckBox    *cb_alloc = nullptr;
+  QLabel       *lb_alloc = nullptr;
+  QCheckBox    *cb_incremental = nullptr;
+  QLabel       *lb_tiles = nullptr;
+  QLabel       *lb_record = nullptr;
+  QPushButton  *pb_render = nullptr;
+  QLabel       *lb_render = nullptr;
+  QPushButton  *pb_still = nullptr;
+  QLabel       *lb_still = nullptr;
+
+  std::shared_ptr<core::offline_renderer> renderer;
+  std::thread render_thread;
+  std::atomic<bool> render_finished { false };
+
+  std::shared_ptr<core::tiled_renderer> still_renderer;
+  std::thread still_thread;
+  std::atomic<bool> still_finished { false };
 
   void build_dock ();
   void build_source_dock ();
@@ -54,6 +91,7 @@ private:
   QSlider *sl_canny_hi = nullptr;
   QLabel *lb_canny_lo = nullptr;
   QLabel *lb_canny_hi = nullptr;
+  QCheckBox *cb_canny_auto = nullptr;
   // jpeg
   QCheckBox *cb_jpeg = nullptr;
   QSlider *sl_jpeg_quality = nullptr;
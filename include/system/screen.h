@@ -9,6 +9,9 @@ class screen
 public:
   screen ();
 
+  // queried once per process, later monitor changes aren't seen
+  static const screen &primary ();
+
   int get_width () const;
 
   int get_height () const;
@@ -16,8 +19,9 @@ public:
   ~screen ();
 
 private:
-  int width;
-  int height;
+  // without an X display or monitors
+  int width = 1920;
+  int height = 1080;
 };
 
 }
@@ -0,0 +1,169 @@
+#include "core/alloc_tracker.h"
+
+#include <algorithm>
+#include <cstring>
+
+namespace core
+{
+
+namespace
+{
+
+thread_local const char *current_owner = nullptr;
+// allocations made by this thread, scopes take differences
+thread_local std::uint64_t thread_allocations = 0;
+thread_local std::uint64_t thread_bytes = 0;
+
+const char *const unowned = "other";
+
+}
+
+alloc_tracker &alloc_tracker::instance ()
+{
+  // never destroyed: Mats allocated through it may outlive static destruction
+  static alloc_tracker &t = *new alloc_tracker ();
+  return t;
+}
+
+void alloc_tracker::enable (bool on)
+{
+  std::lock_guard<std::mutex> lock (mutex);
+  if (on == enabled.load ())
+    return;
+
+  // Mats allocated meanwhile keep coming back to us after disabling
+  if (on)
+    {
+      previous_default = cv::Mat::getDefaultAllocator ();
+      cv::Mat::setDefaultAllocator (this);
+    }
+  else
+    {
+      cv::Mat::setDefaultAllocator (previous_default);
+    }
+  enabled.store (on, std::memory_order_relaxed);
+}
+
+void alloc_tracker::reset ()
+{
+  std::lock_guard<std::mutex> lock (mutex);
+  for (auto &r : owners)
+    {
+      r.calls = 0;
+      r.allocations = 0;
+      r.bytes = 0;
+      r.peak = r.live;
+    }
+}
+
+std::vector<alloc_tracker::stats> alloc_tracker::snapshot () const
+{
+  std::lock_guard<std::mutex> lock (mutex);
+  return std::vector<stats> (owners.begin (), owners.end ());
+}
+
+const char *alloc_tracker::owner ()
+{
+  return current_owner;
+}
+
+const char *alloc_tracker::set_owner (const char *owner)
+{
+  const char *previous = current_owner;
+  current_owner = owner;
+  return previous;
+}
+
+alloc_tracker::stats &alloc_tracker::find (const char *owner) const
+{
+  if (!owner)
+    owner = unowned;
+
+  // a handful of filters, a linear search is enough
+  for (auto &s : owners)
+    {
+      if (std::strcmp (s.owner.c_str (), owner) == 0)
+        return s;
+    }
+  owners.push_back ({});
+  owners.back ().owner = owner;
+  return owners.back ();
+}
+
+cv::UMatData *alloc_tracker::allocate (int dims, const int *sizes, int type, void *data, std::size_t *step,
+                                       cv::AccessFlag flags, cv::UMatUsageFlags usage) const
+{
+  cv::UMatData *u = cv::Mat::getStdAllocator ()->allocate (dims, sizes, type, data, step, flags, usage);
+  if (!u)
+    return u;
+
+  // Mat::release () hands the data to currAllocator, which has to be us
+  u->currAllocator = this;
+  u->prevAllocator = this;
+  u->userdata = nullptr;
+  // wrapped user memory isn't an allocation
+  if (data)
+    return u;
+
+  ++thread_allocations;
+  thread_bytes += u->size;
+
+  std::lock_guard<std::mutex> lock (mutex);
+  stats &r = find (current_owner);
+  ++r.allocations;
+  r.bytes += u->size;
+  r.live += u->size;
+  r.peak = std::max (r.peak, r.live);
+  u->userdata = &r;
+  return u;
+}
+
+bool alloc_tracker::allocate (cv::UMatData *data, cv::AccessFlag flags, cv::UMatUsageFlags usage) const
+{
+  return cv::Mat::getStdAllocator ()->allocate (data, flags, usage);
+}
+
+void alloc_tracker::deallocate (cv::UMatData *data) const
+{
+  if (data && data->userdata)
+    {
+      std::lock_guard<std::mutex> lock (mutex);
+      stats &r = *static_cast<stats *> (data->userdata);
+      r.live -= std::min (r.live, data->size);
+      data->userdata = nullptr;
+    }
+  cv::Mat::getStdAllocator ()->deallocate (data);
+}
+
+alloc_tracker::scope::scope (const char *owner)
+  : previous (set_owner (owner)), allocations_start (thread_allocations), bytes_start (thread_bytes)
+{
+  alloc_tracker &t = instance ();
+  if (!t.is_enabled ())
+    return;
+
+  std::lock_guard<std::mutex> lock (t.mutex);
+  ++t.find (owner).calls;
+}
+
+alloc_tracker::scope::~scope ()
+{
+  set_owner (previous);
+}
+
+std::uint64_t alloc_tracker::scope::allocations () const
+{
+  return thread_allocations - allocations_start;
+}
+
+std::uint64_t alloc_tracker::scope::bytes () const
+{
+  return thread_bytes - bytes_start;
+}
+
+std::string alloc_tracker::scope::args () const
+{
+  return "allocs=" + std::to_string (allocations ()) + " alloc_bytes=" + std::to_string (bytes ());
+}
+
+}
@@ -2,89 +2,273 @@
 
 #include <QDebug>
 
+#include <thread>
+
 #include <opencv2/videoio.hpp>
 
+#include "core/alloc_tracker.h"
+#include "core/reduced_decode.h"
+#include "core/tracer.h"
 #include "gui/utils.h"
 
 namespace core
 {
 
+namespace
+{
+
+// blocking: a missing or slow V4L2 device can take seconds
+std::unique_ptr<cv::VideoCapture> open_capture (bool camera, const std::string &path, int index, QString &error)
+{
+  auto capture = std::make_unique<cv::VideoCapture> ();
+  const bool ok = camera ? capture->open (index, cv::CAP_ANY) : capture->open (path);
+  if (ok && capture->isOpened ())
+    return capture;
+
+  error = camera ? QString ("Cannot open camera %1").arg (index)
+                 : QString ("Cannot open video: %1").arg (QString::fromStdString (path));
+  return nullptr;
+}
+
+}
+
 void cv_engine::set_source (source s) { src = s; }
 void cv_engine::set_test_image (const cv::Mat &bgr) { test_bgr = bgr.clone (); }
 void cv_engine::set_test_video_file (const QString &path) { video_path = path; }
 void cv_engine::set_camera_index (int index) { camera_index = index; }
+void cv_engine::set_native_yuv (bool on) { native_yuv = on; }
+
+void cv_engine::set_decode_limit (int width, int height)
+{
+  decode_width = width;
+  decode_height = height;
+}
+
+void cv_engine::set_mapped_file (const QString &path, int width, int height)
+{
+  mapped_path = path;
+  mapped_width = width;
+  mapped_height = height;
+}
+
+void cv_engine::set_image_sequence (const QString &pattern, int max_width, int max_height)
+{
+  sequence_pattern = pattern;
+  sequence_width = max_width;
+  sequence_height = max_height;
+}
+
+void cv_engine::set_pipe (const QString &path, int width, int height, pipe_source::pixel_format fmt)
+{
+  pipe_path = path;
+  pipe_width = width;
+  pipe_height = height;
+  pipe_format = fmt;
+}
 
 bool cv_engine::open ()
 {
   close ();
-  if (src == source::video)
+  bool ok = true;
+  QString what;
+  if (src == source::video || src == source::camera)
     {
-      capture.open (video_path.toStdString ());
-      if (!capture.isOpened ())
+      QString error;
+      capture = open_capture (src == source::camera, video_path.toStdString (), camera_index, error);
+      if (!capture)
         {
-          qWarning () << "Cannot open video:" << video_path; 
+          qWarning () << error;
+          status = { open_state::failed, error };
           return false;
         }
-      return true;
+      configure_capture ();
     }
-  else if (src == source::camera)
+  else if (src == source::mapped)
     {
-      if (!capture.open (camera_index, cv::CAP_ANY)) 
-        {
-          qWarning () << "Cannot open camera" << camera_index;
-          return false;
-        }
-      return true;
+      ok = mapped.open (mapped_path.toStdString (), mapped_width, mapped_height);
+      what = mapped_path;
+    }
+  else if (src == source::sequence)
+    {
+      ok = sequence.open (sequence_pattern.toStdString (), sequence_width, sequence_height);
+      what = sequence_pattern;
+    }
+  else if (src == source::pipe)
+    {
+      ok = pipe.open (pipe_path.toStdString (), pipe_width, pipe_height, pipe_format);
+      what = pipe_path;
     }
   else
     {
       // image doesn't need to be open
     }
+
+  if (ok)
+    status = { open_state::opened, {} };
+  else
+    status = { open_state::failed, QString ("Cannot open %1").arg (what) };
+  return ok;
+}
+
+void cv_engine::open_async ()
+{
+  if (src != source::video && src != source::camera)
+    {
+      open ();
+      return;
+    }
+
+  close ();
+  auto job = std::make_shared<open_job> ();
+  pending = job;
+  status = { open_state::opening,
+             src == source::camera ? QString ("Opening camera %1").arg (camera_index)
+                                   : QString ("Opening %1").arg (video_path) };
+
+  // the settings are copied and only the job is shared, so the engine can
+  // be reconfigured, reopened or destroyed meanwhile
+  std::thread ([job, camera = src == source::camera, path = video_path.toStdString (), index = camera_index] {
+    job->capture = open_capture (camera, path, index, job->error);
+    job->done.store (true, std::memory_order_release);
+  }).detach ();
+}
+
+bool cv_engine::adopt_capture ()
+{
+  if (!pending->done.load (std::memory_order_acquire))
+    return false;
+
+  const std::shared_ptr<open_job> job = std::move (pending);
+  if (!job->capture)
+    {
+      qWarning () << job->error;
+      status = { open_state::failed, job->error };
+      return false;
+    }
+
+  capture = std::move (job->capture);
+  configure_capture ();
+  status = { open_state::opened, {} };
   return true;
 }
 
+void cv_engine::configure_capture ()
+{
+  reduce_mjpeg ();
+  if (src != source::camera || !native_yuv || mjpeg_flags != 0)
+    return;
+
+  if (capture->set (cv::CAP_PROP_CONVERT_RGB, 0))
+    {
+      yuv_fourcc = static_cast<int> (capture->get (cv::CAP_PROP_FOURCC));
+      yuv_width = static_cast<int> (capture->get (cv::CAP_PROP_FRAME_WIDTH));
+      yuv_height = static_cast<int> (capture->get (cv::CAP_PROP_FRAME_HEIGHT));
+    }
+  else
+    {
+      qWarning () << "Camera" << camera_index << "only delivers converted frames";
+    }
+}
+
 void cv_engine::close ()
 {
-  if (capture.isOpened ())
-    capture.release ();
+  // an open still in flight is left to finish on its own
+  pending.reset ();
+  capture.reset ();
+  status = {};
+  yuv_fourcc = 0;
+  mjpeg_flags = 0;
+  // frames may point into the mapping
+  current_bgr.release ();
+  current_color = nullptr;
+  mapped.close ();
+  sequence.close ();
+  pipe.close ();
 }
 
 bool cv_engine::grab ()
 {
+  tracer &t = tracer::instance ();
+  t.next_frame ();
+  tracer::scope trace ("grab", "source");
+  if (trace.active ())
+    trace.set_args ("source=" + std::to_string (static_cast<int> (src)));
+  current_color = nullptr;
+  current_source.clear ();
+
   switch (src)
     {
       case source::image:
         {
           if (test_bgr.empty ())
             return false;
-          current_bgr = test_bgr.clone ();
+          // the pipeline never writes into its input frame
+          current_bgr = test_bgr;
           return true;
         }
 
-      case source::video:
-      case source::camera:
+      case source::mapped:
+        {
+          if (!mapped.is_open ())
+            {
+              if (!open ())
+                return false;
+            }
+          return mapped.read (current_bgr);
+        }
+
+      case source::sequence:
+        {
+          if (!sequence.is_open ())
+            {
+              if (!open ())
+                return false;
+            }
+          // a frame still in flight just skips this tick
+          if (!sequence.read (current_bgr))
+            return false;
+          if (session.is_running ())
+            current_source = "still " + std::to_string (sequence.decode_flags ()) + ' ' + sequence.current_path ();
+          return true;
+        }
+
+      case source::pipe:
         {
-          if (!capture.isOpened ())
+          // a producer that went away is not reopened, stdin can't be
+          if (!pipe.is_open ())
             {
               if (!open ())
                 return false;
             }
+          return pipe.read (current_bgr);
+        }
+
+      case source::video:
+      case source::camera:
+        {
+          if (pending && !adopt_capture ())
+            return false;
+          if (!capture)
+            {
+              // a failed open is retried when the source is picked again,
+              // not on every tick
+              if (status.state != open_state::failed)
+                open_async ();
+              return false;
+            }
 
           cv::Mat frame;
-          if (!capture.read (frame) || frame.empty ())
+          if (!capture->read (frame) || frame.empty ())
             {
               if (src == source::video)
                 {
-                  capture.set (cv::CAP_PROP_POS_FRAMES, 0);
-                  if (!capture.read (frame) || frame.empty ())
+                  capture->set (cv::CAP_PROP_POS_FRAMES, 0);
+                  if (!capture->read (frame) || frame.empty ())
                     {
-                      const std::string path = video_path.toStdString ();
-                      capture.release ();
-                      if (!capture.open (path))
-                        return false;
-                      capture.set (cv::CAP_PROP_POS_FRAMES, 0);
-                      if (!capture.read (frame) || frame.empty ())
-                        return false;
+                      // a backend that can't seek is reopened, off this
+                      // thread like any other open
+                      open_async ();
+                      return false;
                     }
                 }
               else
@@ -93,6 +277,36 @@ bool cv_engine::grab ()
                 }
             }
 
+          // a backend that ignored the request for raw frames still decodes
+          if (mjpeg_flags != 0 && frame.type () != CV_8UC3)
+            {
+              tracer::scope decode_trace ("mjpeg_decode", "source");
+              cv::Mat decoded = cv::imdecode (frame, mjpeg_flags);
+              if (decoded.empty ())
+                {
+                  qWarning () << "Cannot decode MJPEG frame, decoding at full size from now on";
+                  decode_width = 0;
+                  decode_height = 0;
+                  open_async ();
+                  return false;
+                }
+              frame = std::move (decoded);
+            }
+
+          if (src == source::camera && yuv_fourcc != 0)
+            {
+              if (wrap_yuv (frame))
+                return true;
+              if (frame.type () != CV_8UC3)
+                {
+                  // a compressed or unknown layout, let the backend convert from now on
+                  qWarning () << "Unsupported raw camera format, converting to BGR";
+                  capture->set (cv::CAP_PROP_CONVERT_RGB, 1);
+                  yuv_fourcc = 0;
+                  return false;
+                }
+            }
+
           cv::Mat flipped_frame;
           if (src == source::camera)
             {
@@ -102,6 +316,13 @@ bool cv_engine::grab ()
           else
             {
               current_bgr = std::move (frame);
+              // a reduced MJPEG decode can't be repeated by replay's capture
+              if (session.is_running () && mjpeg_flags == 0)
+                {
+                  const int index = static_cast<int> (capture->get (cv::CAP_PROP_POS_FRAMES)) - 1;
+                  if (index >= 0)
+                    current_source = "video " + std::to_string (index) + ' ' + video_path.toStdString ();
+                }
             }
 
           return true;
@@ -112,6 +333,114 @@ bool cv_engine::grab ()
 }
 
 
+void cv_engine::reduce_mjpeg ()
+{
+  mjpeg_flags = 0;
+  if (!is_mjpeg (static_cast<int> (capture->get (cv::CAP_PROP_FOURCC))))
+    return;
+
+  const cv::Size full (static_cast<int> (capture->get (cv::CAP_PROP_FRAME_WIDTH)),
+                       static_cast<int> (capture->get (cv::CAP_PROP_FRAME_HEIGHT)));
+  const int flags = reduced_read_flags (full, decode_width, decode_height);
+  if (flags == cv::IMREAD_COLOR)
+    return;
+
+  // cameras hand out the JPEG bytes with conversion off, FFmpeg with the
+  // raw packet format
+  const bool raw = src == source::camera ? capture->set (cv::CAP_PROP_CONVERT_RGB, 0)
+                                         : capture->set (cv::CAP_PROP_FORMAT, -1);
+  if (!raw)
+    {
+      qWarning () << "Capture can't deliver compressed MJPEG frames, decoding at full size";
+      return;
+    }
+  mjpeg_flags = flags;
+}
+
+bool cv_engine::wrap_yuv (const cv::Mat &raw)
+{
+  const int w = yuv_width;
+  const int h = yuv_height;
+  if (w <= 0 || h <= 0 || raw.depth () != CV_8U || !raw.isContinuous ())
+    return false;
+
+  const std::size_t bytes = raw.total () * raw.elemSize ();
+  const std::size_t packed = static_cast<std::size_t> (w) * h * 2;
+  const std::size_t planar = static_cast<std::size_t> (w) * h * 3 / 2;
+  auto is = [this] (const char *c) { return yuv_fourcc == cv::VideoWriter::fourcc (c[0], c[1], c[2], c[3]); };
+
+  // yuv outlives this grab in current_color, so it has to share ownership
+  // of the frame rather than point at it
+  const cv::Mat owned = raw.u ? raw : raw.clone ();
+  cv::Mat yuv;
+  int code = -1;
+  // channel of Y in packed layouts, -1 for planar ones where Y is the top h rows
+  int luma_channel = -1;
+  if ((is ("YUYV") || is ("YUY2")) && bytes == packed)
+    {
+      yuv = owned.reshape (2, h);
+      code = cv::COLOR_YUV2BGR_YUYV;
+      luma_channel = 0;
+    }
+  else if (is ("UYVY") && bytes == packed)
+    {
+      yuv = owned.reshape (2, h);
+      code = cv::COLOR_YUV2BGR_UYVY;
+      luma_channel = 1;
+    }
+  else if (bytes == planar && (is ("NV12") || is ("NV21") || is ("YU12") || is ("I420") || is ("YV12")))
+    {
+      yuv = owned.reshape (1, h * 3 / 2);
+      if (is ("NV12"))
+        code = cv::COLOR_YUV2BGR_NV12;
+      else if (is ("NV21"))
+        code = cv::COLOR_YUV2BGR_NV21;
+      else if (is ("YV12"))
+        code = cv::COLOR_YUV2BGR_YV12;
+      else
+        code = cv::COLOR_YUV2BGR_I420;
+    }
+  else
+    {
+      return false;
+    }
+
+  // the camera image is mirrored like the BGR path; the flip also copies
+  // the plane out of the capture's buffer
+  cv::Mat luma;
+  if (luma_channel >= 0)
+    {
+      cv::Mat y;
+      cv::extractChannel (yuv, y, luma_channel);
+      cv::flip (y, luma, 1);
+    }
+  else
+    {
+      cv::flip (yuv.rowRange (0, h), luma, 1);
+    }
+
+  // camera Y is limited range (16..235); stretched to what cvtColor's luma
+  // of the converted frame gives, so thresholds mean the same with and
+  // without the YUV path
+  static const cv::Mat full_range = [] {
+    cv::Mat lut (1, 256, CV_8U);
+    for (int v = 0; v < 256; ++v)
+      lut.at<uchar> (v) = cv::saturate_cast<uchar> ((v - 16) * 255.0 / 219.0);
+    return lut;
+  } ();
+  cv::LUT (luma, full_range, luma);
+
+  current_bgr = luma;
+  // runs at most once, during this frame's process ()
+  current_color = [yuv, code] {
+    cv::Mat bgr, mirrored;
+    cv::cvtColor (yuv, bgr, code);
+    cv::flip (bgr, mirrored, 1);
+    return mirrored;
+  };
+  return true;
+}
+
 void cv_engine::clear_filters ()
 { 
   pipeline.clear(); 
@@ -121,18 +450,17 @@ void cv_engine::add_filter (std::shared_ptr<filters::filter> filter)
 { 
   if (!filter)
     return;
-  pipeline.push_back (std::move (filter));
+  pipeline.set_output (pipeline.add_filter (std::move (filter), pipeline.output ()));
 }
 
 std::shared_ptr<filters::filter> cv_engine::find_filter (const char *id) 
 {
-  for (auto &filter : pipeline) 
-    {
-      if (std::string (filter->id ()) == id) 
-        return filter;
-    }
+  return pipeline.find_filter (id);
+}
 
-  return {};
+pipeline_graph cv_engine::clone_graph () const
+{
+  return pipeline.clone ();
 }
 
 QImage cv_engine::process () 
@@ -140,19 +468,213 @@ QImage cv_engine::process ()
   if (current_bgr.empty ()) 
     return {};
 
-  cv::Mat src = current_bgr;
-  cv::Mat dst;
-  for (auto &filter : pipeline) 
+  // pyramids requested by the stages or the preview live for this frame only
+  filters::frame_context ctx;
+  const cv::Mat out = render (ctx);
+
+  // the widget only needs the smallest level that still covers it
+  int level = 0;
+  if (preview_width > 0 && preview_height > 0)
     {
-      if (!filter)
-        continue;
+      while (level < 4 && (out.cols >> (level + 1)) >= preview_width && (out.rows >> (level + 1)) >= preview_height)
+        ++level;
+    }
+
+  tracer::scope trace ("to_qimage", "engine");
+  if (trace.active ())
+    trace.set_args ("level=" + std::to_string (level));
+  return gui::cvmat_to_qimage (ctx.level (out, level));
+}
+
+cv::Mat cv_engine::process_frame ()
+{
+  if (current_bgr.empty ())
+    return {};
+
+  filters::frame_context ctx;
+  return render (ctx);
+}
+
+std::vector<cv::Mat> cv_engine::process_batch (const std::vector<cv::Mat> &frames)
+{
+  std::vector<cv::Mat> out;
+  {
+    tracer::scope trace ("pipeline_batch", "engine");
+    if (trace.active ())
+      trace.set_args ("frames=" + std::to_string (frames.size ()));
+    out = pipeline.run_batch (frames, pipeline.is_linear () ? nullptr : &thread_pool::shared ());
+  }
+
+  for (const cv::Mat &frame : out)
+    {
+      if (rec.is_running ())
+        rec.push (frame);
+      if (shm.is_running ())
+        shm.push (frame);
+    }
+  return out;
+}
+
+cv::Mat cv_engine::render (filters::frame_context &ctx)
+{
+  // a plain chain has nothing to overlap, branches go to the shared pool
+  thread_pool *workers = pipeline.is_linear () ? nullptr : &thread_pool::shared ();
+
+  // a luma frame turns into colour only if a stage (or the output) needs it
+  if (current_color)
+    ctx.attach_color (current_bgr, current_color);
+
+  if (session.is_running ())
+    {
+      tracer::scope trace ("session_log", "sink");
+      // replay runs on BGR, a luma frame is logged as its colour frame
+      session.begin_frame (current_color ? ctx.color (current_bgr) : current_bgr, pipeline, current_source);
+    }
+
+  cv::Mat out;
+  {
+    tracer::scope trace ("pipeline", "engine");
+    if (trace.active ())
+      trace.set_args ("width=" + std::to_string (current_bgr.cols) + " height=" + std::to_string (current_bgr.rows));
+    // tiles are cut from the frame, which would lose a luma frame's colour
+    if (incremental && !workers && !current_color)
+      {
+        out = tiles.run (current_bgr, pipeline.halo (), pipeline.signature (),
+                         [this] (const cv::Mat &in) { return pipeline.run (in); });
+      }
+    else
+      {
+        out = pipeline.run (current_bgr, workers, &ctx);
+      }
+  }
+
+  if (current_color && out.channels () == 1)
+    {
+      tracer::scope trace ("yuv_to_bgr", "engine");
+      out = ctx.color (out);
+    }
+
+  if (session.is_running ())
+    {
+      tracer::scope trace ("session_log", "sink");
+      session.end_frame (out);
+    }
+  if (rec.is_running ())
+    {
+      tracer::scope trace ("record", "sink");
+      rec.push (out);
+    }
+  if (shm.is_running ())
+    {
+      tracer::scope trace ("shm", "sink");
+      shm.push (out);
+    }
+  return out;
+}
 
-      filter->apply (src, dst);
-      if (dst.data != src.data) 
-        src = dst;
+void cv_engine::set_preview_limit (int width, int height)
+{
+  preview_width = width;
+  preview_height = height;
+}
+
+void cv_engine::set_incremental (bool on)
+{
+  incremental = on;
+  tiles.reset ();
+}
+
+bool cv_engine::start_recording (const QString &path, double fps)
+{
+  return rec.start (path.toStdString (), fps);
+}
+
+void cv_engine::stop_recording ()
+{
+  rec.stop ();
+}
+
+bool cv_engine::is_recording () const
+{
+  return rec.is_running ();
+}
+
+recorder::stats cv_engine::recording_stats () const
+{
+  return rec.get_stats ();
+}
+
+bool cv_engine::start_session_log (const QString &path)
+{
+  if (!pipeline.is_linear ())
+    {
+      qWarning () << "Session log only covers linear chains";
+      return false;
     }
+  return session.start (path.toStdString ());
+}
 
-  return gui::cvmat_to_qimage (src);
+void cv_engine::stop_session_log ()
+{
+  session.stop ();
+}
+
+bool cv_engine::is_session_logging () const
+{
+  return session.is_running ();
+}
+
+bool cv_engine::start_shm_output (const QString &name, int slots)
+{
+  return shm.start (name.toStdString (), slots);
+}
+
+void cv_engine::stop_shm_output ()
+{
+  shm.stop ();
+}
+
+bool cv_engine::is_shm_output () const
+{
+  return shm.is_running ();
+}
+
+void cv_engine::set_tracing (bool on)
+{
+  tracer::instance ().enable (on);
+}
+
+bool cv_engine::is_tracing () const
+{
+  return tracer::instance ().is_enabled ();
+}
+
+bool cv_engine::dump_trace (const QString &path) const
+{
+  return tracer::instance ().dump (path.toStdString ());
+}
+
+void cv_engine::set_alloc_tracking (bool on)
+{
+  alloc_tracker &t = alloc_tracker::instance ();
+  if (on)
+    t.reset ();
+  t.enable (on);
+}
+
+bool cv_engine::is_alloc_tracking () const
+{
+  return alloc_tracker::instance ().is_enabled ();
+}
+
+std::vector<alloc_tracker::stats> cv_engine::alloc_stats () const
+{
+  return alloc_tracker::instance ().snapshot ();
+}
+
+void cv_engine::reset_alloc_stats ()
+{
+  alloc_tracker::instance ().reset ();
 }
 
 }
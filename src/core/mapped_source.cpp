@@ -0,0 +1,263 @@
+#include "core/mapped_source.h"
+
+#include <QDebug>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace core
+{
+
+namespace
+{
+
+constexpr char y4m_magic[] = "YUV4MPEG2 ";
+constexpr char y4m_frame[] = "FRAME";
+
+}
+
+bool mapped_source::open (const std::string &path, int w, int h)
+{
+  close ();
+
+  fd = ::open (path.c_str (), O_RDONLY);
+  if (fd < 0)
+    {
+      qWarning () << "Cannot open mapped source:" << path.c_str ();
+      return false;
+    }
+
+  struct stat st;
+  if (fstat (fd, &st) != 0 || st.st_size <= 0)
+    {
+      qWarning () << "Mapped source is empty:" << path.c_str ();
+      close ();
+      return false;
+    }
+  length = static_cast<std::size_t> (st.st_size);
+
+  void *addr = mmap (nullptr, length, PROT_READ, MAP_PRIVATE, fd, 0);
+  if (addr == MAP_FAILED)
+    {
+      qWarning () << "Cannot map" << path.c_str () << ":" << std::strerror (errno);
+      base = nullptr;
+      close ();
+      return false;
+    }
+  base = static_cast<unsigned char *> (addr);
+
+  // frames are consumed front to back, let the kernel read ahead aggressively
+  madvise (base, length, MADV_SEQUENTIAL);
+
+  const std::size_t magic_len = sizeof (y4m_magic) - 1;
+  if (length > magic_len && std::memcmp (base, y4m_magic, magic_len) == 0)
+    {
+      if (!parse_y4m ())
+        {
+          close ();
+          return false;
+        }
+    }
+  else
+    {
+      if (w <= 0 || h <= 0)
+        {
+          qWarning () << "Raw BGR source needs a frame size:" << path.c_str ();
+          close ();
+          return false;
+        }
+      fmt = format::bgr;
+      width = w;
+      height = h;
+      frame_bytes = static_cast<std::size_t> (w) * h * 3;
+      first_frame = 0;
+      if (length < frame_bytes)
+        {
+          qWarning () << "Raw BGR source is smaller than one frame:" << path.c_str ();
+          close ();
+          return false;
+        }
+    }
+
+  pos = first_frame;
+  prefetch (pos, frame_bytes);
+  return true;
+}
+
+void mapped_source::close ()
+{
+  if (base)
+    munmap (base, length);
+  if (fd >= 0)
+    ::close (fd);
+
+  fd = -1;
+  base = nullptr;
+  length = 0;
+  width = height = 0;
+  frame_bytes = first_frame = pos = 0;
+  converted.release ();
+}
+
+bool mapped_source::parse_y4m ()
+{
+  const auto *end = static_cast<const unsigned char *> (std::memchr (base, '\n', length));
+  if (!end)
+    {
+      qWarning () << "Truncated Y4M header";
+      return false;
+    }
+
+  const std::string header (reinterpret_cast<const char *> (base), end - base);
+  std::string colour = "420";
+  width = height = 0;
+
+  std::size_t i = sizeof (y4m_magic) - 1;
+  while (i < header.size ())
+    {
+      std::size_t j = header.find (' ', i);
+      if (j == std::string::npos)
+        j = header.size ();
+      const std::string tag = header.substr (i, j - i);
+      if (!tag.empty ())
+        {
+          if (tag[0] == 'W')
+            width = std::atoi (tag.c_str () + 1);
+          else if (tag[0] == 'H')
+            height = std::atoi (tag.c_str () + 1);
+          else if (tag[0] == 'C')
+            colour = tag.substr (1);
+        }
+      i = j + 1;
+    }
+
+  if (width <= 0 || height <= 0)
+    {
+      qWarning () << "Y4M header has no frame size";
+      return false;
+    }
+
+  const std::size_t pixels = static_cast<std::size_t> (width) * height;
+  if (colour == "mono")
+    {
+      fmt = format::mono;
+      frame_bytes = pixels;
+    }
+  else if (colour.rfind ("420", 0) == 0)
+    {
+      if (width % 2 || height % 2)
+        {
+          qWarning () << "Y4M 4:2:0 needs an even frame size";
+          return false;
+        }
+      fmt = format::i420;
+      frame_bytes = pixels * 3 / 2;
+    }
+  else
+    {
+      qWarning () << "Unsupported Y4M colour space:" << colour.c_str ();
+      return false;
+    }
+
+  first_frame = static_cast<std::size_t> (end - base) + 1;
+  return true;
+}
+
+const unsigned char *mapped_source::next_payload ()
+{
+  for (int attempt = 0; attempt < 2; ++attempt)
+    {
+      std::size_t at = pos;
+      if (fmt != format::bgr)
+        {
+          // FRAME, optional parameters, newline
+          const std::size_t tag_len = sizeof (y4m_frame) - 1;
+          if (at + tag_len <= length && std::memcmp (base + at, y4m_frame, tag_len) == 0)
+            {
+              const void *nl = std::memchr (base + at, '\n', length - at);
+              at = nl ? static_cast<std::size_t> (static_cast<const unsigned char *> (nl) - base) + 1 : length;
+            }
+          else
+            {
+              at = length;
+            }
+        }
+
+      if (at + frame_bytes <= length)
+        {
+          pos = at + frame_bytes;
+          return base + at;
+        }
+
+      // end of file (or a truncated last frame), start over
+      pos = first_frame;
+    }
+
+  return nullptr;
+}
+
+void mapped_source::prefetch (std::size_t offset, std::size_t bytes) const
+{
+  static const std::size_t page = static_cast<std::size_t> (sysconf (_SC_PAGESIZE));
+
+  if (offset >= length)
+    return;
+  bytes = std::min (bytes, length - offset);
+
+  const std::size_t start = offset & ~(page - 1);
+  madvise (base + start, offset - start + bytes, MADV_WILLNEED);
+}
+
+bool mapped_source::read (cv::Mat &frame)
+{
+  if (!base)
+    return false;
+
+  // drop the caller's reference first so the conversion buffer can be reused
+  frame.release ();
+
+  const unsigned char *payload = next_payload ();
+  if (!payload)
+    {
+      qWarning () << "Mapped source has no complete frame";
+      return false;
+    }
+
+  // start paging in the frame after this one while the pipeline runs
+  prefetch (pos, frame_bytes + 64);
+
+  // the mapping is read-only, any write through these headers faults
+  auto *data = const_cast<unsigned char *> (payload);
+  switch (fmt)
+    {
+      case format::bgr:
+        frame = cv::Mat (height, width, CV_8UC3, data);
+        return true;
+
+      case format::i420:
+      case format::mono:
+        {
+          // whoever still holds the previous frame keeps it
+          if (converted.u && converted.u->refcount > 1)
+            converted.release ();
+
+          if (fmt == format::i420)
+            cv::cvtColor (cv::Mat (height * 3 / 2, width, CV_8UC1, data), converted, cv::COLOR_YUV2BGR_I420);
+          else
+            cv::cvtColor (cv::Mat (height, width, CV_8UC1, data), converted, cv::COLOR_GRAY2BGR);
+          frame = converted;
+          return true;
+        }
+    }
+
+  return false;
+}
+
+}
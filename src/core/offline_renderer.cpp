@@ -0,0 +1,214 @@
+#include "core/offline_renderer.h"
+
+#include <QDebug>
+
+#include <algorithm>
+#include <chrono>
+#include <exception>
+#include <thread>
+
+#include "core/thread_pool.h"
+
+namespace core
+{
+
+offline_renderer::offline_renderer (const pipeline_graph &graph, int workers, int batch_size)
+  : batch (static_cast<std::size_t> (std::max (1, batch_size)))
+{
+  if (workers <= 0)
+    workers = thread_pool::shared ().size ();
+
+  for (int i = 0; i < workers; ++i)
+    graphs.push_back (graph.clone ());
+
+  // frames allowed in flight between the decoder and the writer
+  window = static_cast<std::size_t> (workers) * std::max<std::size_t> (4, 2 * batch);
+}
+
+void offline_renderer::cancel ()
+{
+  {
+    std::lock_guard<std::mutex> lock (mutex);
+    cancelled = true;
+  }
+  changed.notify_all ();
+}
+
+offline_renderer::progress offline_renderer::get_progress () const
+{
+  progress p;
+  p.decoded = decoded;
+  p.written = written;
+  p.total = total;
+  p.fps = fps;
+  return p;
+}
+
+bool offline_renderer::render (const std::string &in_path, const std::string &out_path)
+{
+  cv::VideoCapture capture (in_path);
+  if (!capture.isOpened ())
+    {
+      qWarning () << "Cannot open video:" << in_path.c_str ();
+      return false;
+    }
+
+  pending.clear ();
+  done.clear ();
+  decode_finished = false;
+  idle.clear ();
+  for (std::size_t i = 0; i < graphs.size (); ++i)
+    idle.push_back (i);
+  next_write = 0;
+  cancelled = false;
+  decoded = 0;
+  written = 0;
+  fps = 0.0;
+  total = static_cast<std::uint64_t> (std::max (0.0, capture.get (cv::CAP_PROP_FRAME_COUNT)));
+  running = true;
+
+  double out_fps = capture.get (cv::CAP_PROP_FPS);
+  if (out_fps <= 0.0)
+    out_fps = 30.0;
+
+  // reading blocks on I/O, so the decoder keeps a thread of its own
+  std::thread decoder (&offline_renderer::decode, this, std::ref (capture));
+
+  cv::VideoWriter writer;
+  bool ok = true;
+  const auto start = std::chrono::steady_clock::now ();
+
+  for (;;)
+    {
+      cv::Mat frame;
+      {
+        std::unique_lock<std::mutex> lock (mutex);
+        changed.wait (lock, [this] {
+          return cancelled || done.count (next_write) != 0 || (decode_finished && next_write == decoded);
+        });
+
+        if (cancelled || done.count (next_write) == 0)
+          break;
+
+        auto it = done.find (next_write);
+        frame = std::move (it->second);
+        done.erase (it);
+        ++next_write;
+      }
+      changed.notify_all ();
+
+      if (!writer.isOpened ())
+        {
+          const int fourcc = cv::VideoWriter::fourcc ('M', 'J', 'P', 'G');
+          if (!writer.open (out_path, fourcc, out_fps, frame.size (), frame.channels () != 1))
+            {
+              qWarning () << "Cannot open output:" << out_path.c_str ();
+              ok = false;
+              cancel ();
+              break;
+            }
+        }
+      writer.write (frame);
+
+      ++written;
+      const std::chrono::duration<double> elapsed = std::chrono::steady_clock::now () - start;
+      if (elapsed.count () > 0.0)
+        fps = static_cast<double> (written) / elapsed.count ();
+    }
+
+  decoder.join ();
+  {
+    // groups still running use the graphs
+    std::unique_lock<std::mutex> lock (mutex);
+    changed.wait (lock, [this] { return idle.size () == graphs.size (); });
+  }
+
+  writer.release ();
+  running = false;
+  return ok && !cancelled;
+}
+
+void offline_renderer::decode (cv::VideoCapture &capture)
+{
+  std::uint64_t seq = 0;
+  for (;;)
+    {
+      cv::Mat frame;
+      if (cancelled || !capture.read (frame) || frame.empty ())
+        break;
+
+      std::unique_lock<std::mutex> lock (mutex);
+      changed.wait (lock, [&] { return cancelled || seq < next_write + window; });
+      if (cancelled)
+        break;
+
+      pending.push_back ({ seq++, std::move (frame) });
+      ++decoded;
+      dispatch ();
+      lock.unlock ();
+      changed.notify_all ();
+    }
+
+  {
+    std::lock_guard<std::mutex> lock (mutex);
+    decode_finished = true;
+    dispatch ();
+  }
+  changed.notify_all ();
+}
+
+void offline_renderer::dispatch ()
+{
+  // a full group, or whatever is left at the end of the clip
+  while (!cancelled && !idle.empty () && !pending.empty () && (pending.size () >= batch || decode_finished))
+    {
+      std::vector<std::uint64_t> seqs;
+      std::vector<cv::Mat> frames;
+      while (!pending.empty () && frames.size () < batch)
+        {
+          seqs.push_back (pending.front ().seq);
+          frames.push_back (std::move (pending.front ().frame));
+          pending.pop_front ();
+        }
+
+      const std::size_t graph = idle.back ();
+      idle.pop_back ();
+      thread_pool::shared ().submit ([this, graph, seqs = std::move (seqs), frames = std::move (frames)] () mutable {
+        work (graph, std::move (seqs), std::move (frames));
+      });
+    }
+}
+
+void offline_renderer::work (std::size_t graph, std::vector<std::uint64_t> seqs, std::vector<cv::Mat> frames)
+{
+  std::vector<cv::Mat> out;
+  try
+    {
+      out = graphs[graph].run_batch (frames);
+    }
+  catch (const std::exception &e)
+    {
+      // also bad_alloc on a large batch; nothing may leave a pool task, and
+      // the graph has to go back to idle for render () to return
+      qWarning () << "Offline render failed:" << e.what ();
+      cancelled = true;
+    }
+  catch (...)
+    {
+      qWarning () << "Offline render failed";
+      cancelled = true;
+    }
+
+  {
+    std::lock_guard<std::mutex> lock (mutex);
+    // outputs still waiting here are left alone by the graph's next batch,
+    // which releases buffers somebody else holds
+    for (std::size_t i = 0; i < out.size (); ++i)
+      done.emplace (seqs[i], std::move (out[i]));
+    idle.push_back (graph);
+    dispatch ();
+  }
+  changed.notify_all ();
+}
+
+}
@@ -0,0 +1,278 @@
+#include "core/pipe_source.h"
+
+#include <QDebug>
+
+#include <cerrno>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+namespace core
+{
+
+bool pipe_source::parse_format (const std::string &name, pixel_format &out)
+{
+  if (name == "bgr24")
+    out = pixel_format::bgr24;
+  else if (name == "rgb24")
+    out = pixel_format::rgb24;
+  else if (name == "gray")
+    out = pixel_format::gray;
+  else if (name == "yuv420p")
+    out = pixel_format::yuv420p;
+  else
+    return false;
+  return true;
+}
+
+void pipe_source::buffer_free::operator() (unsigned char *p) const
+{
+  std::free (p);
+}
+
+bool pipe_source::open (const std::string &source, int w, int h, pixel_format f)
+{
+  close ();
+
+  if (w <= 0 || h <= 0 || (f == pixel_format::yuv420p && (w % 2 || h % 2)))
+    {
+      qWarning () << "Invalid pipe frame size" << w << "x" << h;
+      return false;
+    }
+
+  const std::size_t pixels = static_cast<std::size_t> (w) * h;
+  switch (f)
+    {
+      case pixel_format::bgr24:
+      case pixel_format::rgb24:
+        frame_bytes = pixels * 3;
+        break;
+      case pixel_format::gray:
+        frame_bytes = pixels;
+        break;
+      case pixel_format::yuv420p:
+        frame_bytes = pixels * 3 / 2;
+        break;
+    }
+
+  if (source == "-")
+    {
+      fd = STDIN_FILENO;
+    }
+  else
+    {
+      // O_RDWR keeps a FIFO from blocking in open () until a producer shows
+      // up, and from hitting EOF when one producer exits (Linux semantics)
+      fd = ::open (source.c_str (), O_RDWR | O_CLOEXEC);
+      if (fd < 0)
+        {
+          qWarning () << "Cannot open pipe" << source.c_str () << ":" << std::strerror (errno);
+          return false;
+        }
+    }
+
+  stop_fd = eventfd (0, EFD_CLOEXEC);
+  if (stop_fd < 0)
+    {
+      qWarning () << "Cannot create eventfd:" << std::strerror (errno);
+      close ();
+      return false;
+    }
+
+  const std::size_t page = static_cast<std::size_t> (sysconf (_SC_PAGESIZE));
+  const std::size_t alloc = (frame_bytes + page - 1) / page * page;
+  for (auto &b : buffers)
+    {
+      b.reset (static_cast<unsigned char *> (std::aligned_alloc (page, alloc)));
+      if (!b)
+        {
+          qWarning () << "Cannot allocate pipe buffers";
+          close ();
+          return false;
+        }
+    }
+
+  path = source;
+  width = w;
+  height = h;
+  fmt = f;
+  free_list = { 0, 1 };
+  ready.clear ();
+  held = -1;
+  eof = false;
+  stopping = false;
+
+  reader = std::thread (&pipe_source::read_loop, this);
+  return true;
+}
+
+void pipe_source::close ()
+{
+  if (reader.joinable ())
+    {
+      {
+        std::lock_guard<std::mutex> lock (mutex);
+        stopping = true;
+      }
+      freed.notify_all ();
+
+      const std::uint64_t one = 1;
+      if (write (stop_fd, &one, sizeof (one)) < 0)
+        qWarning () << "Cannot wake the pipe reader:" << std::strerror (errno);
+      reader.join ();
+    }
+
+  if (fd >= 0 && fd != STDIN_FILENO)
+    ::close (fd);
+  if (stop_fd >= 0)
+    ::close (stop_fd);
+
+  fd = -1;
+  stop_fd = -1;
+  for (auto &b : buffers)
+    b.reset ();
+  free_list.clear ();
+  ready.clear ();
+  held = -1;
+  converted.release ();
+}
+
+bool pipe_source::at_end () const
+{
+  std::lock_guard<std::mutex> lock (mutex);
+  return eof && ready.empty ();
+}
+
+bool pipe_source::fill (unsigned char *dst)
+{
+  std::size_t got = 0;
+  while (got < frame_bytes)
+    {
+      pollfd fds[2] = { { fd, POLLIN, 0 }, { stop_fd, POLLIN, 0 } };
+      if (poll (fds, 2, -1) < 0)
+        {
+          if (errno == EINTR)
+            continue;
+          qWarning () << "Pipe poll failed:" << std::strerror (errno);
+          return false;
+        }
+      if (fds[1].revents)
+        return false;
+
+      // after POLLIN this returns whatever is buffered without blocking
+      const ssize_t n = ::read (fd, dst + got, frame_bytes - got);
+      if (n < 0)
+        {
+          if (errno == EINTR || errno == EAGAIN)
+            continue;
+          qWarning () << "Pipe read failed:" << std::strerror (errno);
+          return false;
+        }
+      if (n == 0)
+        {
+          if (got > 0)
+            qWarning () << "Pipe closed in the middle of a frame";
+          return false;
+        }
+      got += static_cast<std::size_t> (n);
+    }
+  return true;
+}
+
+void pipe_source::read_loop ()
+{
+  for (;;)
+    {
+      int index;
+      {
+        std::unique_lock<std::mutex> lock (mutex);
+        freed.wait (lock, [this] { return stopping || !free_list.empty (); });
+        if (stopping)
+          return;
+        index = free_list.front ();
+        free_list.pop_front ();
+      }
+
+      const bool ok = fill (buffers[index].get ());
+
+      std::lock_guard<std::mutex> lock (mutex);
+      if (!ok)
+        {
+          eof = true;
+          free_list.push_back (index);
+          return;
+        }
+      ready.push_back (index);
+    }
+}
+
+bool pipe_source::read (cv::Mat &frame)
+{
+  if (!reader.joinable ())
+    return false;
+
+  // the previous frame is done with, its buffer goes back to the reader
+  frame.release ();
+
+  int index;
+  {
+    std::lock_guard<std::mutex> lock (mutex);
+    if (held >= 0)
+      {
+        free_list.push_back (held);
+        held = -1;
+      }
+    if (ready.empty ())
+      {
+        freed.notify_one ();
+        return false;
+      }
+    index = ready.front ();
+    ready.pop_front ();
+  }
+  freed.notify_one ();
+
+  unsigned char *data = buffers[index].get ();
+  if (fmt == pixel_format::bgr24)
+    {
+      frame = cv::Mat (height, width, CV_8UC3, data);
+      std::lock_guard<std::mutex> lock (mutex);
+      held = index;
+      return true;
+    }
+
+  // everything else is converted, so the buffer can be refilled right away
+  if (converted.u && converted.u->refcount > 1)
+    converted.release ();
+
+  switch (fmt)
+    {
+      case pixel_format::rgb24:
+        cv::cvtColor (cv::Mat (height, width, CV_8UC3, data), converted, cv::COLOR_RGB2BGR);
+        break;
+      case pixel_format::gray:
+        cv::cvtColor (cv::Mat (height, width, CV_8UC1, data), converted, cv::COLOR_GRAY2BGR);
+        break;
+      case pixel_format::yuv420p:
+        cv::cvtColor (cv::Mat (height * 3 / 2, width, CV_8UC1, data), converted, cv::COLOR_YUV2BGR_I420);
+        break;
+      case pixel_format::bgr24:
+        break;
+    }
+
+  {
+    std::lock_guard<std::mutex> lock (mutex);
+    free_list.push_back (index);
+  }
+  freed.notify_one ();
+
+  frame = converted;
+  return true;
+}
+
+}
@@ -0,0 +1,552 @@
+#include "core/pipeline_graph.h"
+
+#include "core/alloc_tracker.h"
+#include "core/tracer.h"
+
+#include <algorithm>
+#include <atomic>
+#include <exception>
+#include <mutex>
+#include <string>
+
+namespace core
+{
+
+namespace
+{
+
+// brings m to the channel count and size of like, so nodes fed by branches
+// with different outputs (e.g. gray edges and colour keypoints) can combine
+cv::Mat conform (const cv::Mat &m, const cv::Mat &like)
+{
+  cv::Mat out = m;
+  if (out.channels () != like.channels ())
+    {
+      cv::Mat converted;
+      if (like.channels () == 1)
+        cv::cvtColor (out, converted, out.channels () == 4 ? cv::COLOR_BGRA2GRAY : cv::COLOR_BGR2GRAY);
+      else if (out.channels () == 1)
+        cv::cvtColor (out, converted, cv::COLOR_GRAY2BGR);
+      else
+        cv::cvtColor (out, converted, cv::COLOR_BGRA2BGR);
+      out = converted;
+    }
+  if (out.size () != like.size ())
+    {
+      cv::Mat resized;
+      cv::resize (out, resized, like.size (), 0, 0, cv::INTER_LINEAR);
+      out = resized;
+    }
+  return out;
+}
+
+// a luma frame is converted for stages that need colour, once per frame
+cv::Mat input_for (const filters::filter &f, const cv::Mat &in, filters::frame_context &ctx)
+{
+  return (in.channels () == 1 && f.needs_color ()) ? ctx.color (in) : in;
+}
+
+}
+
+struct pipeline_graph::run_state
+{
+  explicit run_state (std::size_t n) : results (n), waiting (n), uses (n), consumers (n) {}
+
+  std::vector<cv::Mat> results;
+  std::vector<std::atomic<int>> waiting;
+  std::vector<std::atomic<int>> uses;
+  std::vector<std::vector<node_id>> consumers;
+
+  std::mutex mutex;
+  bool done = false;
+  std::exception_ptr error;
+  filters::frame_context *ctx = nullptr;
+};
+
+pipeline_graph::pipeline_graph ()
+{
+  clear ();
+}
+
+void pipeline_graph::clear ()
+{
+  nodes.clear ();
+  nodes.emplace_back ();
+  out = input;
+  compiled = {};
+}
+
+pipeline_graph::node_id pipeline_graph::add_filter (std::shared_ptr<filters::filter> filter, node_id from)
+{
+  if (!filter || !valid (from))
+    return -1;
+
+  node n;
+  n.type = kind::filter;
+  n.filter = std::move (filter);
+  n.inputs = { from };
+  nodes.push_back (std::move (n));
+  compiled.valid = false;
+  return static_cast<node_id> (nodes.size ()) - 1;
+}
+
+pipeline_graph::node_id pipeline_graph::add_blend (node_id a, node_id b, double alpha)
+{
+  if (!valid (a) || !valid (b))
+    return -1;
+
+  node n;
+  n.type = kind::blend;
+  n.inputs = { a, b };
+  n.alpha = std::clamp (alpha, 0.0, 1.0);
+  nodes.push_back (std::move (n));
+  return static_cast<node_id> (nodes.size ()) - 1;
+}
+
+pipeline_graph::node_id pipeline_graph::add_merge (std::vector<node_id> from, merge_op op)
+{
+  if (from.empty ())
+    return -1;
+  for (node_id id : from)
+    {
+      if (!valid (id))
+        return -1;
+    }
+
+  node n;
+  n.type = kind::merge;
+  n.inputs = std::move (from);
+  n.op = op;
+  nodes.push_back (std::move (n));
+  return static_cast<node_id> (nodes.size ()) - 1;
+}
+
+void pipeline_graph::set_output (node_id id)
+{
+  if (valid (id))
+    {
+      out = id;
+      compiled.valid = false;
+    }
+}
+
+bool pipeline_graph::is_linear () const
+{
+  if (out != static_cast<node_id> (nodes.size ()) - 1)
+    return false;
+
+  for (node_id i = 1; i < static_cast<node_id> (nodes.size ()); ++i)
+    {
+      const node &n = nodes[i];
+      if (n.type != kind::filter || n.inputs.size () != 1 || n.inputs[0] != i - 1)
+        return false;
+    }
+  return true;
+}
+
+int pipeline_graph::halo () const
+{
+  if (!is_linear ())
+    return -1;
+
+  int total = 0;
+  for (const auto &n : nodes)
+    {
+      if (!n.filter || !n.filter->is_enabled ())
+        continue;
+      const int h = n.filter->halo ();
+      if (h < 0)
+        return -1;
+      total += h;
+    }
+  return total;
+}
+
+std::string pipeline_graph::signature () const
+{
+  std::string sig;
+  for (const auto &n : nodes)
+    {
+      if (!n.filter || !n.filter->is_enabled ())
+        continue;
+      sig += n.filter->id ();
+      sig += '{';
+      sig += n.filter->serialize_params ();
+      sig += '}';
+    }
+  return sig;
+}
+
+std::shared_ptr<filters::filter> pipeline_graph::find_filter (const char *id) const
+{
+  for (const auto &n : nodes)
+    {
+      if (n.filter && std::string (n.filter->id ()) == id)
+        return n.filter;
+    }
+  return {};
+}
+
+std::vector<std::shared_ptr<filters::filter>> pipeline_graph::all_filters () const
+{
+  std::vector<std::shared_ptr<filters::filter>> list;
+  for (const auto &n : nodes)
+    {
+      if (n.filter)
+        list.push_back (n.filter);
+    }
+  return list;
+}
+
+pipeline_graph pipeline_graph::clone () const
+{
+  pipeline_graph copy = *this;
+  copy.compiled = {};
+  copy.batch_buffers.clear ();
+  for (auto &n : copy.nodes)
+    {
+      if (n.filter)
+        n.filter = n.filter->clone ();
+    }
+  return copy;
+}
+
+void pipeline_graph::execute (const node &n, const std::vector<const cv::Mat *> &in, cv::Mat &dst,
+                              filters::frame_context &ctx)
+{
+  switch (n.type)
+    {
+      case kind::source:
+        dst = *in[0];
+        break;
+
+      case kind::filter:
+        {
+          tracer::scope trace (n.filter->id (), "filter");
+          alloc_tracker::scope owner (n.filter->id ());
+          n.filter->apply_shared (input_for (*n.filter, *in[0], ctx), dst, ctx);
+          if (trace.active ())
+            trace.set_args (n.filter->serialize_params () + ' ' + owner.args ());
+          break;
+        }
+
+      case kind::blend:
+        {
+          tracer::scope trace ("blend", "graph");
+          alloc_tracker::scope owner ("blend");
+          const cv::Mat a = ctx.color (*in[0]);
+          cv::addWeighted (a, n.alpha, conform (ctx.color (*in[1]), a), 1.0 - n.alpha, 0.0, dst);
+          break;
+        }
+
+      case kind::merge:
+        {
+          tracer::scope trace ("merge", "graph");
+          alloc_tracker::scope owner ("merge");
+          cv::Mat acc = ctx.color (*in[0]);
+          for (std::size_t i = 1; i < in.size (); ++i)
+            {
+              const cv::Mat b = conform (ctx.color (*in[i]), acc);
+              cv::Mat next;
+              switch (n.op)
+                {
+                  case merge_op::max:     cv::max (acc, b, next); break;
+                  case merge_op::min:     cv::min (acc, b, next); break;
+                  case merge_op::add:     cv::add (acc, b, next); break;
+                  case merge_op::average:
+                    cv::addWeighted (acc, i / (i + 1.0), b, 1.0 / (i + 1.0), 0.0, next);
+                    break;
+                }
+              acc = next;
+            }
+          dst = acc;
+          break;
+        }
+    }
+}
+
+void pipeline_graph::step (const std::shared_ptr<run_state> &s, thread_pool *pool, node_id id) const
+{
+  for (;;)
+    {
+      const node &n = nodes[id];
+      try
+        {
+          std::vector<const cv::Mat *> in;
+          in.reserve (n.inputs.size ());
+          for (node_id j : n.inputs)
+            in.push_back (&s->results[j]);
+          execute (n, in, s->results[id], *s->ctx);
+        }
+      catch (...)
+        {
+          // keep draining the graph so no task outlives run (), the first
+          // error is rethrown once the output node has been reached
+          std::lock_guard<std::mutex> lock (s->mutex);
+          if (!s->error)
+            s->error = std::current_exception ();
+          s->results[id].release ();
+        }
+
+      // free every intermediate as soon as its last consumer is done
+      for (node_id j : n.inputs)
+        {
+          if (s->uses[j].fetch_sub (1) == 1 && j != out)
+            s->results[j].release ();
+        }
+
+      if (id == out)
+        {
+          {
+            std::lock_guard<std::mutex> lock (s->mutex);
+            s->done = true;
+          }
+          pool->wake ();
+          return;
+        }
+
+      // keep one ready consumer on this thread, hand the others to the pool
+      node_id next = -1;
+      for (node_id c : s->consumers[id])
+        {
+          if (s->waiting[c].fetch_sub (1) != 1)
+            continue;
+          if (next < 0)
+            next = c;
+          else
+            pool->submit ([this, s, pool, c] { step (s, pool, c); });
+        }
+
+      if (next < 0)
+        return;
+      id = next;
+    }
+}
+
+bool pipeline_graph::plan_outdated () const
+{
+  if (!compiled.valid)
+    return true;
+
+  for (node_id i = 1; i <= out; ++i)
+    {
+      if (nodes[i].filter->is_enabled () != compiled.enabled[i])
+        return true;
+    }
+  return false;
+}
+
+void pipeline_graph::compile ()
+{
+  compiled.enabled.assign (nodes.size (), false);
+  compiled.stages.clear ();
+
+  for (node_id i = 1; i <= out; ++i)
+    {
+      filters::filter *f = nodes[i].filter.get ();
+      const bool on = f->is_enabled ();
+      compiled.enabled[i] = on;
+      if (on)
+        compiled.stages.push_back ({ f, f->in_place () });
+    }
+
+  compiled.valid = true;
+}
+
+void pipeline_graph::run_stage (const plan::stage &stage, const cv::Mat &frame, cv::Mat *buffers, int &cur,
+                                filters::frame_context &ctx)
+{
+  // -1 is the frame itself, which is never written; stages alternate
+  // between the two buffers unless they can work in place
+  // only the frame itself can be a luma plane, stage outputs are colour
+  const cv::Mat in = (cur < 0 ? input_for (*stage.filter, frame, ctx) : buffers[cur]);
+  const int target = (stage.in_place && cur >= 0) ? cur : (cur == 0 ? 1 : 0);
+  cv::Mat &dst = buffers[target];
+
+  // whatever the context derived from the old contents of dst is stale
+  if (target != cur)
+    ctx.invalidate (dst);
+
+  // somebody still holds the frame returned last time, leave it to them
+  if (target != cur && dst.u && dst.u->refcount > 1)
+    dst.release ();
+
+  stage.filter->apply_shared (in, dst, ctx);
+
+  if (target == cur)
+    ctx.invalidate (dst);
+
+  if (target != cur && dst.data == in.data)
+    {
+      // the stage passed its input through, keep reading from it
+      dst.release ();
+      return;
+    }
+  cur = target;
+}
+
+cv::Mat pipeline_graph::run_plan (const cv::Mat &frame, filters::frame_context &ctx)
+{
+  if (plan_outdated ())
+    compile ();
+
+  int cur = -1;
+  for (const auto &stage : compiled.stages)
+    {
+      tracer::scope trace (stage.filter->id (), "filter");
+      alloc_tracker::scope owner (stage.filter->id ());
+      run_stage (stage, frame, compiled.buffers, cur, ctx);
+      if (trace.active ())
+        trace.set_args (stage.filter->serialize_params () + ' ' + owner.args ());
+    }
+
+  return (cur < 0 ? frame : compiled.buffers[cur]);
+}
+
+std::vector<cv::Mat> pipeline_graph::run_batch (const std::vector<cv::Mat> &frames, thread_pool *pool)
+{
+  const std::size_t k = frames.size ();
+  std::vector<cv::Mat> results (k);
+  if (out == input)
+    return frames;
+
+  std::vector<filters::frame_context> ctx (k);
+
+  if (!is_linear ())
+    {
+      for (std::size_t i = 0; i < k; ++i)
+        results[i] = run_dag (frames[i], pool, ctx[i]);
+      return results;
+    }
+
+  if (plan_outdated ())
+    compile ();
+
+  // two buffers per frame, kept for the next batch of the same size
+  batch_buffers.resize (2 * k);
+  std::vector<int> cur (k, -1);
+
+  for (const auto &stage : compiled.stages)
+    {
+      tracer::scope trace (stage.filter->id (), "filter");
+      alloc_tracker::scope owner (stage.filter->id ());
+
+      // setup once, then the same code and tables for every frame
+      stage.filter->prepare ();
+      for (std::size_t i = 0; i < k; ++i)
+        run_stage (stage, frames[i], &batch_buffers[2 * i], cur[i], ctx[i]);
+
+      if (trace.active ())
+        trace.set_args (stage.filter->serialize_params () + " frames=" + std::to_string (k) + ' ' + owner.args ());
+    }
+
+  for (std::size_t i = 0; i < k; ++i)
+    results[i] = (cur[i] < 0 ? frames[i] : batch_buffers[2 * i + cur[i]]);
+  return results;
+}
+
+cv::Mat pipeline_graph::run (const cv::Mat &frame, thread_pool *pool, filters::frame_context *ctx)
+{
+  if (out == input)
+    return frame;
+
+  filters::frame_context local;
+  if (!ctx)
+    ctx = &local;
+
+  if (is_linear ())
+    return run_plan (frame, *ctx);
+
+  return run_dag (frame, pool, *ctx);
+}
+
+cv::Mat pipeline_graph::run_dag (const cv::Mat &frame, thread_pool *pool, filters::frame_context &ctx) const
+{
+  const std::size_t n = nodes.size ();
+
+  // only the ancestors of the output are evaluated
+  std::vector<char> needed (n, 0);
+  needed[out] = 1;
+  for (node_id i = out; i > input; --i)
+    {
+      if (!needed[i])
+        continue;
+      for (node_id j : nodes[i].inputs)
+        needed[j] = 1;
+    }
+
+  if (!pool)
+    {
+      std::vector<int> uses (n, 0);
+      for (node_id i = 1; i <= out; ++i)
+        {
+          if (!needed[i])
+            continue;
+          for (node_id j : nodes[i].inputs)
+            ++uses[j];
+        }
+
+      std::vector<cv::Mat> results (n);
+      results[input] = frame;
+      std::vector<const cv::Mat *> in;
+      for (node_id i = 1; i <= out; ++i)
+        {
+          if (!needed[i])
+            continue;
+
+          in.clear ();
+          for (node_id j : nodes[i].inputs)
+            in.push_back (&results[j]);
+          execute (nodes[i], in, results[i], ctx);
+
+          for (node_id j : nodes[i].inputs)
+            {
+              if (--uses[j] == 0)
+                results[j].release ();
+            }
+        }
+      return results[out];
+    }
+
+  auto s = std::make_shared<run_state> (n);
+  s->ctx = &ctx;
+  for (node_id i = 1; i <= out; ++i)
+    {
+      if (!needed[i])
+        continue;
+      s->waiting[i] = static_cast<int> (nodes[i].inputs.size ());
+      for (node_id j : nodes[i].inputs)
+        {
+          ++s->uses[j];
+          s->consumers[j].push_back (i);
+        }
+    }
+
+  s->results[input] = frame;
+
+  // the calling thread takes the first ready branch itself
+  node_id first = -1;
+  for (node_id c : s->consumers[input])
+    {
+      if (s->waiting[c].fetch_sub (1) != 1)
+        continue;
+      if (first < 0)
+        first = c;
+      else
+        pool->submit ([this, s, pool, c] { step (s, pool, c); });
+    }
+  if (first >= 0)
+    step (s, pool, first);
+
+  // a worker that runs this graph keeps executing tasks instead of
+  // blocking, so nested graphs and loops can't starve the pool
+  pool->help_until ([&s] {
+    std::lock_guard<std::mutex> lock (s->mutex);
+    return s->done;
+  });
+  if (s->error)
+    std::rethrow_exception (s->error);
+  return s->results[out];
+}
+
+}
@@ -0,0 +1,216 @@
+#include "core/recorder.h"
+
+#include <QDebug>
+
+#include <algorithm>
+#include <cctype>
+#include <cstdio>
+#include <cstring>
+
+namespace core
+{
+
+namespace
+{
+
+// the path goes to snprintf as its format with one int argument, so it may
+// hold that one conversion and escaped percent signs, nothing else
+bool valid_pattern (const std::string &path)
+{
+  int conversions = 0;
+  for (std::size_t i = 0; i < path.size (); ++i)
+    {
+      if (path[i] != '%')
+        continue;
+      if (++i < path.size () && path[i] == '%')
+        continue;
+
+      while (i < path.size () && std::strchr ("-+ #0", path[i]))
+        ++i;
+      while (i < path.size () && std::isdigit (static_cast<unsigned char> (path[i])))
+        ++i;
+      if (i < path.size () && path[i] == '.')
+        {
+          ++i;
+          while (i < path.size () && std::isdigit (static_cast<unsigned char> (path[i])))
+            ++i;
+        }
+      if (i >= path.size () || (path[i] != 'd' && path[i] != 'i'))
+        return false;
+      ++conversions;
+    }
+  return conversions == 1;
+}
+
+}
+
+recorder::recorder (std::size_t capacity) : capacity (std::max<std::size_t> (1, capacity)) {}
+
+bool recorder::start (const std::string &p, double f)
+{
+  stop ();
+
+  sequence = (p.find ('%') != std::string::npos);
+  if (sequence && !valid_pattern (p))
+    {
+      qWarning () << "Image sequence pattern needs exactly one %d:" << p.c_str ();
+      return false;
+    }
+
+  path = p;
+  fps = (f > 0.0 ? f : 30.0);
+  failed = false;
+  writer_type = -1;
+  mismatch_warned = false;
+
+  std::lock_guard<std::mutex> lock (mutex);
+  queue.clear ();
+  written = 0;
+  dropped = 0;
+  running = true;
+  worker = std::thread (&recorder::run, this);
+  return true;
+}
+
+void recorder::stop ()
+{
+  {
+    std::lock_guard<std::mutex> lock (mutex);
+    if (!running)
+      return;
+    running = false;
+  }
+  ready.notify_all ();
+  space.notify_all ();
+
+  if (worker.joinable ())
+    worker.join ();
+
+  if (writer.isOpened ())
+    writer.release ();
+}
+
+bool recorder::is_running () const
+{
+  std::lock_guard<std::mutex> lock (mutex);
+  return running;
+}
+
+bool recorder::push (const cv::Mat &frame, const std::string &name, bool wait)
+{
+  if (frame.empty ())
+    return false;
+
+  {
+    std::unique_lock<std::mutex> lock (mutex);
+    if (!running)
+      return false;
+    if (queue.size () >= capacity)
+      {
+        if (!wait)
+          {
+            ++dropped;
+            return false;
+          }
+        space.wait (lock, [this] { return !running || queue.size () < capacity; });
+        if (!running)
+          return false;
+      }
+  }
+
+  // the engine reuses its frame buffers, so the queue owns a private copy
+  cv::Mat copy = frame.clone ();
+
+  {
+    std::lock_guard<std::mutex> lock (mutex);
+    queue.push_back ({ std::move (copy), name });
+  }
+  ready.notify_one ();
+  return true;
+}
+
+recorder::stats recorder::get_stats () const
+{
+  std::lock_guard<std::mutex> lock (mutex);
+  stats s;
+  s.queue_depth = queue.size ();
+  s.queue_capacity = capacity;
+  s.written = written;
+  s.dropped = dropped;
+  return s;
+}
+
+void recorder::run ()
+{
+  for (;;)
+    {
+      item it;
+      {
+        std::unique_lock<std::mutex> lock (mutex);
+        ready.wait (lock, [this] { return !running || !queue.empty (); });
+
+        // drain what is already queued before leaving
+        if (queue.empty ())
+          return;
+
+        it = std::move (queue.front ());
+        queue.pop_front ();
+      }
+      space.notify_one ();
+
+      const bool ok = write (it);
+
+      std::lock_guard<std::mutex> lock (mutex);
+      if (ok)
+        ++written;
+      else
+        ++dropped;
+    }
+}
+
+bool recorder::write (const item &it)
+{
+  const cv::Mat &frame = it.frame;
+  if (!it.name.empty ())
+    return cv::imwrite (it.name, frame);
+
+  if (sequence)
+    {
+      char name[4096];
+      std::snprintf (name, sizeof (name), path.c_str (), static_cast<int> (written));
+      return cv::imwrite (name, frame);
+    }
+
+  if (failed)
+    return false;
+
+  if (!writer.isOpened ())
+    {
+      const bool mp4 = path.size () >= 4 && path.compare (path.size () - 4, 4, ".mp4") == 0;
+      const int fourcc = mp4 ? cv::VideoWriter::fourcc ('m', 'p', '4', 'v')
+                             : cv::VideoWriter::fourcc ('M', 'J', 'P', 'G');
+      if (!writer.open (path, fourcc, fps, frame.size (), frame.channels () != 1))
+        {
+          qWarning () << "Cannot open recording:" << path.c_str ();
+          failed = true;
+          return false;
+        }
+      writer_size = frame.size ();
+      writer_type = frame.type ();
+    }
+
+  // VideoWriter silently skips frames that don't match what it was opened
+  // for, count them as dropped instead of written
+  if (frame.size () != writer_size || frame.type () != writer_type)
+    {
+      if (!mismatch_warned)
+        qWarning () << "Recording keeps its first frame size and type, dropping frames that differ";
+      mismatch_warned = true;
+      return false;
+    }
+
+  writer.write (frame);
+  return true;
+}
+
+}
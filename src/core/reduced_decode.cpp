@@ -0,0 +1,33 @@
+#include "core/reduced_decode.h"
+
+namespace core
+{
+
+int reduced_read_flags (const cv::Size &full, int max_width, int max_height)
+{
+  static const int flags[] = { cv::IMREAD_REDUCED_COLOR_8, cv::IMREAD_REDUCED_COLOR_4, cv::IMREAD_REDUCED_COLOR_2 };
+  static const int factors[] = { 8, 4, 2 };
+
+  if (max_width <= 0 || max_height <= 0)
+    return cv::IMREAD_COLOR;
+
+  for (int i = 0; i < 3; ++i)
+    {
+      if (full.width / factors[i] >= max_width && full.height / factors[i] >= max_height)
+        return flags[i];
+    }
+  return cv::IMREAD_COLOR;
+}
+
+bool is_mjpeg (int fourcc)
+{
+  static const char *const known[] = { "MJPG", "mjpg", "jpeg", "AVDJ" };
+  for (const char *c : known)
+    {
+      if (fourcc == cv::VideoWriter::fourcc (c[0], c[1], c[2], c[3]))
+        return true;
+    }
+  return false;
+}
+
+}
@@ -0,0 +1,134 @@
+#include "core/sequence_source.h"
+
+#include <QDebug>
+
+#include <algorithm>
+#include <cctype>
+#include <filesystem>
+#include <thread>
+
+#include "core/reduced_decode.h"
+
+namespace core
+{
+
+namespace
+{
+
+bool is_image_file (const std::filesystem::path &p)
+{
+  std::string ext = p.extension ().string ();
+  std::transform (ext.begin (), ext.end (), ext.begin (),
+                  [] (unsigned char c) { return static_cast<char> (std::tolower (c)); });
+
+  static const char *const known[] = { ".jpg", ".jpeg", ".png", ".bmp", ".tif", ".tiff", ".webp", ".ppm", ".pgm" };
+  return std::find (std::begin (known), std::end (known), ext) != std::end (known);
+}
+
+}
+
+sequence_source::sequence_source (int depth) : depth (std::max (1, depth)) {}
+
+bool sequence_source::open (const std::string &pattern, int max_width, int max_height)
+{
+  close ();
+
+  std::error_code ec;
+  if (std::filesystem::is_directory (pattern, ec))
+    {
+      for (const auto &entry : std::filesystem::directory_iterator (pattern, ec))
+        {
+          if (entry.is_regular_file (ec) && is_image_file (entry.path ()))
+            files.push_back (entry.path ().string ());
+        }
+    }
+  else
+    {
+      std::vector<std::string> found;
+      cv::glob (pattern, found, false);
+      for (const auto &f : found)
+        {
+          if (is_image_file (f))
+            files.push_back (f);
+        }
+    }
+
+  if (files.empty ())
+    {
+      qWarning () << "No images in" << pattern.c_str ();
+      return false;
+    }
+  std::sort (files.begin (), files.end ());
+
+  // the reduction is picked once from the first still, sequences are
+  // expected to share one resolution
+  read_flags = cv::IMREAD_COLOR;
+  if (max_width > 0 && max_height > 0)
+    {
+      const cv::Mat probe = cv::imread (files.front (), cv::IMREAD_COLOR);
+      if (!probe.empty ())
+        read_flags = reduced_read_flags (probe.size (), max_width, max_height);
+    }
+
+  const int hw = static_cast<int> (std::max (1u, std::thread::hardware_concurrency ()));
+  pool = std::make_unique<thread_pool> (std::min (depth, hw));
+  cancelled = std::make_shared<std::atomic<bool>> (false);
+  next_file = 0;
+
+  fill ();
+  return true;
+}
+
+void sequence_source::close ()
+{
+  // queued decodes turn into no-ops, the pool only waits for running ones
+  if (cancelled)
+    cancelled->store (true);
+  pool.reset ();
+  queue.clear ();
+  cancelled.reset ();
+  files.clear ();
+  next_file = 0;
+}
+
+void sequence_source::fill ()
+{
+  while (static_cast<int> (queue.size ()) < depth)
+    {
+      auto s = std::make_shared<slot> ();
+      s->path = files[next_file];
+      next_file = (next_file + 1) % files.size ();
+
+      pool->submit ([s, stop = cancelled, flags = read_flags] {
+        if (!stop->load ())
+          s->image = cv::imread (s->path, flags);
+        s->done.store (true, std::memory_order_release);
+      });
+      queue.push_back (std::move (s));
+    }
+}
+
+bool sequence_source::read (cv::Mat &frame)
+{
+  if (queue.empty ())
+    return false;
+
+  const auto &front = queue.front ();
+  if (!front->done.load (std::memory_order_acquire))
+    return false;
+
+  const bool ok = !front->image.empty ();
+  if (ok)
+    {
+      frame = std::move (front->image);
+      last_path = front->path;
+    }
+  else
+    qWarning () << "Cannot decode" << front->path.c_str ();
+
+  queue.pop_front ();
+  fill ();
+  return ok;
+}
+
+}
@@ -0,0 +1,351 @@
+#include "core/session_log.h"
+
+#include <QDebug>
+
+#include <algorithm>
+#include <chrono>
+#include <cinttypes>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
+#include <sstream>
+
+#include "filters/registry.h"
+
+namespace core
+{
+
+namespace
+{
+
+constexpr const char *header = "filtercv-session 2";
+// logs without input references read the same
+constexpr const char *header_v1 = "filtercv-session 1";
+
+std::string hex (std::uint64_t v)
+{
+  char text[17];
+  std::snprintf (text, sizeof (text), "%016" PRIx64, v);
+  return text;
+}
+
+bool parse_hex (const std::string &text, std::uint64_t &v)
+{
+  char *end = nullptr;
+  v = std::strtoull (text.c_str (), &end, 16);
+  return !text.empty () && *end == '\0';
+}
+
+std::uint64_t mix (std::uint64_t h, std::uint64_t w)
+{
+  h = (h ^ w) * 0x9e3779b97f4a7c15ULL;
+  return h ^ (h >> 29);
+}
+
+}
+
+session_log::session_log () : frames (64) {}
+
+bool session_log::start (const std::string &path)
+{
+  stop ();
+
+  std::lock_guard<std::mutex> lock (mutex);
+  out.open (path, std::ios::trunc);
+  if (!out)
+    {
+      qWarning () << "Cannot write session log:" << path.c_str ();
+      return false;
+    }
+
+  frames_dir = path + ".frames";
+  std::error_code ec;
+  std::filesystem::create_directories (frames_dir, ec);
+  if (ec)
+    {
+      qWarning () << "Cannot create" << frames_dir.c_str () << ":" << ec.message ().c_str ();
+      out.close ();
+      return false;
+    }
+
+  out << header << '\n';
+  frame = 0;
+  in_frame = false;
+  chain.clear ();
+  params.clear ();
+  stored.clear ();
+  // every frame is pushed under its own name, the pattern only has to be
+  // accepted; a % in the directory is escaped for it
+  std::string pattern;
+  for (const char c : frames_dir)
+    pattern += (c == '%' ? "%%" : std::string (1, c));
+  frames.start (pattern + "/%06d.png", 0.0);
+  running = true;
+  return true;
+}
+
+void session_log::stop ()
+{
+  {
+    std::lock_guard<std::mutex> lock (mutex);
+    if (!running)
+      return;
+    running = false;
+    out.close ();
+  }
+  // drains the frames still queued
+  frames.stop ();
+}
+
+void session_log::begin_frame (const cv::Mat &input, const pipeline_graph &graph, const std::string &source)
+{
+  if (!graph.is_linear ())
+    {
+      qWarning () << "Session log only covers linear chains, stopped";
+      stop ();
+      return;
+    }
+
+  const auto list = graph.all_filters ();
+  const std::uint64_t h = hash (input);
+
+  std::lock_guard<std::mutex> lock (mutex);
+  if (!running)
+    return;
+
+  std::vector<std::string> ids;
+  ids.reserve (list.size ());
+  for (const auto &f : list)
+    ids.emplace_back (f->id ());
+  if (ids != chain)
+    {
+      out << "chain " << frame;
+      for (const auto &id : ids)
+        out << ' ' << id;
+      out << '\n';
+      chain = std::move (ids);
+      // a new chain starts from default parameters, log them all again
+      params.assign (chain.size (), {});
+    }
+
+  for (std::size_t i = 0; i < list.size (); ++i)
+    {
+      std::string p = list[i]->serialize_params ();
+      if (p == params[i])
+        continue;
+      out << "param " << frame << ' ' << i << ' ' << chain[i] << ' ' << p << '\n';
+      params[i] = std::move (p);
+    }
+
+  // a reference costs nothing; a copy waits for room in the writer's queue,
+  // a dropped one would leave the log unreplayable
+  if (!source.empty ())
+    out << "input " << frame << ' ' << source << '\n';
+  else if (!stored.count (h) && frames.push (input, frames_dir + '/' + hex (h) + ".png", true))
+    stored.insert (h);
+
+  input_hash = h;
+  in_frame = true;
+}
+
+void session_log::end_frame (const cv::Mat &output)
+{
+  const std::uint64_t h = hash (output);
+
+  std::lock_guard<std::mutex> lock (mutex);
+  if (!running || !in_frame)
+    return;
+  out << "frame " << frame << ' ' << hex (input_hash) << ' ' << hex (h) << '\n';
+  ++frame;
+  in_frame = false;
+}
+
+bool session_log::replay (const std::string &path, replay_result &result)
+{
+  result = {};
+
+  std::ifstream in (path);
+  std::string line;
+  if (!std::getline (in, line) || (line != header && line != header_v1))
+    {
+      qWarning () << "Not a session log:" << path.c_str ();
+      return false;
+    }
+
+  const std::string dir = path + ".frames";
+  pipeline_graph graph;
+  std::vector<std::shared_ptr<filters::filter>> chain;
+  cv::Mat input;
+  std::uint64_t input_hash = 0;
+  bool have_input = false;
+  std::vector<double> times;
+
+  // the reference for the next frame line, if it has one
+  std::string ref_kind, ref_path;
+  int ref_value = 0;
+  bool have_ref = false;
+  // kept open while frames of the same video follow each other
+  cv::VideoCapture video;
+  std::string video_path;
+  int video_next = -1;
+
+  while (std::getline (in, line))
+    {
+      std::istringstream ls (line);
+      std::string kind;
+      std::uint64_t n = 0;
+      ls >> kind >> n;
+
+      if (kind == "chain")
+        {
+          graph.clear ();
+          chain.clear ();
+          std::string id;
+          while (ls >> id)
+            {
+              auto f = filters::make_filter (id);
+              if (!f)
+                {
+                  qWarning () << "Session log uses an unknown filter:" << id.c_str ();
+                  return false;
+                }
+              chain.push_back (f);
+              graph.set_output (graph.add_filter (std::move (f), graph.output ()));
+            }
+        }
+      else if (kind == "param")
+        {
+          std::size_t index = 0;
+          std::string id, text;
+          ls >> index >> id;
+          std::getline (ls >> std::ws, text);
+          if (index >= chain.size () || id != chain[index]->id ())
+            {
+              qWarning () << "Session log parameters for a filter not in the chain, frame" << n;
+              return false;
+            }
+          if (!chain[index]->load_params (text))
+            qWarning () << "Bad" << id.c_str () << "parameters at frame" << n << ":" << text.c_str ();
+        }
+      else if (kind == "input")
+        {
+          ls >> ref_kind >> ref_value;
+          std::getline (ls >> std::ws, ref_path);
+          have_ref = (ref_kind == "video" || ref_kind == "still") && !ref_path.empty ();
+          if (!have_ref)
+            qWarning () << "Bad input line in session log:" << line.c_str ();
+        }
+      else if (kind == "frame")
+        {
+          std::string in_text, out_text;
+          std::uint64_t in_hash = 0, out_hash = 0;
+          ls >> in_text >> out_text;
+          if (!parse_hex (in_text, in_hash) || !parse_hex (out_text, out_hash))
+            {
+              qWarning () << "Bad frame line in session log:" << line.c_str ();
+              return false;
+            }
+
+          if (have_ref && ref_kind == "video")
+            {
+              if (ref_path != video_path || !video.isOpened ())
+                {
+                  video.open (ref_path);
+                  video_path = ref_path;
+                  video_next = 0;
+                }
+              if (ref_value != video_next)
+                video.set (cv::CAP_PROP_POS_FRAMES, ref_value);
+              input.release ();
+              video.read (input);
+              video_next = ref_value + 1;
+              have_input = false;
+            }
+          else if (have_ref)
+            {
+              input = cv::imread (ref_path, ref_value);
+              have_input = false;
+            }
+          else if (!have_input || in_hash != input_hash)
+            {
+              input = cv::imread (dir + '/' + in_text + ".png", cv::IMREAD_UNCHANGED);
+              input_hash = in_hash;
+              have_input = true;
+            }
+          const bool referenced = have_ref;
+          have_ref = false;
+
+          // a file that changed since the session can't reproduce it
+          if (input.empty () || (referenced && hash (input) != in_hash))
+            {
+              ++result.missing;
+              continue;
+            }
+
+          const auto start = std::chrono::steady_clock::now ();
+          filters::frame_context ctx;
+          const cv::Mat output = graph.run (input, nullptr, &ctx);
+          const double ms = std::chrono::duration<double, std::milli> (std::chrono::steady_clock::now () - start).count ();
+
+          if (hash (output) != out_hash)
+            ++result.mismatched;
+          if (ms > result.max_ms)
+            {
+              result.max_ms = ms;
+              result.slowest_frame = n;
+            }
+          times.push_back (ms);
+        }
+      else if (!kind.empty ())
+        {
+          qWarning () << "Unknown session log entry:" << kind.c_str ();
+        }
+    }
+
+  result.frames = times.size ();
+  if (times.empty ())
+    return true;
+
+  for (const double t : times)
+    result.total_ms += t;
+  result.mean_ms = result.total_ms / times.size ();
+  std::sort (times.begin (), times.end ());
+  result.p50_ms = times[times.size () / 2];
+  result.p95_ms = times[std::min (times.size () - 1, times.size () * 95 / 100)];
+  return true;
+}
+
+std::uint64_t session_log::hash (const cv::Mat &img)
+{
+  // four independent lanes keep the multiplies overlapped
+  std::uint64_t lane[4] = { 0x243f6a8885a308d3ULL, 0x13198a2e03707344ULL, 0xa4093822299f31d0ULL,
+                            0x082efa98ec4e6c89ULL };
+  lane[0] = mix (lane[0], static_cast<std::uint64_t> (img.cols) << 32 | static_cast<std::uint32_t> (img.rows));
+  lane[1] = mix (lane[1], static_cast<std::uint64_t> (img.type ()));
+
+  const std::size_t bytes = img.cols * img.elemSize ();
+  for (int y = 0; y < img.rows; ++y)
+    {
+      const uchar *p = img.ptr<uchar> (y);
+      std::size_t i = 0;
+      for (; i + 32 <= bytes; i += 32)
+        {
+          std::uint64_t w[4];
+          std::memcpy (w, p + i, sizeof (w));
+          lane[0] = mix (lane[0], w[0]);
+          lane[1] = mix (lane[1], w[1]);
+          lane[2] = mix (lane[2], w[2]);
+          lane[3] = mix (lane[3], w[3]);
+        }
+      for (; i < bytes; ++i)
+        lane[3] = mix (lane[3], p[i]);
+    }
+
+  std::uint64_t h = lane[0];
+  for (int k = 1; k < 4; ++k)
+    h = mix (h, lane[k]);
+  return h;
+}
+
+}
@@ -0,0 +1,310 @@
+#include "core/shm_sink.h"
+
+#include <QDebug>
+
+#include <algorithm>
+#include <cerrno>
+#include <climits>
+#include <cstring>
+#include <ctime>
+#include <new>
+
+#include <fcntl.h>
+#include <linux/futex.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+namespace core
+{
+
+namespace
+{
+
+constexpr std::size_t align = 64;
+
+std::size_t align_up (std::size_t v) { return (v + align - 1) & ~(align - 1); }
+
+// not FUTEX_PRIVATE: the word lives in memory shared between processes
+long futex (std::atomic<std::uint32_t> *word, int op, std::uint32_t val, const timespec *timeout)
+{
+  return syscall (SYS_futex, reinterpret_cast<std::uint32_t *> (word), op, val, timeout, nullptr, 0);
+}
+
+// tells readers still on the segment to move on, then lets go of it
+void retire (shm_header *header, unsigned char *base, std::size_t length, int fd)
+{
+  if (header)
+    {
+      header->retired.store (1, std::memory_order_release);
+      header->notify.fetch_add (1, std::memory_order_seq_cst);
+      if (header->waiters.load (std::memory_order_seq_cst) > 0)
+        futex (&header->notify, FUTEX_WAKE, INT_MAX, nullptr);
+    }
+  if (base)
+    munmap (base, length);
+  if (fd >= 0)
+    ::close (fd);
+}
+
+std::uint64_t now_ns ()
+{
+  timespec ts;
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return static_cast<std::uint64_t> (ts.tv_sec) * 1000000000ull + ts.tv_nsec;
+}
+
+}
+
+bool shm_sink::start (const std::string &segment, int count)
+{
+  stop ();
+  if (segment.empty () || segment[0] != '/')
+    {
+      qWarning () << "Shared memory name must start with '/':" << segment.c_str ();
+      return false;
+    }
+
+  name = segment;
+  slots = std::max (2, count);
+  width = 0;
+  height = 0;
+  type = -1;
+  frame = 0;
+  lost = 0;
+  failed = false;
+  return true;
+}
+
+void shm_sink::stop ()
+{
+  // unlinked first, so readers woken by the retirement don't reopen it
+  if (fd >= 0 || base)
+    shm_unlink (name.c_str ());
+  retire (header, base, length, fd);
+
+  fd = -1;
+  base = nullptr;
+  header = nullptr;
+  length = 0;
+  name.clear ();
+}
+
+bool shm_sink::create (std::size_t bytes)
+{
+  const std::size_t payload_offset = align_up (sizeof (shm_slot));
+  const std::size_t stride = payload_offset + align_up (bytes);
+  const std::size_t total = align_up (sizeof (shm_header)) + stride * slots;
+
+  // a stale segment from a crashed run would keep its old layout
+  shm_unlink (name.c_str ());
+  fd = shm_open (name.c_str (), O_CREAT | O_EXCL | O_RDWR, 0644);
+  if (fd < 0)
+    {
+      qWarning () << "Cannot create shared memory" << name.c_str () << ":" << std::strerror (errno);
+      return false;
+    }
+  if (ftruncate (fd, static_cast<off_t> (total)) != 0)
+    {
+      qWarning () << "Cannot size shared memory" << name.c_str () << ":" << std::strerror (errno);
+      return false;
+    }
+
+  void *addr = mmap (nullptr, total, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if (addr == MAP_FAILED)
+    {
+      qWarning () << "Cannot map shared memory" << name.c_str () << ":" << std::strerror (errno);
+      return false;
+    }
+  base = static_cast<unsigned char *> (addr);
+  length = total;
+
+  // ftruncate zero-fills, so every seq and counter starts at 0
+  header = new (base) shm_header ();
+  header->slot_count = static_cast<std::uint32_t> (slots);
+  header->slot_stride = stride;
+  header->payload_offset = payload_offset;
+  header->payload_capacity = align_up (bytes);
+  for (int i = 0; i < slots; ++i)
+    new (base + align_up (sizeof (shm_header)) + stride * i) shm_slot ();
+
+  // readers check the magic last
+  std::atomic_thread_fence (std::memory_order_release);
+  header->magic = shm_header::magic_value;
+  return true;
+}
+
+void shm_sink::push (const cv::Mat &img)
+{
+  if (name.empty () || img.empty ())
+    return;
+  if (failed)
+    {
+      ++lost;
+      return;
+    }
+
+  if (!header || img.cols != width || img.rows != height || img.type () != type)
+    {
+      // the old segment is retired only once the new one is ready, so the
+      // readers it wakes find the new one under the name
+      shm_header *old_header = header;
+      unsigned char *old_base = base;
+      const std::size_t old_length = length;
+      const int old_fd = fd;
+      header = nullptr;
+      base = nullptr;
+      length = 0;
+      fd = -1;
+
+      const bool ok = create (img.total () * img.elemSize ());
+      retire (old_header, old_base, old_length, old_fd);
+      if (!ok)
+        {
+          // keep the error to one warning instead of one per frame
+          failed = true;
+          ++lost;
+          return;
+        }
+      width = img.cols;
+      height = img.rows;
+      type = img.type ();
+    }
+
+  const std::uint64_t n = ++frame;
+  auto *slot = reinterpret_cast<shm_slot *> (base + align_up (sizeof (shm_header))
+                                             + header->slot_stride * ((n - 1) % header->slot_count));
+
+  slot->seq.store (2 * n - 1, std::memory_order_relaxed);
+  std::atomic_thread_fence (std::memory_order_release);
+
+  slot->frame = n;
+  slot->timestamp_ns = now_ns ();
+  slot->width = img.cols;
+  slot->height = img.rows;
+  slot->type = img.type ();
+  slot->step = static_cast<std::int32_t> (img.cols * img.elemSize ());
+
+  cv::Mat dst (img.rows, img.cols, img.type (), reinterpret_cast<unsigned char *> (slot) + header->payload_offset);
+  img.copyTo (dst);
+
+  slot->seq.store (2 * n, std::memory_order_release);
+  header->latest.store (n, std::memory_order_release);
+
+  header->notify.fetch_add (1, std::memory_order_seq_cst);
+  if (header->waiters.load (std::memory_order_seq_cst) > 0)
+    futex (&header->notify, FUTEX_WAKE, INT_MAX, nullptr);
+}
+
+bool shm_reader::open (const std::string &segment)
+{
+  close ();
+  name = segment;
+
+  // read-write only for the waiter count, frames are never written here
+  fd = shm_open (segment.c_str (), O_RDWR, 0);
+  if (fd < 0)
+    return false;
+
+  struct stat st;
+  if (fstat (fd, &st) != 0 || static_cast<std::size_t> (st.st_size) < sizeof (shm_header))
+    {
+      close ();
+      return false;
+    }
+  length = static_cast<std::size_t> (st.st_size);
+
+  void *addr = mmap (nullptr, length, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if (addr == MAP_FAILED)
+    {
+      close ();
+      return false;
+    }
+  base = static_cast<unsigned char *> (addr);
+  header = reinterpret_cast<shm_header *> (base);
+
+  if (header->magic != shm_header::magic_value)
+    {
+      close ();
+      return false;
+    }
+  std::atomic_thread_fence (std::memory_order_acquire);
+  return true;
+}
+
+void shm_reader::close ()
+{
+  if (base)
+    munmap (base, length);
+  if (fd >= 0)
+    ::close (fd);
+
+  fd = -1;
+  base = nullptr;
+  header = nullptr;
+  length = 0;
+}
+
+std::uint64_t shm_reader::wait (std::uint64_t after, int timeout_ms)
+{
+  if (!header)
+    return 0;
+
+  const timespec timeout { timeout_ms / 1000, (timeout_ms % 1000) * 1000000L };
+  for (;;)
+    {
+      if (header->retired.load (std::memory_order_acquire))
+        {
+          const std::string segment = name;
+          if (!open (segment))
+            return 0;
+          continue;
+        }
+
+      const std::uint32_t word = header->notify.load (std::memory_order_acquire);
+      const std::uint64_t latest = header->latest.load (std::memory_order_acquire);
+      if (latest > after)
+        return latest;
+
+      // announce ourselves before sleeping so the writer issues the wake;
+      // a publish in between changes the word and FUTEX_WAIT returns at once
+      header->waiters.fetch_add (1, std::memory_order_seq_cst);
+      const long r = futex (&header->notify, FUTEX_WAIT, word, &timeout);
+      header->waiters.fetch_sub (1, std::memory_order_seq_cst);
+
+      if (r != 0 && errno == ETIMEDOUT)
+        return 0;
+    }
+}
+
+const shm_slot *shm_reader::slot_for (std::uint64_t n) const
+{
+  if (!header || n == 0)
+    return nullptr;
+  return reinterpret_cast<const shm_slot *> (base + align_up (sizeof (shm_header))
+                                             + header->slot_stride * ((n - 1) % header->slot_count));
+}
+
+bool shm_reader::view (std::uint64_t n, cv::Mat &out, std::uint64_t *timestamp_ns) const
+{
+  const shm_slot *slot = slot_for (n);
+  if (!slot || slot->seq.load (std::memory_order_acquire) != 2 * n)
+    return false;
+
+  auto *pixels = const_cast<unsigned char *> (reinterpret_cast<const unsigned char *> (slot) + header->payload_offset);
+  out = cv::Mat (slot->height, slot->width, slot->type, pixels, static_cast<std::size_t> (slot->step));
+  if (timestamp_ns)
+    *timestamp_ns = slot->timestamp_ns;
+
+  return still_valid (n);
+}
+
+bool shm_reader::still_valid (std::uint64_t n) const
+{
+  const shm_slot *slot = slot_for (n);
+  std::atomic_thread_fence (std::memory_order_acquire);
+  return slot && slot->seq.load (std::memory_order_relaxed) == 2 * n;
+}
+
+}
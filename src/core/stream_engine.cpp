@@ -0,0 +1,311 @@
+#include "core/stream_engine.h"
+
+#include <QDebug>
+
+#include <algorithm>
+#include <exception>
+#include <limits>
+
+#include "core/tracer.h"
+
+namespace core
+{
+
+namespace
+{
+
+double to_ms (std::chrono::steady_clock::duration d)
+{
+  return std::chrono::duration<double, std::milli> (d).count ();
+}
+
+// weight of the newest sample in the moving averages
+constexpr double smoothing = 0.1;
+
+}
+
+stream_engine::stream_engine (int in_flight_limit)
+  : pool (thread_pool::shared ()), max_in_flight (in_flight_limit > 0 ? in_flight_limit : pool.size ())
+{
+}
+
+stream_engine::~stream_engine ()
+{
+  // no frame task outlives stop ()
+  stop ();
+}
+
+stream_engine::stream_id stream_engine::add_stream (std::unique_ptr<cv_engine> engine, config cfg, sink_fn sink)
+{
+  if (!engine)
+    return 0;
+
+  auto s = std::make_unique<stream> ();
+  s->engine = std::move (engine);
+  s->cfg = cfg;
+  s->cfg.priority = std::max (1, cfg.priority);
+  s->cfg.target_fps = std::max (0.0, cfg.target_fps);
+  s->sink = std::move (sink);
+  s->due = clock::now ();
+  s->window_start = s->due;
+
+  std::lock_guard<std::mutex> lock (mutex);
+  // start level with the others instead of owing or being owed worker time
+  double floor = std::numeric_limits<double>::max ();
+  for (const auto &other : list)
+    floor = std::min (floor, other->pass);
+  s->pass = list.empty () ? 0.0 : floor;
+
+  s->id = next_id++;
+  list.push_back (std::move (s));
+  changed.notify_all ();
+  return list.back ()->id;
+}
+
+void stream_engine::remove_stream (stream_id id)
+{
+  std::unique_ptr<stream> gone;
+  {
+    std::unique_lock<std::mutex> lock (mutex);
+    stream *s = find (id);
+    if (!s)
+      return;
+
+    s->removed = true;
+    changed.wait (lock, [s] { return !s->busy; });
+
+    auto it = std::find_if (list.begin (), list.end (), [s] (const auto &p) { return p.get () == s; });
+    gone = std::move (*it);
+    list.erase (it);
+  }
+  // closing a capture can take a while, not under the lock
+  gone->engine->close ();
+}
+
+void stream_engine::set_config (stream_id id, config cfg)
+{
+  std::lock_guard<std::mutex> lock (mutex);
+  stream *s = find (id);
+  if (!s)
+    return;
+
+  s->cfg.priority = std::max (1, cfg.priority);
+  s->cfg.target_fps = std::max (0.0, cfg.target_fps);
+  // a new rate takes effect now rather than after the old period
+  s->due = std::min (s->due, clock::now ());
+  changed.notify_all ();
+}
+
+cv_engine *stream_engine::engine (stream_id id)
+{
+  std::lock_guard<std::mutex> lock (mutex);
+  stream *s = find (id);
+  return s ? s->engine.get () : nullptr;
+}
+
+void stream_engine::start ()
+{
+  std::lock_guard<std::mutex> lock (mutex);
+  if (running)
+    return;
+
+  const clock::time_point now = clock::now ();
+  for (auto &s : list)
+    {
+      s->due = now;
+      s->window_start = now;
+      s->window_frames = 0;
+    }
+
+  running = true;
+  scheduler = std::thread (&stream_engine::schedule, this);
+}
+
+void stream_engine::stop ()
+{
+  {
+    std::lock_guard<std::mutex> lock (mutex);
+    if (!running)
+      return;
+    running = false;
+  }
+  changed.notify_all ();
+  scheduler.join ();
+
+  // let the frames in flight finish so their streams can be removed safely
+  std::unique_lock<std::mutex> lock (mutex);
+  changed.wait (lock, [this] { return in_flight == 0; });
+}
+
+bool stream_engine::is_running () const
+{
+  std::lock_guard<std::mutex> lock (mutex);
+  return running;
+}
+
+stream_engine::stats stream_engine::get_stats (stream_id id) const
+{
+  std::lock_guard<std::mutex> lock (mutex);
+  const stream *s = find (id);
+  return s ? s->st : stats {};
+}
+
+std::vector<stream_engine::stream_id> stream_engine::streams () const
+{
+  std::lock_guard<std::mutex> lock (mutex);
+  std::vector<stream_id> ids;
+  ids.reserve (list.size ());
+  for (const auto &s : list)
+    ids.push_back (s->id);
+  return ids;
+}
+
+cv::Mat stream_engine::latest (stream_id id) const
+{
+  std::lock_guard<std::mutex> lock (mutex);
+  const stream *s = find (id);
+  return s ? s->latest : cv::Mat ();
+}
+
+stream_engine::stream *stream_engine::find (stream_id id) const
+{
+  for (const auto &s : list)
+    if (s->id == id && !s->removed)
+      return s.get ();
+  return nullptr;
+}
+
+stream_engine::stream *stream_engine::pick (clock::time_point now, clock::time_point &wake)
+{
+  stream *best = nullptr;
+  for (const auto &s : list)
+    {
+      if (s->busy || s->removed)
+        continue;
+      if (s->due > now)
+        {
+          wake = std::min (wake, s->due);
+          continue;
+        }
+      if (!best || s->pass < best->pass)
+        best = s.get ();
+    }
+  return best;
+}
+
+void stream_engine::schedule ()
+{
+  std::unique_lock<std::mutex> lock (mutex);
+  while (running)
+    {
+      const clock::time_point now = clock::now ();
+      // nothing due and nothing finishing still rechecks now and then
+      clock::time_point wake = now + std::chrono::milliseconds (100);
+
+      stream *s = in_flight < max_in_flight ? pick (now, wake) : nullptr;
+      if (!s)
+        {
+          changed.wait_until (lock, wake);
+          continue;
+        }
+
+      s->busy = true;
+      ++in_flight;
+      const clock::time_point scheduled = s->due;
+      pool.submit ([this, s, scheduled] { run_frame (s, scheduled); });
+    }
+}
+
+void stream_engine::run_frame (stream *s, clock::time_point scheduled)
+{
+  const clock::time_point start = clock::now ();
+
+  cv::Mat out;
+  bool failed = false;
+  // a throwing stream must still be released below, or it is never
+  // scheduled again and stop () waits forever
+  try
+    {
+      {
+        tracer::scope trace ("stream", "engine");
+        if (trace.active ())
+          trace.set_args ("stream=" + std::to_string (s->id));
+        if (s->engine->grab ())
+          out = s->engine->process_frame ();
+      }
+
+      if (!out.empty () && s->sink)
+        s->sink (s->id, out);
+    }
+  catch (const std::exception &e)
+    {
+      qWarning () << "Stream" << s->id << "failed:" << e.what ();
+      failed = true;
+    }
+  catch (...)
+    {
+      qWarning () << "Stream" << s->id << "failed";
+      failed = true;
+    }
+
+  const clock::time_point end = clock::now ();
+  {
+    std::lock_guard<std::mutex> lock (mutex);
+    const double spent = to_ms (end - start);
+    s->pass += spent / s->cfg.priority;
+
+    const double period_s = s->cfg.target_fps > 0.0 ? 1.0 / s->cfg.target_fps : 0.0;
+    const auto period = std::chrono::duration_cast<clock::duration> (std::chrono::duration<double> (period_s));
+
+    if (failed || out.empty ())
+      {
+        ++(failed ? s->st.failed : s->st.empty);
+        // a source that isn't ready yet is polled, not spun on
+        clock::duration retry = std::chrono::milliseconds (5);
+        if (period.count () > 0)
+          retry = std::min (retry, period);
+        s->due = end + retry;
+      }
+    else
+      {
+        s->latest = out;
+        ++s->st.frames;
+        ++s->window_frames;
+
+        const double lag = std::max (0.0, to_ms (start - scheduled));
+        s->st.process_ms = s->st.frames == 1 ? spent : s->st.process_ms + smoothing * (spent - s->st.process_ms);
+        s->st.lag_ms = s->st.frames == 1 ? lag : s->st.lag_ms + smoothing * (lag - s->st.lag_ms);
+
+        if (period.count () > 0)
+          {
+            // slots that are already over are skipped rather than caught
+            // up in a burst
+            s->due = scheduled + period;
+            if (s->due < end)
+              {
+                const auto missed = (end - s->due) / period;
+                s->st.late += static_cast<std::uint64_t> (missed);
+                s->due += missed * period;
+              }
+          }
+        else
+          {
+            s->due = end;
+          }
+      }
+
+    const double window = std::chrono::duration<double> (end - s->window_start).count ();
+    if (window >= 1.0)
+      {
+        s->st.fps = s->window_frames / window;
+        s->window_frames = 0;
+        s->window_start = end;
+      }
+
+    s->busy = false;
+    --in_flight;
+  }
+  changed.notify_all ();
+}
+
+}
@@ -0,0 +1,319 @@
+#include "core/thread_pool.h"
+
+#include <algorithm>
+#include <exception>
+
+#include <pthread.h>
+#include <sched.h>
+
+#include <QDebug>
+
+#include <opencv2/core.hpp>
+#if __has_include(<opencv2/core/parallel/parallel_backend.hpp>)
+#include <opencv2/core/parallel/parallel_backend.hpp>
+#define FILTERCV_CV_BACKEND 1
+#endif
+
+#include "core/alloc_tracker.h"
+
+namespace core
+{
+
+namespace
+{
+
+// which pool the current thread works for, and its deque
+thread_local const thread_pool *current_pool = nullptr;
+thread_local int current_index = -1;
+
+std::mutex shared_mutex;
+thread_pool::options shared_options;
+bool shared_created = false;
+
+#ifdef FILTERCV_CV_BACKEND
+// OpenCV's loops as tasks of our pool. Threads outside the pool report
+// index 0, workers 1..size (); an outside thread only ever runs chunks of
+// the loop it started, so 0 is unique within a loop.
+class cv_backend final : public cv::parallel::ParallelForAPI
+{
+public:
+  explicit cv_backend (thread_pool &p) : pool (p) {}
+
+  void parallel_for (int tasks, FN_parallel_for_body_cb_t body, void *data) override
+  {
+    pool.parallel_for (0, tasks, 1, [body, data] (int begin, int end) { body (begin, end, data); });
+  }
+
+  int getThreadNum () const override { return pool.worker_index () + 1; }
+  int getNumThreads () const override { return pool.size () + 1; }
+  // the pool is sized once, see thread_pool::configure_shared
+  int setNumThreads (int) override { return getNumThreads (); }
+  const char *getName () const override { return "filtercv"; }
+
+private:
+  thread_pool &pool;
+};
+#endif
+
+}
+
+thread_pool::thread_pool (int workers)
+{
+  options opt;
+  opt.workers = workers;
+  start (opt);
+}
+
+thread_pool::thread_pool (const options &opt)
+{
+  start (opt);
+}
+
+void thread_pool::start (const options &opt)
+{
+  int workers = opt.workers;
+  if (workers <= 0)
+    workers = static_cast<int> (std::max (1u, std::thread::hardware_concurrency ()));
+
+  for (int i = 0; i <= workers; ++i)
+    queues.push_back (std::make_unique<queue> ());
+
+  threads.reserve (workers);
+  for (int i = 0; i < workers; ++i)
+    {
+      threads.emplace_back (&thread_pool::run, this, i);
+      if (opt.cpus.empty ())
+        continue;
+
+      cpu_set_t set;
+      CPU_ZERO (&set);
+      CPU_SET (opt.cpus[i % opt.cpus.size ()], &set);
+      if (pthread_setaffinity_np (threads.back ().native_handle (), sizeof (set), &set) != 0)
+        qWarning () << "Cannot pin worker" << i << "to cpu" << opt.cpus[i % opt.cpus.size ()];
+    }
+}
+
+thread_pool::~thread_pool ()
+{
+  {
+    std::lock_guard<std::mutex> lock (mutex);
+    stopping = true;
+  }
+  ready.notify_all ();
+
+  for (auto &thread : threads)
+    thread.join ();
+}
+
+int thread_pool::worker_index () const
+{
+  return current_pool == this ? current_index : -1;
+}
+
+void thread_pool::submit (std::function<void ()> task)
+{
+  const int self = worker_index ();
+  queue &q = self >= 0 ? *queues[self] : *queues.back ();
+  {
+    std::lock_guard<std::mutex> lock (q.mutex);
+    q.tasks.push_back (std::move (task));
+  }
+  {
+    // under the pool lock so a worker going to sleep can't miss it
+    std::lock_guard<std::mutex> lock (mutex);
+    pending.fetch_add (1, std::memory_order_relaxed);
+  }
+  ready.notify_one ();
+}
+
+bool thread_pool::take (int self, std::function<void ()> &task)
+{
+  if (pending.load (std::memory_order_relaxed) == 0)
+    return false;
+
+  // own work newest first, otherwise the oldest task of the next queue
+  // that has any, outside submissions included
+  if (self >= 0)
+    {
+      queue &q = *queues[self];
+      std::lock_guard<std::mutex> lock (q.mutex);
+      if (!q.tasks.empty ())
+        {
+          task = std::move (q.tasks.back ());
+          q.tasks.pop_back ();
+          pending.fetch_sub (1, std::memory_order_relaxed);
+          return true;
+        }
+    }
+
+  const int n = static_cast<int> (queues.size ());
+  const int first = self >= 0 ? self + 1 : 0;
+  for (int k = 0; k < n; ++k)
+    {
+      const int i = (first + n - 1 + k) % n;
+      if (i == self)
+        continue;
+      queue &q = *queues[i];
+      std::lock_guard<std::mutex> lock (q.mutex);
+      if (!q.tasks.empty ())
+        {
+          task = std::move (q.tasks.front ());
+          q.tasks.pop_front ();
+          pending.fetch_sub (1, std::memory_order_relaxed);
+          return true;
+        }
+    }
+  return false;
+}
+
+void thread_pool::run (int index)
+{
+  current_pool = this;
+  current_index = index;
+
+  for (;;)
+    {
+      std::function<void ()> task;
+      if (take (index, task))
+        {
+          task ();
+          continue;
+        }
+
+      std::unique_lock<std::mutex> lock (mutex);
+      ready.wait (lock, [this] { return stopping || pending.load (std::memory_order_relaxed) > 0; });
+      if (stopping && pending.load (std::memory_order_relaxed) == 0)
+        return;
+    }
+}
+
+void thread_pool::help_until (const std::function<bool ()> &done)
+{
+  const int self = worker_index ();
+  if (self < 0)
+    {
+      // threads outside the pool (the GUI, renderers) only wait: a queued
+      // task may be another stream's frame, and OpenCV numbers all of them
+      // 0, so they can't share a loop's per-thread buffers either
+      std::unique_lock<std::mutex> lock (mutex);
+      ready.wait (lock, [&done] { return done (); });
+      return;
+    }
+
+  while (!done ())
+    {
+      std::function<void ()> task;
+      if (take (self, task))
+        {
+          task ();
+          continue;
+        }
+
+      std::unique_lock<std::mutex> lock (mutex);
+      ready.wait (lock, [this, &done] { return pending.load (std::memory_order_relaxed) > 0 || done (); });
+    }
+}
+
+void thread_pool::wake ()
+{
+  {
+    std::lock_guard<std::mutex> lock (mutex);
+  }
+  ready.notify_all ();
+}
+
+void thread_pool::parallel_for (int first, int last, int grain, const std::function<void (int, int)> &fn)
+{
+  if (last <= first)
+    return;
+
+  const int n = last - first;
+  grain = std::max (1, grain);
+  // a few chunks per worker so early finishers have something to steal
+  const int chunks = std::min ((n + grain - 1) / grain, 4 * (size () + 1));
+  if (chunks <= 1)
+    {
+      fn (first, last);
+      return;
+    }
+
+  struct loop
+  {
+    std::atomic<int> next { 0 };
+    std::atomic<int> left { 0 };
+    // first exception of any chunk, rethrown to the caller
+    std::mutex error_mutex;
+    std::exception_ptr error;
+  };
+  auto l = std::make_shared<loop> ();
+  l->left = chunks;
+
+  // helpers that start after the loop is over find no chunk and never
+  // touch fn; their allocations count for whoever started the loop
+  auto body = [this, l, first, n, chunks, &fn, owner = alloc_tracker::owner ()] {
+    const char *previous = alloc_tracker::set_owner (owner);
+    for (;;)
+      {
+        const int c = l->next.fetch_add (1);
+        if (c >= chunks)
+          {
+            alloc_tracker::set_owner (previous);
+            return;
+          }
+        const int begin = first + static_cast<int> (static_cast<long long> (n) * c / chunks);
+        const int end = first + static_cast<int> (static_cast<long long> (n) * (c + 1) / chunks);
+        try
+          {
+            fn (begin, end);
+          }
+        catch (...)
+          {
+            std::lock_guard<std::mutex> lock (l->error_mutex);
+            if (!l->error)
+              l->error = std::current_exception ();
+          }
+        if (l->left.fetch_sub (1) == 1)
+          wake ();
+      }
+  };
+
+  const int helpers = std::min (chunks - 1, size ());
+  for (int i = 0; i < helpers; ++i)
+    submit (body);
+  body ();
+  help_until ([&l] { return l->left.load () == 0; });
+  if (l->error)
+    std::rethrow_exception (l->error);
+}
+
+void thread_pool::configure_shared (const options &opt)
+{
+  std::lock_guard<std::mutex> lock (shared_mutex);
+  if (shared_created)
+    {
+      qWarning () << "Shared thread pool already running, configuration ignored";
+      return;
+    }
+  shared_options = opt;
+}
+
+thread_pool &thread_pool::shared ()
+{
+  static thread_pool &pool = [] () -> thread_pool & {
+    std::lock_guard<std::mutex> lock (shared_mutex);
+    shared_created = true;
+    // never destroyed: workers may still be running at static destruction
+    auto *p = new thread_pool (shared_options);
+#ifdef FILTERCV_CV_BACKEND
+    std::shared_ptr<cv::parallel::ParallelForAPI> backend = std::make_shared<cv_backend> (*p);
+    cv::parallel::setParallelForBackend (backend, false);
+#else
+    // OpenCV keeps its own threads; at least don't let it count past ours
+    cv::setNumThreads (p->size ());
+#endif
+    return *p;
+  } ();
+  return pool;
+}
+
+}
@@ -0,0 +1,135 @@
+#include "core/tile_cache.h"
+
+#include <algorithm>
+#include <vector>
+
+namespace core
+{
+
+tile_cache::tile_cache (int tile_size, double tol) : tile (std::max (8, tile_size)), tolerance (tol) {}
+
+void tile_cache::reset ()
+{
+  reference.release ();
+  output.release ();
+  last_signature.clear ();
+  last_halo = -1;
+  reused = 0.0;
+}
+
+cv::Mat tile_cache::run_full (const cv::Mat &frame, int halo, const std::string &signature, const process_fn &process)
+{
+  reused = 0.0;
+  const cv::Mat out = process (frame);
+
+  // a chain that changes the frame size can't be patched tile by tile
+  if (halo < 0 || out.size () != frame.size ())
+    {
+      reset ();
+      return out;
+    }
+
+  // the result may live in the pipeline's working buffers, keep our own copy
+  frame.copyTo (reference);
+  out.copyTo (output);
+  last_signature = signature;
+  last_halo = halo;
+  return output;
+}
+
+cv::Mat tile_cache::run (const cv::Mat &frame, int halo, const std::string &signature, const process_fn &process)
+{
+  if (halo < 0 || output.empty () || signature != last_signature || halo != last_halo
+      || reference.size () != frame.size () || reference.type () != frame.type ())
+    return run_full (frame, halo, signature, process);
+
+  const int cols = (frame.cols + tile - 1) / tile;
+  const int rows = (frame.rows + tile - 1) / tile;
+  const int total = cols * rows;
+
+  auto tile_rect = [&] (int tx, int ty) {
+    return cv::Rect (tx * tile, ty * tile, std::min (tile, frame.cols - tx * tile), std::min (tile, frame.rows - ty * tile));
+  };
+
+  // the largest difference in a tile is a vectorised reduction in OpenCV,
+  // far cheaper than any filter; a mean would let a small moving object
+  // hide in an otherwise still tile
+  std::vector<char> dirty (total, 0);
+  int changed = 0;
+  for (int ty = 0; ty < rows; ++ty)
+    for (int tx = 0; tx < cols; ++tx)
+      {
+        const cv::Rect r = tile_rect (tx, ty);
+        if (cv::norm (frame (r), reference (r), cv::NORM_INF) > tolerance)
+          {
+            dirty[ty * cols + tx] = 1;
+            ++changed;
+          }
+      }
+
+  if (changed == 0)
+    {
+      reused = 1.0;
+      return output;
+    }
+
+  // a changed input pixel reaches halo pixels of output, so neighbours
+  // within that distance have to be redone as well
+  const int reach = (halo + tile - 1) / tile;
+  std::vector<char> redo (total, 0);
+  int redone = 0;
+  for (int ty = 0; ty < rows; ++ty)
+    for (int tx = 0; tx < cols; ++tx)
+      {
+        bool hit = false;
+        for (int y = std::max (0, ty - reach); y <= std::min (rows - 1, ty + reach) && !hit; ++y)
+          for (int x = std::max (0, tx - reach); x <= std::min (cols - 1, tx + reach) && !hit; ++x)
+            hit = dirty[y * cols + x];
+        if (hit)
+          {
+            redo[ty * cols + tx] = 1;
+            ++redone;
+          }
+      }
+
+  // past half the frame the halos cost more than they save
+  if (redone * 2 > total)
+    return run_full (frame, halo, signature, process);
+
+  // the caller may still hold the previous result
+  if (output.u && output.u->refcount > 1)
+    output = output.clone ();
+
+  const cv::Rect bounds (0, 0, frame.cols, frame.rows);
+  for (int ty = 0; ty < rows; ++ty)
+    {
+      int tx = 0;
+      while (tx < cols)
+        {
+          if (!redo[ty * cols + tx])
+            {
+              ++tx;
+              continue;
+            }
+
+          // neighbouring dirty tiles in a row are done in one call
+          const int first = tx;
+          while (tx < cols && redo[ty * cols + tx])
+            ++tx;
+          const cv::Rect run = tile_rect (first, ty) | tile_rect (tx - 1, ty);
+
+          const cv::Rect region = cv::Rect (run.x - halo, run.y - halo, run.width + 2 * halo, run.height + 2 * halo) & bounds;
+          const cv::Mat out = process (frame (region));
+          if (out.size () != region.size () || out.type () != output.type ())
+            return run_full (frame, halo, signature, process);
+
+          out (cv::Rect (run.x - region.x, run.y - region.y, run.width, run.height)).copyTo (output (run));
+          frame (run).copyTo (reference (run));
+        }
+    }
+
+  reused = 1.0 - static_cast<double> (redone) / total;
+  return output;
+}
+
+}
@@ -0,0 +1,343 @@
+#include "core/tiled_renderer.h"
+
+#include <QDebug>
+
+#include <algorithm>
+#include <cctype>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <exception>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "core/thread_pool.h"
+#include "core/tracer.h"
+
+namespace core
+{
+
+namespace
+{
+
+// "P6 <width> <height> 255" followed by one whitespace byte; # comments
+// may appear between the fields
+bool parse_ppm (const unsigned char *p, std::size_t n, int &width, int &height, std::size_t &offset)
+{
+  if (n < 2 || p[0] != 'P' || p[1] != '6')
+    return false;
+
+  std::size_t i = 2;
+  long fields[3] = { 0, 0, 0 };
+  for (long &field : fields)
+    {
+      while (i < n && (std::isspace (p[i]) || p[i] == '#'))
+        {
+          if (p[i] == '#')
+            while (i < n && p[i] != '\n')
+              ++i;
+          else
+            ++i;
+        }
+      if (i >= n || !std::isdigit (p[i]))
+        return false;
+      while (i < n && std::isdigit (p[i]) && field < (1L << 30))
+        field = field * 10 + (p[i++] - '0');
+    }
+  if (i >= n || !std::isspace (p[i]) || fields[2] != 255 || fields[0] <= 0 || fields[1] <= 0)
+    return false;
+
+  width = static_cast<int> (fields[0]);
+  height = static_cast<int> (fields[1]);
+  offset = i + 1;
+  return true;
+}
+
+bool ends_with_ppm (const std::string &path)
+{
+  if (path.size () < 4)
+    return false;
+  std::string ext = path.substr (path.size () - 4);
+  std::transform (ext.begin (), ext.end (), ext.begin (),
+                  [] (unsigned char c) { return static_cast<char> (std::tolower (c)); });
+  return ext == ".ppm";
+}
+
+}
+
+// a PPM or raw BGR image mapped into memory
+struct tiled_renderer::image
+{
+  int fd = -1;
+  unsigned char *base = nullptr;
+  std::size_t length = 0;
+  std::size_t offset = 0;
+  bool writable = false;
+  // PPM stores RGB
+  bool rgb = false;
+  // CV_8UC3 header over the mapping
+  cv::Mat pixels;
+
+  ~image () { close (); }
+
+  bool open (const std::string &path, int w, int h)
+  {
+    fd = ::open (path.c_str (), O_RDONLY | O_CLOEXEC);
+    struct stat st;
+    if (fd < 0 || fstat (fd, &st) != 0 || st.st_size <= 0)
+      {
+        qWarning () << "Cannot open still:" << path.c_str ();
+        return false;
+      }
+    length = static_cast<std::size_t> (st.st_size);
+
+    void *addr = mmap (nullptr, length, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (addr == MAP_FAILED)
+      {
+        qWarning () << "Cannot map" << path.c_str () << ":" << std::strerror (errno);
+        return false;
+      }
+    base = static_cast<unsigned char *> (addr);
+
+    rgb = parse_ppm (base, std::min<std::size_t> (length, 4096), w, h, offset);
+    if (!rgb && (w <= 0 || h <= 0))
+      {
+        qWarning () << "Raw BGR still needs a size:" << path.c_str ();
+        return false;
+      }
+    return wrap (path, w, h);
+  }
+
+  bool create (const std::string &path, int w, int h)
+  {
+    rgb = ends_with_ppm (path);
+    char header[64] = "";
+    if (rgb)
+      std::snprintf (header, sizeof (header), "P6\n%d %d\n255\n", w, h);
+    offset = std::strlen (header);
+    length = offset + static_cast<std::size_t> (w) * h * 3;
+    writable = true;
+
+    fd = ::open (path.c_str (), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0 || ftruncate (fd, static_cast<off_t> (length)) != 0)
+      {
+        qWarning () << "Cannot create" << path.c_str () << ":" << std::strerror (errno);
+        return false;
+      }
+
+    void *addr = mmap (nullptr, length, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (addr == MAP_FAILED)
+      {
+        qWarning () << "Cannot map" << path.c_str () << ":" << std::strerror (errno);
+        return false;
+      }
+    base = static_cast<unsigned char *> (addr);
+    std::memcpy (base, header, offset);
+    return wrap (path, w, h);
+  }
+
+  bool wrap (const std::string &path, int w, int h)
+  {
+    if (length < offset + static_cast<std::size_t> (w) * h * 3)
+      {
+        qWarning () << "Still is shorter than" << w << "x" << h << ":" << path.c_str ();
+        return false;
+      }
+    pixels = cv::Mat (h, w, CV_8UC3, base + offset);
+    return true;
+  }
+
+  // rows [first, last) won't be touched again; only whole pages inside
+  // them are dropped. Written pages of the output are already in the page
+  // cache and go to disk from there.
+  void release_rows (int first, int last) const
+  {
+    if (first >= last)
+      return;
+    const std::size_t page = static_cast<std::size_t> (sysconf (_SC_PAGESIZE));
+    const std::size_t begin = (offset + first * pixels.step[0] + page - 1) / page * page;
+    const std::size_t end = (offset + last * pixels.step[0]) / page * page;
+    if (end <= begin)
+      return;
+    if (writable)
+      msync (base + begin, end - begin, MS_ASYNC);
+    madvise (base + begin, end - begin, MADV_DONTNEED);
+  }
+
+  void close ()
+  {
+    pixels.release ();
+    if (base)
+      {
+        if (writable)
+          msync (base, length, MS_SYNC);
+        munmap (base, length);
+        base = nullptr;
+      }
+    if (fd >= 0)
+      {
+        ::close (fd);
+        fd = -1;
+      }
+  }
+};
+
+tiled_renderer::tiled_renderer (const pipeline_graph &g, int tile_size)
+  : graph (g.clone ()), tile (std::max (64, tile_size))
+{
+}
+
+tiled_renderer::progress tiled_renderer::get_progress () const
+{
+  progress p;
+  p.done = done;
+  p.total = total;
+  return p;
+}
+
+pipeline_graph tiled_renderer::acquire ()
+{
+  std::lock_guard<std::mutex> lock (mutex);
+  if (idle.empty ())
+    return graph.clone ();
+  pipeline_graph g = std::move (idle.back ());
+  idle.pop_back ();
+  return g;
+}
+
+void tiled_renderer::release (pipeline_graph &&g)
+{
+  std::lock_guard<std::mutex> lock (mutex);
+  idle.push_back (std::move (g));
+}
+
+bool tiled_renderer::render (const std::string &in_path, const std::string &out_path, int width, int height)
+{
+  const int halo = graph.halo ();
+  if (halo < 0)
+    {
+      qWarning () << "Tiled rendering needs a chain of local filters";
+      return false;
+    }
+
+  image in, out;
+  if (!in.open (in_path, width, height))
+    return false;
+  const int w = in.pixels.cols;
+  const int h = in.pixels.rows;
+  if (!out.create (out_path, w, h))
+    return false;
+
+  const int cols = (w + tile - 1) / tile;
+  const int rows = (h + tile - 1) / tile;
+  cancelled = false;
+  done = 0;
+  total = static_cast<std::uint64_t> (cols) * rows;
+  running = true;
+
+  thread_pool &pool = thread_pool::shared ();
+  std::atomic<bool> failed { false };
+  int in_released = 0;
+  // tiles catch their own errors; this covers the loop itself, so running
+  // is reset however it ends
+  try
+    {
+      for (int ty = 0; ty < rows && !cancelled && !failed; ++ty)
+        {
+          const int top = ty * tile;
+          const int bottom = std::min (h, top + tile);
+          pool.parallel_for (0, cols, 1, [&] (int first, int last) {
+            for (int tx = first; tx < last && !cancelled && !failed; ++tx)
+              {
+                const cv::Rect core (tx * tile, top, std::min (tile, w - tx * tile), bottom - top);
+                if (!run_tile (in, out, core, halo))
+                  failed = true;
+              }
+          });
+
+          // the next row of tiles reads from halo rows above its top
+          const int needed = std::max (0, bottom - halo);
+          in.release_rows (in_released, needed);
+          in_released = std::max (in_released, needed);
+          out.release_rows (top, bottom);
+        }
+    }
+  catch (const std::exception &e)
+    {
+      qWarning () << "Tiled rendering failed:" << e.what ();
+      failed = true;
+    }
+  catch (...)
+    {
+      qWarning () << "Tiled rendering failed";
+      failed = true;
+    }
+
+  in.close ();
+  out.close ();
+  running = false;
+  return !failed && !cancelled;
+}
+
+bool tiled_renderer::run_tile (const image &in, image &out, const cv::Rect &core, int halo)
+{
+  tracer::scope trace ("tile", "tiled");
+  if (trace.active ())
+    trace.set_args ("x=" + std::to_string (core.x) + " y=" + std::to_string (core.y));
+
+  const cv::Rect bounds (0, 0, in.pixels.cols, in.pixels.rows);
+  const cv::Rect region = cv::Rect (core.x - halo, core.y - halo, core.width + 2 * halo, core.height + 2 * halo) & bounds;
+
+  pipeline_graph g = acquire ();
+  bool ok = false;
+  // an exception would leave the pool's loop and the render thread, fail
+  // the render instead
+  try
+    {
+      // a continuous copy: the graph never sees the rest of the mapping, and
+      // this is the only tile-sized allocation besides the graph's buffers
+      cv::Mat src;
+      if (in.rgb)
+        cv::cvtColor (in.pixels (region), src, cv::COLOR_RGB2BGR);
+      else
+        in.pixels (region).copyTo (src);
+
+      const cv::Mat result = g.run (src);
+      ok = result.size () == region.size () && (result.channels () == 1 || result.channels () == 3);
+      if (ok)
+        {
+          const cv::Mat part = result (cv::Rect (core.x - region.x, core.y - region.y, core.width, core.height));
+          cv::Mat dst = out.pixels (core);
+          if (part.channels () == 1)
+            cv::cvtColor (part, dst, cv::COLOR_GRAY2BGR);
+          else if (out.rgb)
+            cv::cvtColor (part, dst, cv::COLOR_BGR2RGB);
+          else
+            part.copyTo (dst);
+        }
+      else
+        {
+          qWarning () << "Tiled rendering needs a chain that keeps the frame size";
+        }
+    }
+  catch (const std::exception &e)
+    {
+      qWarning () << "Tile at" << core.x << core.y << "failed:" << e.what ();
+      ok = false;
+    }
+  catch (...)
+    {
+      qWarning () << "Tile at" << core.x << core.y << "failed";
+      ok = false;
+    }
+  // the result may live in the graph's buffers, done with it only now
+  release (std::move (g));
+
+  ++done;
+  return ok;
+}
+
+}
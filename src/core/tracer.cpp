@@ -0,0 +1,181 @@
+#include "core/tracer.h"
+
+#include <QDebug>
+
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <cstdio>
+#include <fstream>
+#include <sstream>
+
+#include <sys/syscall.h>
+#include <unistd.h>
+
+namespace core
+{
+
+namespace
+{
+
+std::uint32_t thread_id ()
+{
+  thread_local const std::uint32_t tid = static_cast<std::uint32_t> (syscall (SYS_gettid));
+  return tid;
+}
+
+void write_escaped (std::ostream &out, const std::string &s)
+{
+  out << '"';
+  for (char c : s)
+    {
+      if (c == '"' || c == '\\')
+        out << '\\' << c;
+      else if (static_cast<unsigned char> (c) < 0x20)
+        out << ' ';
+      else
+        out << c;
+    }
+  out << '"';
+}
+
+bool is_number (const std::string &s)
+{
+  if (s.empty ())
+    return false;
+  char *end = nullptr;
+  std::strtod (s.c_str (), &end);
+  return end && *end == '\0';
+}
+
+// "a=1 b=x" becomes ,"a":1,"b":"x"
+void write_args (std::ostream &out, const std::string &args)
+{
+  std::istringstream in (args);
+  std::string pair;
+  while (in >> pair)
+    {
+      const auto eq = pair.find ('=');
+      if (eq == std::string::npos)
+        continue;
+      const std::string value = pair.substr (eq + 1);
+      out << ',';
+      write_escaped (out, pair.substr (0, eq));
+      out << ':';
+      if (is_number (value))
+        out << value;
+      else
+        write_escaped (out, value);
+    }
+}
+
+}
+
+tracer &tracer::instance ()
+{
+  static tracer t;
+  return t;
+}
+
+std::uint64_t tracer::now_ns ()
+{
+  using namespace std::chrono;
+  return static_cast<std::uint64_t> (duration_cast<nanoseconds> (steady_clock::now ().time_since_epoch ()).count ());
+}
+
+void tracer::enable (bool on, std::size_t capacity)
+{
+  std::lock_guard<std::mutex> lock (mutex);
+  if (on && !enabled.load ())
+    {
+      ring.assign (std::max<std::size_t> (capacity, 1), event {});
+      head = 0;
+      count = 0;
+    }
+  enabled.store (on, std::memory_order_relaxed);
+}
+
+void tracer::record (event e)
+{
+  std::lock_guard<std::mutex> lock (mutex);
+  if (ring.empty ())
+    return;
+
+  // the oldest event is overwritten once the ring is full
+  ring[head] = std::move (e);
+  head = (head + 1) % ring.size ();
+  if (count < ring.size ())
+    ++count;
+}
+
+std::size_t tracer::size () const
+{
+  std::lock_guard<std::mutex> lock (mutex);
+  return count;
+}
+
+bool tracer::dump (const std::string &path) const
+{
+  std::vector<event> events;
+  {
+    std::lock_guard<std::mutex> lock (mutex);
+    events.reserve (count);
+    const std::size_t first = (head + ring.size () - count) % std::max<std::size_t> (ring.size (), 1);
+    for (std::size_t i = 0; i < count; ++i)
+      events.push_back (ring[(first + i) % ring.size ()]);
+  }
+
+  std::ofstream out (path);
+  if (!out)
+    {
+      qWarning () << "Cannot write trace:" << path.c_str ();
+      return false;
+    }
+
+  // complete ("X") events, timestamps in microseconds
+  // events are stored as they finish, so the earliest start is not first
+  std::uint64_t origin = events.empty () ? 0 : events.front ().start_ns;
+  for (const auto &e : events)
+    origin = std::min (origin, e.start_ns);
+  const int pid = static_cast<int> (getpid ());
+  out << "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[";
+  bool first = true;
+  for (const auto &e : events)
+    {
+      char timing[96];
+      std::snprintf (timing, sizeof (timing), "\"ts\":%.3f,\"dur\":%.3f",
+                     (static_cast<double> (e.start_ns) - static_cast<double> (origin)) / 1000.0,
+                     static_cast<double> (e.duration_ns) / 1000.0);
+
+      out << (first ? "\n" : ",\n") << "{\"name\":";
+      write_escaped (out, e.name);
+      out << ",\"cat\":";
+      write_escaped (out, e.category);
+      out << ",\"ph\":\"X\"," << timing << ",\"pid\":" << pid << ",\"tid\":" << e.tid
+          << ",\"args\":{\"frame\":" << e.frame;
+      write_args (out, e.args);
+      out << "}}";
+      first = false;
+    }
+  out << "\n]}\n";
+
+  return static_cast<bool> (out);
+}
+
+tracer::scope::scope (const char *n, const char *c) : name (n), category (c)
+{
+  if (tracer::instance ().is_enabled ())
+    start_ns = tracer::now_ns ();
+}
+
+tracer::scope::~scope ()
+{
+  if (!start_ns)
+    return;
+
+  tracer &t = tracer::instance ();
+  t.record ({ name, category, start_ns, tracer::now_ns () - start_ns,
+              t.current_frame (), thread_id (), std::move (args) });
+}
+
+}
@@ -1,45 +1,184 @@
 #include "gui/image_widget.h"
 
 #include <QPainter>
+#include <QMetaObject>
 
+#include <opencv2/opencv.hpp>
+
+#include "core/tracer.h"
 #include "system/screen.h"
 
 namespace gui
 {
 
+namespace
+{
+
+int cv_type_for (QImage::Format format)
+{
+  switch (format)
+    {
+    case QImage::Format_RGB888:
+      return CV_8UC3;
+    case QImage::Format_Grayscale8:
+      return CV_8UC1;
+    case QImage::Format_RGBA8888:
+      return CV_8UC4;
+    default:
+      return -1;
+    }
+}
+
+QImage scale_image (const QImage &src, const QSize &target)
+{
+  if (src.size () == target)
+    return src;
+
+  QImage in = src;
+  if (cv_type_for (in.format ()) < 0)
+    in = in.convertToFormat (QImage::Format_RGB888);
+
+  const int type = cv_type_for (in.format ());
+  const cv::Mat src_mat (in.height (), in.width (), type,
+                         const_cast<uchar *> (in.constBits ()), static_cast<size_t> (in.bytesPerLine ()));
+
+  QImage out (target, in.format ());
+  cv::Mat dst_mat (out.height (), out.width (), type, out.bits (), static_cast<size_t> (out.bytesPerLine ()));
+
+  // area averaging when shrinking, bilinear when the widget is larger than the frame
+  const bool shrink = target.width () < in.width ();
+  cv::resize (src_mat, dst_mat, dst_mat.size (), 0, 0, shrink ? cv::INTER_AREA : cv::INTER_LINEAR);
+  return out;
+}
+
+}
+
 image_widget::image_widget (QWidget *parent) : QWidget (parent)
 {
   setSizePolicy (QSizePolicy::Expanding, QSizePolicy::Expanding);
   setMinimumSize (1, 1);
 
-  system_utils::screen screen;
+  const system_utils::screen &screen = system_utils::screen::primary ();
   hint_width = screen.get_width () / 2;
   hint_height = screen.get_height () / 2;
+
+  scaler = std::thread ([this] { scale_loop (); });
+}
+
+image_widget::~image_widget ()
+{
+  {
+    std::lock_guard<std::mutex> lock (scale_mutex);
+    stopping = true;
+  }
+  scale_ready.notify_all ();
+  if (scaler.joinable ())
+    scaler.join ();
 }
 
 void image_widget::set_image(const QImage &img)
 {
   image = img;
+  request_scale ();
+}
+
+void image_widget::resizeEvent (QResizeEvent * /*event*/)
+{
+  request_scale ();
+}
+
+void image_widget::request_scale ()
+{
+  if (image.isNull ())
+    {
+      cached = QPixmap ();
+      update ();
+      return;
+    }
+
+  const qreal dpr = devicePixelRatioF ();
+  const QSize target = image.size ().scaled (size () * dpr, Qt::KeepAspectRatio);
+  if (target.isEmpty ())
+    return;
+
+  {
+    std::lock_guard<std::mutex> lock (scale_mutex);
+    // a frame still waiting to be scaled is simply replaced by the newer one
+    scale_source = image;
+    scale_target = target;
+    scale_dpr = dpr;
+    scale_requested = true;
+  }
+  scale_ready.notify_one ();
+}
+
+void image_widget::scale_loop ()
+{
+  for (;;)
+    {
+      QImage src;
+      QSize target;
+      qreal dpr;
+      {
+        std::unique_lock<std::mutex> lock (scale_mutex);
+        scale_ready.wait (lock, [this] { return stopping || scale_requested; });
+        if (stopping)
+          return;
+
+        src = std::move (scale_source);
+        scale_source = QImage ();
+        target = scale_target;
+        dpr = scale_dpr;
+        scale_requested = false;
+      }
+
+      QImage out;
+      {
+        core::tracer::scope trace ("scale", "gui");
+        out = scale_image (src, target);
+      }
+
+      {
+        std::lock_guard<std::mutex> lock (scale_mutex);
+        scaled = std::move (out);
+        scaled_dpr = dpr;
+      }
+      // the destructor joins this thread first, so the widget is alive for the post
+      QMetaObject::invokeMethod (this, [this] { take_scaled (); }, Qt::QueuedConnection);
+    }
+}
+
+void image_widget::take_scaled ()
+{
+  QImage img;
+  qreal dpr;
+  {
+    std::lock_guard<std::mutex> lock (scale_mutex);
+    if (scaled.isNull ())
+      return;
+    img = std::move (scaled);
+    scaled = QImage ();
+    dpr = scaled_dpr;
+  }
+
+  cached = QPixmap::fromImage (img);
+  cached.setDevicePixelRatio (dpr);
   update ();
 }
 
 void image_widget::paintEvent(QPaintEvent * /*event*/)
 {
+  core::tracer::scope trace ("paint", "gui");
   QPainter painter (this);
   painter.fillRect (rect (), Qt::black);
 
-  if (image.isNull ())
+  if (cached.isNull ())
     return;
 
-  const QSize target_size = image.size ().scaled (size (), Qt::KeepAspectRatio);
-  QRect image_rect (QPoint (0, 0), target_size);
+  // logical size of the pre-scaled pixmap, drawn 1:1 without any transform
+  QRect image_rect (QPoint (0, 0), cached.deviceIndependentSize ().toSize ());
   image_rect.moveCenter (rect ().center ());
-
-  QPixmap pixmap = QPixmap::fromImage (image);
-  pixmap.setDevicePixelRatio (devicePixelRatioF ());
-
-  painter.setRenderHint (QPainter::SmoothPixmapTransform, true);
-  painter.drawPixmap (image_rect, pixmap);
+  painter.drawPixmap (image_rect.topLeft (), cached);
 }
 
-}
\ No newline at end of file
+}
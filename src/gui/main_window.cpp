@@ -8,6 +8,10 @@
 #include <QRadioButton>
 #include <QSlider>
 #include <QLabel>
+#include <QFileDialog>
+#include <QRegularExpression>
+
+#include <algorithm>
 
 #include <opencv2/opencv.hpp>
 
@@ -57,6 +61,27 @@ main_window::main_window (QWidget *parent) : QMainWindow (parent), engine (std::
   timer.start ();
 }
 
+main_window::~main_window ()
+{
+  if (render_thread.joinable ())
+    {
+      renderer->cancel ();
+      render_thread.join ();
+    }
+  if (still_thread.joinable ())
+    {
+      still_renderer->cancel ();
+      still_thread.join ();
+    }
+}
+
+void main_window::use_pipe (const QString &path, int width, int height, core::pipe_source::pixel_format fmt)
+{
+  engine->set_pipe (path, width, height, fmt);
+  rb_pipe->setVisible (true);
+  rb_pipe->setChecked (true);
+}
+
 void main_window::build_ui ()
 {
   auto *central = new QWidget (this);
@@ -66,7 +91,7 @@ void main_window::build_ui ()
 
   viewport = new image_widget (central);
   
-  system_utils::screen screen;
+  const system_utils::screen &screen = system_utils::screen::primary ();
   int width = screen.get_width () / 1.5;
   int height = screen.get_height () / 1.5;
 
@@ -262,6 +287,10 @@ void main_window::add_canny_filter (QVBoxLayout *v, QWidget *panel)
   hHi->addWidget (lb_canny_hi);
   form->addRow (tr ("High"), hHi);
 
+  // thresholds follow the frame's median luma, the sliders are ignored
+  cb_canny_auto = new QCheckBox (tr ("Automatic"), panel);
+  form->addRow (QString (), cb_canny_auto);
+
   v->addLayout (form);
 
   connect (cb_canny, &QCheckBox::toggled, this, [this] (bool on) {
@@ -269,6 +298,14 @@ void main_window::add_canny_filter (QVBoxLayout *v, QWidget *panel)
       base->set_enabled (on);
   });
 
+  connect (cb_canny_auto, &QCheckBox::toggled, this, [this] (bool on) {
+    sl_canny_lo->setEnabled (!on);
+    sl_canny_hi->setEnabled (!on);
+    auto f = std::dynamic_pointer_cast<filters::canny> (engine->find_filter ("canny"));
+    if (f)
+      f->set_automatic (on);
+  });
+
   connect (sl_canny_lo, &QSlider::valueChanged, this, [this] (int lo) {
     lb_canny_lo->setText (QString::number (lo));
     auto base = engine->find_filter ("canny");
@@ -323,7 +360,14 @@ void main_window::build_source_dock ()
   rb_image  = new QRadioButton (tr ("Test Image"), panel);
   rb_video  = new QRadioButton (tr ("Test Video"), panel);
   rb_camera = new QRadioButton (tr ("Camera"), panel);
+  rb_mapped = new QRadioButton (tr ("Raw/Y4M File"), panel);
+  rb_sequence = new QRadioButton (tr ("Image Sequence"), panel);
+  // only offered when started with --pipe
+  rb_pipe = new QRadioButton (tr ("Pipe"), panel);
+  rb_pipe->setVisible (false);
   rb_image->setChecked(true);
+  lb_source = new QLabel (panel);
+  lb_source->setWordWrap (true);
 
   sb_camera_index = new QSpinBox (panel);
   sb_camera_index->setRange (0, 10);
@@ -333,9 +377,42 @@ void main_window::build_source_dock ()
   v->addWidget (rb_image);
   v->addWidget (rb_video);
   v->addWidget (rb_camera);
+  v->addWidget (rb_mapped);
+  v->addWidget (rb_sequence);
+  v->addWidget (rb_pipe);
+  v->addWidget (lb_source);
+  cb_yuv = new QCheckBox (tr ("Native YUV (camera)"), panel);
+  cb_record = new QCheckBox (tr ("Record"), panel);
+  cb_session = new QCheckBox (tr ("Log session (writes session.log)"), panel);
+  cb_shm = new QCheckBox (tr ("Shared memory output"), panel);
+  cb_trace = new QCheckBox (tr ("Trace (writes trace.json)"), panel);
+  cb_alloc = new QCheckBox (tr ("Track allocations"), panel);
+  lb_alloc = new QLabel (panel);
+  cb_incremental = new QCheckBox (tr ("Incremental tiles"), panel);
+  lb_tiles = new QLabel (panel);
+  lb_record = new QLabel (panel);
+  pb_render = new QPushButton (tr ("Render test video"), panel);
+  lb_render = new QLabel (panel);
+  pb_still = new QPushButton (tr ("Render large still..."), panel);
+  lb_still = new QLabel (panel);
+
   auto *form = new QFormLayout ();
   form->addRow (tr ("Camera Index"), sb_camera_index);
   v->addLayout (form);
+  v->addWidget (cb_yuv);
+  v->addWidget (cb_record);
+  v->addWidget (cb_session);
+  v->addWidget (cb_shm);
+  v->addWidget (cb_trace);
+  v->addWidget (cb_alloc);
+  v->addWidget (lb_alloc);
+  v->addWidget (cb_incremental);
+  v->addWidget (lb_tiles);
+  v->addWidget (lb_record);
+  v->addWidget (pb_render);
+  v->addWidget (lb_render);
+  v->addWidget (pb_still);
+  v->addWidget (lb_still);
   v->addStretch (1);
 
   panel->setLayout (v);
@@ -356,11 +433,13 @@ void main_window::build_source_dock ()
     engine->set_source (core::cv_engine::source::video);
     sb_camera_index->setEnabled (false);
 
+    // nothing finer than the viewport is ever shown
+    const QSize limit = viewport->size () * viewport->devicePixelRatioF ();
+    engine->set_decode_limit (limit.width (), limit.height ());
+
     engine->set_test_video_file ("../resources/rickroll.mp4");
-    if (!engine->open ())
-      {
-        qWarning() << "Cannot open video";
-      }
+    // progress and errors show up in lb_source
+    engine->open_async ();
   });
 
   connect(rb_camera, &QRadioButton::toggled, this, [this] (bool on) {
@@ -368,15 +447,186 @@ void main_window::build_source_dock ()
       return;
     engine->set_source (core::cv_engine::source::camera);
     sb_camera_index->setEnabled (true);
+    const QSize limit = viewport->size () * viewport->devicePixelRatioF ();
+    engine->set_decode_limit (limit.width (), limit.height ());
     engine->set_camera_index (sb_camera_index->value ());
-    engine->open ();
+    engine->open_async ();
+  });
+
+  connect(rb_mapped, &QRadioButton::toggled, this, [this] (bool on) {
+    if (!on)
+      return;
+    sb_camera_index->setEnabled (false);
+
+    const QString path = QFileDialog::getOpenFileName (this, tr ("Open raw BGR or Y4M file"), QString (),
+                                                       tr ("Raw video (*.y4m *.bgr *.raw);;All files (*)"));
+    if (path.isEmpty ())
+      {
+        rb_image->setChecked (true);
+        return;
+      }
+
+    // raw files carry no header, take the size from a name like clip_1920x1080.bgr
+    int width = 0, height = 0;
+    const auto match = QRegularExpression ("(\\d+)x(\\d+)").match (path.section ('/', -1));
+    if (match.hasMatch ())
+      {
+        width = match.captured (1).toInt ();
+        height = match.captured (2).toInt ();
+      }
+
+    engine->set_source (core::cv_engine::source::mapped);
+    engine->set_mapped_file (path, width, height);
+    if (!engine->open ())
+      {
+        qWarning() << "Cannot open mapped file";
+      }
+  });
+
+  connect(rb_sequence, &QRadioButton::toggled, this, [this] (bool on) {
+    if (!on)
+      return;
+    sb_camera_index->setEnabled (false);
+
+    const QString dir = QFileDialog::getExistingDirectory (this, tr ("Open image directory"));
+    if (dir.isEmpty ())
+      {
+        rb_image->setChecked (true);
+        return;
+      }
+
+    // nothing finer than the viewport is ever shown
+    const QSize limit = viewport->size () * viewport->devicePixelRatioF ();
+    engine->set_source (core::cv_engine::source::sequence);
+    engine->set_image_sequence (dir, limit.width (), limit.height ());
+    if (!engine->open ())
+      {
+        qWarning() << "Cannot open image sequence";
+      }
+  });
+
+  connect(rb_pipe, &QRadioButton::toggled, this, [this] (bool on) {
+    if (!on)
+      return;
+    sb_camera_index->setEnabled (false);
+    engine->set_source (core::cv_engine::source::pipe);
+    if (!engine->open ())
+      {
+        qWarning() << "Cannot open pipe";
+      }
   });
 
   connect (sb_camera_index, qOverload<int> (&QSpinBox::valueChanged), this, [this] (int idx) {
     if (!rb_camera->isChecked ()) 
       return;
     engine->set_camera_index (idx);
-    engine->open ();
+    engine->open_async ();
+  });
+
+  connect (cb_yuv, &QCheckBox::toggled, this, [this] (bool on) {
+    engine->set_native_yuv (on);
+    // the capture format is chosen when the camera opens
+    if (rb_camera->isChecked ())
+      engine->open_async ();
+  });
+
+  connect (cb_record, &QCheckBox::toggled, this, [this] (bool on) {
+    if (on)
+      engine->start_recording ("recording.avi", 1000.0 / timer.interval ());
+    else
+      engine->stop_recording ();
+    lb_record->clear ();
+  });
+
+  // replay with --replay session.log
+  connect (cb_session, &QCheckBox::toggled, this, [this] (bool on) {
+    if (!on)
+      {
+        engine->stop_session_log ();
+        return;
+      }
+    if (!engine->start_session_log ("session.log"))
+      {
+        cb_session->blockSignals (true);
+        cb_session->setChecked (false);
+        cb_session->blockSignals (false);
+      }
+  });
+
+  connect (cb_shm, &QCheckBox::toggled, this, [this] (bool on) {
+    if (!on)
+      {
+        engine->stop_shm_output ();
+        return;
+      }
+    if (!engine->start_shm_output ("/filtercv"))
+      {
+        cb_shm->blockSignals (true);
+        cb_shm->setChecked (false);
+        cb_shm->blockSignals (false);
+      }
+  });
+
+  connect (cb_trace, &QCheckBox::toggled, this, [this] (bool on) {
+    engine->set_tracing (on);
+    if (!on && !engine->dump_trace ("trace.json"))
+      {
+        qWarning() << "Cannot write trace.json";
+      }
+  });
+
+  connect (cb_alloc, &QCheckBox::toggled, this, [this] (bool on) {
+    engine->set_alloc_tracking (on);
+    lb_alloc->clear ();
+  });
+
+  connect (cb_incremental, &QCheckBox::toggled, this, [this] (bool on) {
+    engine->set_incremental (on);
+    lb_tiles->clear ();
+  });
+
+  connect (pb_render, &QPushButton::clicked, this, [this] {
+    if (render_thread.joinable ())
+      return;
+
+    // the render works on clones, so the live chain keeps running meanwhile
+    renderer = std::make_shared<core::offline_renderer> (engine->clone_graph ());
+    render_finished = false;
+    pb_render->setEnabled (false);
+    render_thread = std::thread ([this] {
+      if (!renderer->render ("../resources/rickroll.mp4", "render.avi"))
+        qWarning () << "Offline render failed";
+      render_finished = true;
+    });
+  });
+
+  connect (pb_still, &QPushButton::clicked, this, [this] {
+    if (still_thread.joinable ())
+      return;
+
+    const QString path = QFileDialog::getOpenFileName (this, tr ("Open large still"), QString (),
+                                                       tr ("Stills (*.ppm *.bgr *.raw);;All files (*)"));
+    if (path.isEmpty ())
+      return;
+
+    // raw stills carry no header, take the size from a name like scan_20000x20000.bgr
+    int width = 0, height = 0;
+    const auto match = QRegularExpression ("(\\d+)x(\\d+)").match (path.section ('/', -1));
+    if (match.hasMatch ())
+      {
+        width = match.captured (1).toInt ();
+        height = match.captured (2).toInt ();
+      }
+    const QString out_path = path.section ('.', 0, -2) + "_filtered.ppm";
+
+    still_renderer = std::make_shared<core::tiled_renderer> (engine->clone_graph ());
+    still_finished = false;
+    pb_still->setEnabled (false);
+    still_thread = std::thread ([this, in = path.toStdString (), out = out_path.toStdString (), width, height] {
+      if (!still_renderer->render (in, out, width, height))
+        qWarning () << "Tiled render failed";
+      still_finished = true;
+    });
   });
 }
 
@@ -575,6 +825,8 @@ void main_window::add_threshold_filter (QVBoxLayout *v, QWidget *panel)
   cb_threshold_mode->addItem ("Binary");
   cb_threshold_mode->addItem ("Adaptive Mean");
   cb_threshold_mode->addItem ("Adaptive Gaussian");
+  cb_threshold_mode->addItem ("Otsu");
+  cb_threshold_mode->addItem ("Triangle");
 
   auto *form = new QFormLayout ();
   form->setContentsMargins (0, 0, 0, 0);
@@ -939,8 +1191,9 @@ void main_window::add_affine_filter (QVBoxLayout *v, QWidget *panel)
 
 void main_window::show_test_image ()
 {
-  cv::Mat mat = cv::imread ("../resources/shrek.jpg", cv::IMREAD_UNCHANGED);
-  engine->set_test_image (mat);
+  // decoded off the GUI thread so the window shows up first, onTick hands
+  // it to the engine
+  test_image = std::async (std::launch::async, [] { return cv::imread ("../resources/shrek.jpg", cv::IMREAD_UNCHANGED); });
   engine->set_source (core::cv_engine::source::image);
 }
 
@@ -948,12 +1201,81 @@ void main_window::onTick ()
 {
   if (!engine) 
     return;
-  if (!engine->grab()) 
+
+  if (render_thread.joinable ())
+    {
+      const auto p = renderer->get_progress ();
+      lb_render->setText (tr ("%1/%2 frames, %3 fps")
+                            .arg (p.written).arg (p.total)
+                            .arg (p.fps, 0, 'f', 1));
+      if (render_finished)
+        {
+          render_thread.join ();
+          pb_render->setEnabled (true);
+        }
+    }
+
+  if (still_thread.joinable ())
+    {
+      const auto p = still_renderer->get_progress ();
+      lb_still->setText (tr ("%1/%2 tiles").arg (p.done).arg (p.total));
+      if (still_finished)
+        {
+          still_thread.join ();
+          pb_still->setEnabled (true);
+        }
+    }
+
+  if (test_image.valid () && test_image.wait_for (std::chrono::seconds (0)) == std::future_status::ready)
+    {
+      const cv::Mat mat = test_image.get ();
+      if (mat.empty ())
+        qWarning () << "Cannot load the test image";
+      engine->set_test_image (mat);
+    }
+
+  const bool grabbed = engine->grab ();
+  lb_source->setText (engine->source_status ().message);
+  if (!grabbed)
     return;
 
+  const QSize limit = viewport->size () * viewport->devicePixelRatioF ();
+  engine->set_preview_limit (limit.width (), limit.height ());
+
   const QImage img = engine->process();
   if (!img.isNull ()) 
     viewport->set_image (img);
+
+  if (engine->is_incremental ())
+    lb_tiles->setText (tr ("tiles reused %1%").arg (engine->tile_reuse () * 100.0, 0, 'f', 0));
+
+  if (engine->is_alloc_tracking ())
+    {
+      // figures of the last tick, so a filter in a steady state shows 0
+      auto stats = engine->alloc_stats ();
+      engine->reset_alloc_stats ();
+      std::sort (stats.begin (), stats.end (), [] (const auto &a, const auto &b) { return a.bytes > b.bytes; });
+      QStringList lines;
+      for (const auto &s : stats)
+        {
+          // allocations outside any filter have no calls to divide by
+          const double calls = static_cast<double> (std::max<std::uint64_t> (s.calls, 1));
+          lines << tr ("%1: %2 allocs, %3 KB per call, peak %4 KB")
+                     .arg (QString::fromStdString (s.owner))
+                     .arg (s.allocations / calls, 0, 'f', 1)
+                     .arg (s.bytes / calls / 1024.0, 0, 'f', 0)
+                     .arg (s.peak / 1024.0, 0, 'f', 0);
+        }
+      lb_alloc->setText (lines.join ('\n'));
+    }
+
+  if (engine->is_recording ())
+    {
+      const auto s = engine->recording_stats ();
+      lb_record->setText (tr ("queue %1/%2, written %3, dropped %4")
+                            .arg (s.queue_depth).arg (s.queue_capacity)
+                            .arg (s.written).arg (s.dropped));
+    }
 }
 
 }
@@ -1,15 +1,128 @@
 #include <QApplication>
+#include <QCommandLineParser>
+#include <QDebug>
+
+#include <cinttypes>
+#include <cstdio>
+#include <cstring>
+#include <memory>
 
 #include "globals.h"
+#include "core/session_log.h"
+#include "core/thread_pool.h"
 #include "gui/main_window.h"
 
+namespace
+{
+
+// "0-3,8,10" -> 0 1 2 3 8 10
+bool parse_cpus (const QString &text, std::vector<int> &cpus)
+{
+  for (const QString &part : text.split (',', Qt::SkipEmptyParts))
+    {
+      const QStringList range = part.split ('-');
+      bool ok_first = false, ok_last = false;
+      const int first = range.front ().toInt (&ok_first);
+      const int last = range.size () == 2 ? range.back ().toInt (&ok_last) : first;
+      if (!ok_first || (range.size () == 2 && !ok_last) || range.size () > 2 || first < 0 || last < first)
+        return false;
+      for (int cpu = first; cpu <= last; ++cpu)
+        cpus.push_back (cpu);
+    }
+  return !cpus.empty ();
+}
+
+// replaying needs no display, so it is decided before any application
+// object exists
+bool wants_replay (int argc, char *argv[])
+{
+  for (int i = 1; i < argc; ++i)
+    {
+      if (std::strcmp (argv[i], "--replay") == 0 || std::strncmp (argv[i], "--replay=", 9) == 0)
+        return true;
+    }
+  return false;
+}
+
+int replay (const QString &path)
+{
+  core::session_log::replay_result r;
+  if (!core::session_log::replay (path.toStdString (), r))
+    return 1;
+
+  std::printf ("%" PRIu64 " frames in %.1f ms: mean %.2f ms, p50 %.2f ms, p95 %.2f ms, max %.2f ms (frame %" PRIu64 ")\n",
+               r.frames, r.total_ms, r.mean_ms, r.p50_ms, r.p95_ms, r.max_ms, r.slowest_frame);
+  if (r.missing > 0)
+    std::printf ("%" PRIu64 " frames skipped, their input was never written\n", r.missing);
+  if (r.mismatched > 0)
+    std::printf ("%" PRIu64 " outputs differ from the recorded session\n", r.mismatched);
+  return 0;
+}
+
+}
+
 int main(int argc, char *argv[])
 {
-  QApplication app (argc, argv);
-  QApplication::setApplicationName (WINDOW_NAME);
+  const bool headless = wants_replay (argc, argv);
+  std::unique_ptr<QCoreApplication> app (headless ? new QCoreApplication (argc, argv) : new QApplication (argc, argv));
+  QCoreApplication::setApplicationName (WINDOW_NAME);
+
+  QCommandLineParser parser;
+  parser.setApplicationDescription ("Real-time image and video filtering playground");
+  parser.addHelpOption ();
+
+  const QCommandLineOption pipe_option ("pipe", "Read raw frames from <path> (\"-\" for stdin).", "path");
+  const QCommandLineOption width_option ("width", "Width of the piped frames.", "pixels");
+  const QCommandLineOption height_option ("height", "Height of the piped frames.", "pixels");
+  const QCommandLineOption format_option ("pix-fmt", "Pixel format of the piped frames: bgr24, rgb24, gray or yuv420p.",
+                                          "format", "bgr24");
+  const QCommandLineOption workers_option ("workers", "Threads in the shared pool used by filters, OpenCV and streams.",
+                                           "count");
+  const QCommandLineOption cpus_option ("cpus", "Pin the pool's threads to these cpus, e.g. 0-3,8.", "list");
+  const QCommandLineOption replay_option ("replay", "Run a logged session headless as fast as possible and print timings.",
+                                          "log");
+  parser.addOptions ({ pipe_option, width_option, height_option, format_option, workers_option, cpus_option,
+                       replay_option });
+  parser.process (*app);
+
+  // before anything touches the pool
+  core::thread_pool::options pool_options;
+  if (parser.isSet (workers_option))
+    pool_options.workers = parser.value (workers_option).toInt ();
+  if (parser.isSet (cpus_option) && !parse_cpus (parser.value (cpus_option), pool_options.cpus))
+    {
+      qCritical () << "Bad --cpus list" << parser.value (cpus_option);
+      return 1;
+    }
+  core::thread_pool::configure_shared (pool_options);
+  // created now, not by whatever first needs it, so OpenCV's loops run on
+  // the pool from the first frame on, linear chains included
+  core::thread_pool::shared ();
+
+  if (headless)
+    return replay (parser.value (replay_option));
 
   gui::main_window window;
+
+  if (parser.isSet (pipe_option))
+    {
+      const int width = parser.value (width_option).toInt ();
+      const int height = parser.value (height_option).toInt ();
+      core::pipe_source::pixel_format fmt;
+      if (width <= 0 || height <= 0)
+        {
+          qCritical () << "--pipe needs --width and --height";
+          return 1;
+        }
+      if (!core::pipe_source::parse_format (parser.value (format_option).toStdString (), fmt))
+        {
+          qCritical () << "Unknown --pix-fmt" << parser.value (format_option);
+          return 1;
+        }
+      window.use_pipe (parser.value (pipe_option), width, height, fmt);
+    }
+
   window.show ();
 
-  return app.exec ();
+  return app->exec ();
 }
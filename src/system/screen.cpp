@@ -10,6 +10,8 @@ namespace system_utils
 screen::screen ()
 {
   Display *display = XOpenDisplay (nullptr);
+  if (!display)
+    return;
 
   Window root = DefaultRootWindow (display);
 
@@ -43,6 +45,12 @@ screen::screen ()
   XCloseDisplay (display);
 }
 
+const screen &screen::primary ()
+{
+  static const screen s;
+  return s;
+}
+
 int screen::get_width () const { return width; }
 
 int screen::get_height () const { return height; }
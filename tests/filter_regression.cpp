@@ -0,0 +1,535 @@
+// Golden-image and timing regression harness for include/filters.
+//
+//   filter_regression golden --corpus <dir> --data <dir> [--update | --add-missing] [--only <name>]
+//   filter_regression timing --corpus <dir> --baseline <file> [--max-slowdown <pct>] [--update | --add-missing]
+//
+// --add-missing records only variants that have no golden or baseline entry
+// yet; tests/make_baseline.sh uses it to extend references taken from the
+// filters as they were before the optimisations.
+//
+// Exit codes: 0 pass, 1 failure (a missing golden included), 77 timing
+// skipped (no baseline on this machine yet).
+
+#include <opencv2/opencv.hpp>
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <filesystem>
+#include <fstream>
+#include <functional>
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "filters/grayscale.h"
+#include "filters/blur.h"
+#include "filters/canny.h"
+#include "filters/jpeg.h"
+#include "filters/sharpen.h"
+#include "filters/pixel_sort.h"
+#include "filters/threshold.h"
+#include "filters/morphology.h"
+#include "filters/contours.h"
+#include "filters/keypoints.h"
+#include "filters/affine.h"
+#include "filters/glitch.h"
+#include "filters/static_pipeline.h"
+#include "core/alloc_tracker.h"
+#include "core/pipeline_graph.h"
+
+namespace
+{
+
+constexpr int exit_skip = 77;
+
+struct input
+{
+  std::string name;
+  cv::Mat bgr;
+};
+
+struct variant
+{
+  std::string name;
+  std::function<std::shared_ptr<filters::filter> ()> make;
+  // outputs must reach min_psnr or stay within max_abs everywhere
+  double min_psnr;
+  double max_abs;
+};
+
+template <typename T, typename Fn>
+std::function<std::shared_ptr<filters::filter> ()> make (Fn fn)
+{
+  return [fn] {
+    auto f = std::make_shared<T> ();
+    f->set_enabled (true);
+    fn (*f);
+    return std::static_pointer_cast<filters::filter> (f);
+  };
+}
+
+// exact filters are compared bit for bit; codecs and feature detectors get
+// some slack because their output depends on the library build
+std::vector<variant> variants ()
+{
+  using namespace filters;
+  const double exact = 0.0;
+  const double inf = 1e9;
+
+  return {
+    { "grayscale", make<grayscale> ([] (grayscale &) {}), inf, exact },
+
+    { "blur_k3", make<blur> ([] (blur &f) { f.set_ksize (3); }), inf, exact },
+    { "blur_k9", make<blur> ([] (blur &f) { f.set_ksize (9); }), inf, exact },
+    { "blur_k21", make<blur> ([] (blur &f) { f.set_ksize (21); }), inf, exact },
+
+    { "canny_50_150", make<canny> ([] (canny &f) { f.set_thresholds (50, 150); }), inf, exact },
+    { "canny_10_60", make<canny> ([] (canny &f) { f.set_thresholds (10, 60); }), inf, exact },
+    { "canny_auto", make<canny> ([] (canny &f) { f.set_automatic (true); }), inf, exact },
+
+    { "jpeg_q80", make<jpeg> ([] (jpeg &f) { f.set_quality (80); }), 45.0, inf },
+    { "jpeg_q20", make<jpeg> ([] (jpeg &f) { f.set_quality (20); }), 40.0, inf },
+
+    { "sharpen_default", make<sharpen> ([] (sharpen &) {}), inf, exact },
+    { "sharpen_strong", make<sharpen> ([] (sharpen &f) {
+        f.set_amount (2.5);
+        f.set_radius (5);
+        f.set_threshold (0);
+      }), inf, exact },
+
+    { "pixel_sort_vertical", make<pixel_sort> ([] (pixel_sort &f) {
+        f.set_axis (pixel_sort::axis_t::vertical);
+        f.set_chunk (32);
+      }), inf, exact },
+    { "pixel_sort_horizontal_rev", make<pixel_sort> ([] (pixel_sort &f) {
+        f.set_axis (pixel_sort::axis_t::horizontal);
+        f.set_chunk (8);
+        f.set_stride (2);
+        f.set_reverse (true);
+      }), inf, exact },
+
+    { "threshold_binary", make<threshold> ([] (threshold &f) { f.set_thresh (128); }), inf, exact },
+    { "threshold_adaptive_mean", make<threshold> ([] (threshold &f) {
+        f.set_mode (threshold::mode_t::adaptive_mean);
+        f.set_block_size (11);
+        f.set_c (2);
+      }), inf, exact },
+    { "threshold_adaptive_gaussian", make<threshold> ([] (threshold &f) {
+        f.set_mode (threshold::mode_t::adaptive_gaussian);
+        f.set_block_size (21);
+        f.set_c (5);
+      }), inf, exact },
+    { "threshold_otsu", make<threshold> ([] (threshold &f) { f.set_mode (threshold::mode_t::otsu); }), inf, exact },
+    { "threshold_triangle", make<threshold> ([] (threshold &f) { f.set_mode (threshold::mode_t::triangle); }), inf, exact },
+
+    { "morphology_open_3", make<morphology> ([] (morphology &f) {
+        f.set_op (morphology::op_t::open);
+        f.set_kernel_size (3);
+      }), inf, exact },
+    { "morphology_close_5x2", make<morphology> ([] (morphology &f) {
+        f.set_op (morphology::op_t::close);
+        f.set_kernel_size (5);
+        f.set_iterations (2);
+      }), inf, exact },
+    { "morphology_erode_7", make<morphology> ([] (morphology &f) {
+        f.set_op (morphology::op_t::erode);
+        f.set_kernel_size (7);
+      }), inf, exact },
+
+    { "contours_approx", make<contours> ([] (contours &) {}), inf, exact },
+    { "contours_raw", make<contours> ([] (contours &f) { f.set_draw_approx (false); }), inf, exact },
+
+    { "keypoints_fast", make<keypoints> ([] (keypoints &f) {
+        f.set_detector (keypoints::detector_t::fast);
+      }), 30.0, inf },
+    { "keypoints_orb", make<keypoints> ([] (keypoints &f) {
+        f.set_detector (keypoints::detector_t::orb);
+      }), 30.0, inf },
+
+    { "affine_rotate", make<affine> ([] (affine &f) {
+        f.set_angle (15.0);
+        f.set_scale (1.2);
+        f.set_tx (20);
+        f.set_ty (-10);
+      }), inf, 1.0 },
+
+    { "glitch_10", make<glitch> ([] (glitch &f) { f.set_strength (10); }), 40.0, inf },
+    { "glitch_30", make<glitch> ([] (glitch &f) { f.set_strength (30); }), 40.0, inf },
+
+    // exact: the fused grayscale + threshold loop reproduces cvtColor and
+    // cv::threshold bit for bit
+    { "static_gray_threshold_open", make<static_pipeline<grayscale, threshold, morphology>> ([] (auto &f) {
+        f.template get<grayscale> ().set_enabled (true);
+        f.template get<threshold> ().set_enabled (true);
+        f.template get<threshold> ().set_thresh (100);
+        f.template get<morphology> ().set_enabled (true);
+      }), inf, exact },
+  };
+}
+
+// shrek.jpg at two sizes plus patterns that stress edges, gradients and noise
+std::vector<input> corpus (const std::string &dir)
+{
+  std::vector<input> out;
+
+  const cv::Mat shrek = cv::imread (dir + "/shrek.jpg", cv::IMREAD_COLOR);
+  if (!shrek.empty ())
+    {
+      cv::Mat a, b;
+      cv::resize (shrek, a, cv::Size (640, 480), 0, 0, cv::INTER_AREA);
+      cv::resize (shrek, b, cv::Size (317, 211), 0, 0, cv::INTER_AREA);
+      out.push_back ({ "shrek_640", a });
+      out.push_back ({ "shrek_odd", b });
+    }
+
+  cv::Mat gradient (240, 320, CV_8UC3);
+  for (int y = 0; y < gradient.rows; ++y)
+    for (int x = 0; x < gradient.cols; ++x)
+      gradient.at<cv::Vec3b> (y, x) = cv::Vec3b (static_cast<uchar> (x * 255 / 319),
+                                                 static_cast<uchar> (y * 255 / 239),
+                                                 static_cast<uchar> ((x + y) & 255));
+  out.push_back ({ "gradient", gradient });
+
+  cv::Mat checker (240, 320, CV_8UC3);
+  for (int y = 0; y < checker.rows; ++y)
+    for (int x = 0; x < checker.cols; ++x)
+      checker.at<cv::Vec3b> (y, x) = ((x / 16 + y / 16) % 2) ? cv::Vec3b (255, 255, 255) : cv::Vec3b (0, 0, 0);
+  cv::circle (checker, cv::Point (160, 120), 60, cv::Scalar (0, 0, 255), -1);
+  out.push_back ({ "checker", checker });
+
+  cv::Mat noise (240, 320, CV_8UC3);
+  cv::RNG rng (12345);
+  rng.fill (noise, cv::RNG::UNIFORM, 0, 256);
+  out.push_back ({ "noise", noise });
+
+  return out;
+}
+
+double psnr (const cv::Mat &a, const cv::Mat &b)
+{
+  const double mse = cv::norm (a, b, cv::NORM_L2SQR) / static_cast<double> (a.total () * a.channels ());
+  return mse == 0.0 ? 1e9 : 10.0 * std::log10 (255.0 * 255.0 / mse);
+}
+
+int run_golden (const std::vector<input> &inputs, const std::string &data, bool update, bool add_missing,
+                const std::string &only)
+{
+  namespace fs = std::filesystem;
+  if (add_missing)
+    update = true;
+  if (update)
+    fs::create_directories (data);
+
+  int failures = 0;
+  int compared = 0;
+  int missing = 0;
+  for (const auto &v : variants ())
+    {
+      if (!only.empty () && v.name.rfind (only, 0) != 0)
+        continue;
+
+      auto f = v.make ();
+      for (const auto &in : inputs)
+        {
+          cv::Mat out;
+          f->apply (in.bgr, out);
+
+          const std::string path = data + "/" + v.name + "__" + in.name + ".png";
+          if (add_missing && fs::exists (path))
+            continue;
+          if (update)
+            {
+              if (!cv::imwrite (path, out))
+                {
+                  std::fprintf (stderr, "cannot write %s\n", path.c_str ());
+                  ++failures;
+                }
+              continue;
+            }
+
+          const cv::Mat golden = cv::imread (path, cv::IMREAD_UNCHANGED);
+          if (golden.empty ())
+            {
+              ++missing;
+              continue;
+            }
+          ++compared;
+
+          if (golden.size () != out.size () || golden.type () != out.type ())
+            {
+              std::fprintf (stderr, "FAIL %s on %s: %dx%d type %d, golden %dx%d type %d\n",
+                            v.name.c_str (), in.name.c_str (), out.cols, out.rows, out.type (),
+                            golden.cols, golden.rows, golden.type ());
+              ++failures;
+              continue;
+            }
+
+          const double max_abs = cv::norm (out, golden, cv::NORM_INF);
+          const double p = psnr (out, golden);
+          if (max_abs > v.max_abs || p < v.min_psnr)
+            {
+              std::fprintf (stderr, "FAIL %s on %s: max abs %.0f, psnr %.2f dB\n",
+                            v.name.c_str (), in.name.c_str (), max_abs, p);
+              ++failures;
+            }
+        }
+    }
+
+  if (update)
+    {
+      std::printf ("goldens written to %s\n", data.c_str ());
+      return failures ? 1 : 0;
+    }
+  // an output without a reference proves nothing, so it fails rather than
+  // skips; tests/make_baseline.sh writes the references
+  if (missing)
+    std::fprintf (stderr, "FAIL %d outputs have no golden in %s, run tests/make_baseline.sh\n", missing, data.c_str ());
+
+  std::printf ("%d comparisons, %d failures\n", compared, failures + missing);
+  return failures || missing ? 1 : 0;
+}
+
+std::map<std::string, double> read_baseline (const std::string &path)
+{
+  std::map<std::string, double> out;
+  std::ifstream in (path);
+  std::string name;
+  double ms;
+  while (in >> name >> ms)
+    out[name] = ms;
+  return out;
+}
+
+int run_timing (const std::vector<input> &inputs, const std::string &baseline_path,
+                double max_slowdown, bool update, bool add_missing)
+{
+  using clock = std::chrono::steady_clock;
+  constexpr int runs = 9;
+  // differences below this are scheduler noise, not regressions
+  constexpr double slack_ms = 0.05;
+
+  const cv::Mat &frame = inputs.front ().bgr;
+  const auto baseline = read_baseline (baseline_path);
+  if (add_missing)
+    update = true;
+  if (!update && baseline.empty ())
+    {
+      std::printf ("no timing baseline at %s, run with --update first\n", baseline_path.c_str ());
+      return exit_skip;
+    }
+
+  // allocations per call are reported next to the times, not compared
+  core::alloc_tracker::instance ().enable (true);
+
+  std::map<std::string, double> measured;
+  int failures = 0;
+  for (const auto &v : variants ())
+    {
+      auto f = v.make ();
+      cv::Mat out;
+      f->apply (frame, out);
+
+      // after the first call; the fresh dst of every run is one of them
+      core::alloc_tracker::scope allocs (v.name.c_str ());
+      std::vector<double> times;
+      for (int i = 0; i < runs; ++i)
+        {
+          cv::Mat dst;
+          const auto t0 = clock::now ();
+          f->apply (frame, dst);
+          times.push_back (std::chrono::duration<double, std::milli> (clock::now () - t0).count ());
+        }
+      std::nth_element (times.begin (), times.begin () + runs / 2, times.end ());
+      const double median = times[runs / 2];
+      measured[v.name] = median;
+
+      char churn[64];
+      std::snprintf (churn, sizeof (churn), "%6.1f allocs %9.1f KB/call",
+                     static_cast<double> (allocs.allocations ()) / runs,
+                     static_cast<double> (allocs.bytes ()) / runs / 1024.0);
+
+      const auto it = baseline.find (v.name);
+      if (add_missing && it != baseline.end ())
+        measured[v.name] = it->second;
+      if (update || it == baseline.end ())
+        {
+          std::printf ("%-28s %8.3f ms %s\n", v.name.c_str (), median, churn);
+          continue;
+        }
+
+      const double limit = it->second * (1.0 + max_slowdown / 100.0) + slack_ms;
+      const bool slow = median > limit;
+      std::printf ("%-28s %8.3f ms (baseline %.3f) %s%s\n", v.name.c_str (), median, it->second, churn,
+                   slow ? "  SLOWER" : "");
+      failures += slow;
+    }
+
+  if (update)
+    {
+      const auto parent = std::filesystem::path (baseline_path).parent_path ();
+      if (!parent.empty ())
+        std::filesystem::create_directories (parent);
+      std::ofstream out (baseline_path);
+      for (const auto &[name, ms] : measured)
+        out << name << ' ' << ms << '\n';
+      if (!out)
+        {
+          std::fprintf (stderr, "cannot write %s\n", baseline_path.c_str ());
+          return 1;
+        }
+      std::printf ("baseline written to %s\n", baseline_path.c_str ());
+      return 0;
+    }
+
+  return failures ? 1 : 0;
+}
+
+// pipeline_graph::run_batch against one pipeline_graph::run per frame over
+// the same chain: outputs must match, throughput of both is reported
+int run_batch (const std::vector<input> &inputs, const std::string &chain_names, int batch)
+{
+  using clock = std::chrono::steady_clock;
+  constexpr int runs = 5;
+
+  std::vector<std::shared_ptr<filters::filter>> chain;
+  const auto all = variants ();
+  std::size_t pos = 0;
+  while (pos <= chain_names.size ())
+    {
+      const std::size_t comma = std::min (chain_names.find (',', pos), chain_names.size ());
+      const std::string name = chain_names.substr (pos, comma - pos);
+      pos = comma + 1;
+      const auto it = std::find_if (all.begin (), all.end (), [&name] (const variant &v) { return v.name == name; });
+      if (it == all.end ())
+        {
+          std::fprintf (stderr, "unknown variant %s\n", name.c_str ());
+          return 2;
+        }
+      chain.push_back (it->make ());
+    }
+
+  // the corpus at one size, repeated until the batch is full
+  std::vector<cv::Mat> frames;
+  for (int i = 0; i < batch; ++i)
+    {
+      cv::Mat f;
+      cv::resize (inputs[i % inputs.size ()].bgr, f, cv::Size (640, 480), 0, 0, cv::INTER_AREA);
+      frames.push_back (f);
+    }
+
+  // the same chain run the way cv_engine and the offline renderer run it
+  core::pipeline_graph graph;
+  for (auto &f : chain)
+    graph.set_output (graph.add_filter (f, graph.output ()));
+
+  // outputs are copied out in both orders so the graph's buffers are free
+  // again for the next run, as in the engine
+  auto frame_major = [&] (std::vector<cv::Mat> &out) {
+    for (std::size_t i = 0; i < frames.size (); ++i)
+      graph.run (frames[i]).copyTo (out[i]);
+  };
+
+  auto filter_major = [&] (std::vector<cv::Mat> &out) {
+    const std::vector<cv::Mat> results = graph.run_batch (frames);
+    for (std::size_t i = 0; i < frames.size (); ++i)
+      results[i].copyTo (out[i]);
+  };
+
+  auto measure = [&] (const auto &order, std::vector<cv::Mat> &out) {
+    std::vector<double> times;
+    for (int r = 0; r < runs; ++r)
+      {
+        const auto t0 = clock::now ();
+        order (out);
+        times.push_back (std::chrono::duration<double> (clock::now () - t0).count ());
+      }
+    std::nth_element (times.begin (), times.begin () + runs / 2, times.end ());
+    return frames.size () / times[runs / 2];
+  };
+
+  std::vector<cv::Mat> a (frames.size ()), b (frames.size ());
+  const double fps_frame = measure (frame_major, a);
+  const double fps_filter = measure (filter_major, b);
+
+  int mismatches = 0;
+  for (std::size_t i = 0; i < frames.size (); ++i)
+    mismatches += a[i].size () != b[i].size () || cv::norm (a[i], b[i], cv::NORM_INF) != 0.0;
+
+  std::printf ("%-14s %8.1f fps\n%-14s %8.1f fps (%+.1f%%)\n", "frame-major", fps_frame, "filter-major", fps_filter,
+               (fps_filter / fps_frame - 1.0) * 100.0);
+  if (mismatches)
+    std::printf ("%d of %zu frames differ between the two orders\n", mismatches, frames.size ());
+  return mismatches ? 1 : 0;
+}
+
+}
+
+int main (int argc, char *argv[])
+{
+  if (argc < 2)
+    {
+      std::fprintf (stderr, "usage: %s golden|timing|batch [options]\n", argv[0]);
+      return 2;
+    }
+
+  const std::string mode = argv[1];
+  std::string corpus_dir = "resources";
+  std::string data_dir = "tests/golden";
+  std::string baseline = "tests/baseline/timings.txt";
+  std::string only;
+  double max_slowdown = 25.0;
+  bool update = false;
+  bool add_missing = false;
+  std::string chain = "blur_k3,sharpen_default,morphology_open_3,keypoints_orb,jpeg_q80";
+  int batch = 8;
+
+  for (int i = 2; i < argc; ++i)
+    {
+      const std::string arg = argv[i];
+      const bool has_value = i + 1 < argc;
+      if (arg == "--update")
+        update = true;
+      else if (arg == "--add-missing")
+        add_missing = true;
+      else if (arg == "--corpus" && has_value)
+        corpus_dir = argv[++i];
+      else if (arg == "--data" && has_value)
+        data_dir = argv[++i];
+      else if (arg == "--baseline" && has_value)
+        baseline = argv[++i];
+      else if (arg == "--only" && has_value)
+        only = argv[++i];
+      else if (arg == "--max-slowdown" && has_value)
+        max_slowdown = std::atof (argv[++i]);
+      else if (arg == "--chain" && has_value)
+        chain = argv[++i];
+      else if (arg == "--batch" && has_value)
+        batch = std::max (1, std::atoi (argv[++i]));
+      else
+        {
+          std::fprintf (stderr, "unknown argument %s\n", arg.c_str ());
+          return 2;
+        }
+    }
+
+  // results must not depend on how many cores the machine has
+  cv::setNumThreads (1);
+
+  const auto inputs = corpus (corpus_dir);
+  if (inputs.empty ())
+    return 1;
+
+  if (mode == "golden")
+    return run_golden (inputs, data_dir, update, add_missing, only);
+  if (mode == "timing")
+    return run_timing (inputs, baseline, max_slowdown, update, add_missing);
+  if (mode == "batch")
+    return run_batch (inputs, chain, batch);
+
+  std::fprintf (stderr, "unknown mode %s\n", mode.c_str ());
+  return 2;
+}
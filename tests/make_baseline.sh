@@ -0,0 +1,30 @@
+#!/bin/sh
+# Writes tests/golden and tests/baseline/timings.txt from the filters as they
+# were when the harness was added, before the optimisations that followed,
+# then adds references for variants introduced since with the current tree.
+#
+#   tests/make_baseline.sh [revision]
+#
+# Needs the same toolchain as the main build (Qt 6, OpenCV). Commit the
+# result; timings are only comparable on the machine that wrote them.
+set -eu
+
+root=$(git -C "$(dirname "$0")" rev-parse --show-toplevel)
+cd "$root"
+
+rev=${1:-$(git log --diff-filter=A --format=%H -- tests/filter_regression.cpp | tail -n 1)}
+work=$(mktemp -d)
+trap 'git worktree remove --force "$work/src" >/dev/null 2>&1 || true; rm -rf "$work"' EXIT
+
+git worktree add --detach "$work/src" "$rev" >/dev/null
+cmake -S "$work/src" -B "$work/old" -DCMAKE_BUILD_TYPE=Release -DFILTERCV_BUILD_TESTS=ON >/dev/null
+cmake --build "$work/old" --target filter_regression -j"$(nproc)"
+
+cmake -S . -B "$work/new" -DCMAKE_BUILD_TYPE=Release -DFILTERCV_BUILD_TESTS=ON >/dev/null
+cmake --build "$work/new" --target filter_regression -j"$(nproc)"
+
+rm -rf tests/golden tests/baseline
+"$work/old/tests/filter_regression" golden --corpus resources --data tests/golden --update
+"$work/old/tests/filter_regression" timing --corpus resources --baseline tests/baseline/timings.txt --update
+"$work/new/tests/filter_regression" golden --corpus resources --data tests/golden --add-missing
+"$work/new/tests/filter_regression" timing --corpus resources --baseline tests/baseline/timings.txt --add-missing